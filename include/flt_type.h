@@ -31,6 +31,7 @@ typedef float flt_type;
 #define flt_pow   powf
 #define flt_sin   sinf
 #define flt_cos   cosf
+#define flt_acos  acosf
 #define flt_sqrt  sqrtf
 
 #elif FLT_TYPE_DOUBLE
@@ -51,6 +52,7 @@ typedef double flt_type;
 #define flt_pow   pow
 #define flt_sin   sin
 #define flt_cos   cos
+#define flt_acos  acos
 #define flt_sqrt  sqrt
 
 #elif FLT_TYPE_LONG_DOUBLE
@@ -71,6 +73,7 @@ typedef long double flt_type;
 #define flt_pow   powl
 #define flt_sin   sinl
 #define flt_cos   cosl
+#define flt_acos  acosl
 #define flt_sqrt  sqrtl
 
 #endif
@@ -0,0 +1,322 @@
+#include "accel.h"
+#include "bvh.h"
+#include "geometry.h"
+#include "primitives.h"
+#include "scene.h"
+
+#ifdef WITH_OBJ
+  #include "obj_model.h"
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+
+aabb_t get_object_bounds(const object_t *object) {
+  assert(object);
+
+  aabb_t bounds = aabb_empty();
+
+  switch (object->type) {
+  case SPHERE: {
+    const sphere_t *sphere = object->data;
+    vec3f radius = get_vec3f(sphere->radius, sphere->radius, sphere->radius);
+    bounds.min   = vec3f_sub(sphere->center, radius);
+    bounds.max   = vec3f_add(sphere->center, radius);
+    break;
+  }
+  case TRIANGLE: {
+    const triangle_t *triangle = object->data;
+    bounds                     = aabb_add_point(bounds, triangle->a);
+    bounds                     = aabb_add_point(bounds, triangle->b);
+    bounds                     = aabb_add_point(bounds, triangle->c);
+    break;
+  }
+#ifdef WITH_OBJ
+  case OBJ_MODEL: {
+    const model_t *model = object->data;
+    bounds               = model->bounds;
+    break;
+  }
+#endif
+  default:
+    assert(0 && "object has no finite bounds!");
+    break;
+  }
+
+  return bounds;
+}
+
+
+
+// order of kinds inside a leaf
+int object_kind_rank(const object_t *object) {
+  switch (object->type) {
+  case SPHERE:
+    return 0;
+  case TRIANGLE:
+    return 1;
+  default:
+    return 2;
+  }
+}
+
+void sort_leaf_by_kind(const scene_pack_t *pack, const scene_accel_t *accel,
+                       const bvh_node_t *leaf) {
+  int *prims = accel->bvh.prims;
+  for (int i = leaf->first + 1; i < leaf->first + leaf->count; ++i) {
+    int prim = prims[i];
+    int rank = object_kind_rank(&pack->objects[accel->objects[prim]]);
+    int j    = i - 1;
+    while ((j >= leaf->first) &&
+           (object_kind_rank(&pack->objects[accel->objects[prims[j]]]) >
+            rank)) {
+      prims[j + 1] = prims[j];
+      j--;
+    }
+    prims[j + 1] = prim;
+  }
+}
+
+aabb_t *get_prims_bounds(const scene_pack_t *pack, const scene_accel_t *accel) {
+  aabb_t *bounds = malloc(accel->n_objects * sizeof(aabb_t) + 1);
+  if (bounds != NULL) {
+    for (int i = 0; i < accel->n_objects; ++i) {
+      bounds[i] = get_object_bounds(&pack->objects[accel->objects[i]]);
+    }
+  }
+  return bounds;
+}
+
+// lay out geometry of the BVH primitives into SoA arrays leaf by leaf, so the
+// primitives of every leaf make contiguous ranges for the SIMD kernels; the
+// leaves should be sorted by kind already
+void lay_out_leaves(const scene_pack_t *pack, scene_accel_t *accel) {
+  int n_spheres   = 0;
+  int n_triangles = 0;
+  accel->n_models = 0;
+
+  for (int node_idx = 0; node_idx < accel->bvh.n_nodes; ++node_idx) {
+    const bvh_node_t *node = &accel->bvh.nodes[node_idx];
+    if (node->count == 0) {
+      continue;
+    }
+
+    accel_leaf_t *leaf   = &accel->leaves[node_idx];
+    leaf->first_sphere   = n_spheres;
+    leaf->first_triangle = n_triangles;
+    leaf->first_model    = accel->n_models;
+
+    for (int i = node->first; i < node->first + node->count; ++i) {
+      int       object_idx = accel->objects[accel->bvh.prims[i]];
+      object_t *object     = &pack->objects[object_idx];
+
+      switch (object->type) {
+      case SPHERE:
+        set_soa_sphere(&accel->spheres, n_spheres, object->data);
+        accel->sphere_materials[n_spheres++] = object->mtrl_idx;
+        break;
+      case TRIANGLE:
+        set_soa_triangle(&accel->triangles, n_triangles, object->data);
+        accel->triangle_normals[n_triangles] =
+            get_triangle_normal(object->data);
+        accel->triangle_materials[n_triangles++] = object->mtrl_idx;
+        break;
+      default:
+        accel->models[accel->n_models]            = object->data;
+        accel->model_materials[accel->n_models++] = object->mtrl_idx;
+        break;
+      }
+    }
+
+    leaf->n_spheres   = n_spheres - leaf->first_sphere;
+    leaf->n_triangles = n_triangles - leaf->first_triangle;
+    leaf->n_models    = accel->n_models - leaf->first_model;
+  }
+}
+
+int compile_accel_leaves(const scene_pack_t *pack, scene_accel_t *accel) {
+  int n_spheres   = 0;
+  int n_triangles = 0;
+  for (int i = 0; i < accel->n_objects; ++i) {
+    enum object_type_t type = pack->objects[accel->objects[i]].type;
+    n_spheres += (type == SPHERE);
+    n_triangles += (type == TRIANGLE);
+  }
+  int n_models = accel->n_objects - n_spheres - n_triangles;
+
+  accel->leaves = calloc(accel->bvh.n_nodes + 1, sizeof(accel_leaf_t));
+  accel->sphere_materials   = malloc(n_spheres * sizeof(int) + 1);
+  accel->triangle_normals   = malloc(n_triangles * sizeof(vec3f) + 1);
+  accel->triangle_materials = malloc(n_triangles * sizeof(int) + 1);
+  accel->models             = malloc(n_models * sizeof(void *) + 1);
+  accel->model_materials    = malloc(n_models * sizeof(int) + 1);
+  if ((accel->leaves == NULL) || (accel->sphere_materials == NULL) ||
+      (accel->triangle_normals == NULL) ||
+      (accel->triangle_materials == NULL) || (accel->models == NULL) ||
+      (accel->model_materials == NULL) ||
+      alloc_spheres_soa(&accel->spheres, n_spheres) ||
+      alloc_triangles_soa(&accel->triangles, n_triangles)) {
+    return -1;
+  }
+
+  for (int node_idx = 0; node_idx < accel->bvh.n_nodes; ++node_idx) {
+    const bvh_node_t *node = &accel->bvh.nodes[node_idx];
+    if (node->count != 0) {
+      sort_leaf_by_kind(pack, accel, node);
+    }
+  }
+
+  lay_out_leaves(pack, accel);
+  return 0;
+}
+
+
+
+void compile_plane(accel_plane_t *compiled, const object_t *object) {
+  const plane_t *plane = object->data;
+  compiled->n          = plane->n;
+  compiled->dist       = vec3f_scalar_mul(plane->r0, plane->n);
+  compiled->material   = object->mtrl_idx;
+}
+
+// lights and materials are copied to make the compiled scene self-contained
+int compile_lights_and_materials(const scene_pack_t *pack, int scene_idx,
+                                 scene_accel_t *accel) {
+  const scene_t *scene = &pack->scenes[scene_idx];
+
+  accel->materials = malloc(pack->n_materials * sizeof(material_t) + 1);
+  accel->lights    = malloc(scene->n_lights * sizeof(light_t) + 1);
+  if ((accel->materials == NULL) || (accel->lights == NULL)) {
+    return -1;
+  }
+
+  for (int i = 0; i < pack->n_materials; ++i) {
+    accel->materials[i] = pack->materials[i];
+  }
+  accel->n_materials = pack->n_materials;
+
+  accel->n_lights = 0;
+  for (int i = 0; i < scene->n_lights; ++i) {
+    int light_idx = scene->lights[i];
+    if ((light_idx < 0) || (light_idx >= pack->n_lights)) {
+      fprintf(stderr, "scene #%d: light #%d doesn't exist and is skipped\n",
+              scene_idx, light_idx);
+      continue;
+    }
+
+    accel->lights[accel->n_lights++] = pack->lights[light_idx];
+  }
+
+  return 0;
+}
+
+scene_accel_t *build_scene_accel(const scene_pack_t *pack, int scene_idx) {
+  assert(pack);
+  assert(scene_idx < pack->n_scenes);
+
+  const scene_t *scene = &pack->scenes[scene_idx];
+
+  scene_accel_t *accel = calloc(1, sizeof(scene_accel_t));
+  assert(accel);
+  accel->objects       = malloc(scene->n_objects * sizeof(int) + 1);
+  accel->n_objects     = 0;
+  accel->planes        = malloc(scene->n_objects * sizeof(accel_plane_t) + 1);
+  accel->plane_objects = malloc(scene->n_objects * sizeof(int) + 1);
+  accel->n_planes      = 0;
+  accel->n_users       = 1;
+  assert(accel->objects && accel->planes && accel->plane_objects);
+
+  for (int i = 0; i < scene->n_objects; ++i) {
+    int object_idx = scene->objects[i];
+    if ((object_idx < 0) || (object_idx >= pack->n_objects)) {
+      fprintf(stderr, "scene #%d: object #%d doesn't exist and is skipped\n",
+              scene_idx, object_idx);
+      continue;
+    }
+
+    const object_t *object = &pack->objects[object_idx];
+    if ((object->mtrl_idx < 0) || (object->mtrl_idx >= pack->n_materials)) {
+      fprintf(stderr,
+              "scene #%d: object #%d has no material #%d and is skipped\n",
+              scene_idx, object_idx, object->mtrl_idx);
+      continue;
+    }
+
+    if (object->type == PLANE) {
+      accel->plane_objects[accel->n_planes] = object_idx;
+      compile_plane(&accel->planes[accel->n_planes++], object);
+    } else {
+      accel->objects[accel->n_objects++] = object_idx;
+    }
+  }
+
+  aabb_t *bounds = get_prims_bounds(pack, accel);
+  assert(bounds);
+
+  if (bvh_build(&accel->bvh, bounds, accel->n_objects) != 0) {
+    fprintf(stderr, "scene #%d: BVH build failed\n", scene_idx);
+    free(bounds);
+    free_scene_accel(accel);
+    return NULL;
+  }
+
+  free(bounds);
+
+  if ((compile_accel_leaves(pack, accel) != 0) ||
+      (compile_lights_and_materials(pack, scene_idx, accel) != 0)) {
+    fprintf(stderr, "scene #%d: out of memory\n", scene_idx);
+    free_scene_accel(accel);
+    return NULL;
+  }
+
+  return accel;
+}
+
+int refit_scene_accel(const scene_pack_t *pack, scene_accel_t *accel) {
+  assert(pack);
+  assert(accel);
+
+  aabb_t *bounds = get_prims_bounds(pack, accel);
+  if (bounds == NULL) {
+    return -1;
+  }
+
+  bvh_refit(&accel->bvh, bounds);
+  free(bounds);
+
+  lay_out_leaves(pack, accel);
+  for (int i = 0; i < accel->n_planes; ++i) {
+    compile_plane(&accel->planes[i], &pack->objects[accel->plane_objects[i]]);
+  }
+
+  return 0;
+}
+
+scene_accel_t *share_scene_accel(scene_accel_t *accel) {
+  assert(accel);
+  accel->n_users++;
+  return accel;
+}
+
+void free_scene_accel(scene_accel_t *accel) {
+  if ((accel != NULL) && (--accel->n_users == 0)) {
+    bvh_free(&accel->bvh);
+    free(accel->objects);
+    free(accel->leaves);
+    free_spheres_soa(&accel->spheres);
+    free(accel->sphere_materials);
+    free_triangles_soa(&accel->triangles);
+    free(accel->triangle_normals);
+    free(accel->triangle_materials);
+    free(accel->models);
+    free(accel->model_materials);
+    free(accel->planes);
+    free(accel->plane_objects);
+    free(accel->materials);
+    free(accel->lights);
+    free(accel);
+  }
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "bvh.h"
+#include "primitives.h"
+#include "scene.h"
+
+
+
+// primitives of a BVH leaf grouped by kind: ranges in the SoA arrays and in
+// the list of models
+typedef struct {
+  int first_sphere;
+  int n_spheres;
+  int first_triangle;
+  int n_triangles;
+  int first_model;
+  int n_models;
+} accel_leaf_t;
+
+typedef enum {
+  NO_PRIM,
+  SPHERE_PRIM,
+  TRIANGLE_PRIM,
+  MODEL_PRIM,
+  PLANE_PRIM,
+} prim_kind_t;
+
+// primitive of a compiled scene: index in the arrays of its kind
+typedef struct {
+  prim_kind_t kind;
+  int         idx;
+} prim_ref_t;
+
+// 'dist' is the precomputed r0 * n
+typedef struct {
+  vec3f    n;
+  flt_type dist;
+  int      material;
+} accel_plane_t;
+
+// compiled scene: everything the renderer needs, grouped by kind and laid out
+// flat, so nothing is reached through 'object_t' while rendering; it is built
+// once and only refitted afterwards when the objects move
+typedef struct scene_accel_t {
+  bvh_t bvh;
+
+  // pack object index of each BVH primitive
+  int *objects;
+  int  n_objects;
+
+  // indexed by BVH node, only leaves are filled
+  accel_leaf_t *leaves;
+
+  // geometry of the BVH primitives laid out in leaves order with the index in
+  // 'materials' of each element; 'models' are 'model_t' which is known only
+  // with WITH_OBJ
+  spheres_soa_t   spheres;
+  int *           sphere_materials;
+  triangles_soa_t triangles;
+  vec3f *         triangle_normals;
+  int *           triangle_materials;
+  void **         models;
+  int *           model_materials;
+  int             n_models;
+
+  accel_plane_t *planes;
+  int *          plane_objects;
+  int            n_planes;
+
+  // copies of the pack materials and of the scene lights
+  material_t *materials;
+  int         n_materials;
+  light_t *   lights;
+  int         n_lights;
+
+  // scenes sharing the compiled scene, it is freed along with the last one
+  int n_users;
+} scene_accel_t;
+
+
+
+scene_accel_t *build_scene_accel(const scene_pack_t *pack, int scene_idx);
+scene_accel_t *share_scene_accel(scene_accel_t *accel);
+
+// objects of the pack have moved, but the scene keeps the same set of them:
+// the BVH is refitted and the geometry is laid out anew in the same places
+int refit_scene_accel(const scene_pack_t *pack, scene_accel_t *accel);
+void           free_scene_accel(scene_accel_t *accel);
+
+aabb_t get_object_bounds(const object_t *object);
@@ -0,0 +1,289 @@
+#include "animation.h"
+#include "accel.h"
+#include "geometry.h"
+#include "scene.h"
+
+#ifdef WITH_OBJ
+  #include "obj_model.h"
+#endif
+
+#include "flt_type.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+
+// turn by the angle about the vertical axis through 'pivot', then 'shift'
+typedef struct {
+  vec3f    pivot;
+  vec3f    shift;
+  flt_type cos;
+  flt_type sin;
+} transform_t;
+
+
+
+vec3f lerp_vec3f(vec3f from, vec3f to, flt_type t) {
+  return vec3f_add(from, vec3f_mul(vec3f_sub(to, from), t));
+}
+
+// the direction turns at a steady rate along the great circle and the length
+// goes linearly; directions of zero length or of opposite ways have no circle
+// to turn along, they are lerped
+vec3f slerp_vec3f(vec3f from, vec3f to, flt_type t) {
+  const flt_type epsilon  = 1e-4;
+  flt_type       from_len = vec3f_norm(from);
+  flt_type       to_len   = vec3f_norm(to);
+  if ((from_len < epsilon) || (to_len < epsilon)) {
+    return lerp_vec3f(from, to, t);
+  }
+
+  vec3f    from_dir  = vec3f_mul(from, 1 / from_len);
+  vec3f    to_dir    = vec3f_mul(to, 1 / to_len);
+  flt_type cos_angle = vec3f_scalar_mul(from_dir, to_dir);
+  flt_type angle     = flt_acos(flt_max(-1, flt_min(1, cos_angle)));
+  flt_type sin_angle = flt_sin(angle);
+  if (sin_angle < epsilon) {
+    return lerp_vec3f(from, to, t);
+  }
+
+  flt_type from_part = flt_sin((1 - t) * angle) / sin_angle;
+  flt_type to_part   = flt_sin(t * angle) / sin_angle;
+  vec3f    dir =
+      vec3f_add(vec3f_mul(from_dir, from_part), vec3f_mul(to_dir, to_part));
+  return vec3f_mul(dir, from_len + (to_len - from_len) * t);
+}
+
+keyframe_t get_track_pose(const track_t *track, int frame) {
+  assert(track->n_keys > 0);
+
+  const keyframe_t *keys = track->keys;
+  if (frame <= keys[0].frame) {
+    return keys[0];
+  }
+
+  int next = 1;
+  while ((next < track->n_keys) && (keys[next].frame < frame)) {
+    next++;
+  }
+  if (next == track->n_keys) {
+    return keys[next - 1];
+  }
+
+  const keyframe_t *prev = &keys[next - 1];
+  flt_type          t    = (flt_type)(frame - prev->frame) /
+                (flt_type)(keys[next].frame - prev->frame);
+
+  keyframe_t pose;
+  pose.frame = frame;
+  pose.pos   = lerp_vec3f(prev->pos, keys[next].pos, t);
+  pose.dir   = slerp_vec3f(prev->dir, keys[next].dir, t);
+  pose.angle = prev->angle + (keys[next].angle - prev->angle) * t;
+
+  return pose;
+}
+
+transform_t get_transform(const keyframe_t *pose, vec3f pivot) {
+  transform_t transform = {pivot, pose->pos, flt_cos(pose->angle),
+                           flt_sin(pose->angle)};
+  return transform;
+}
+
+vec3f turn_vector(const transform_t *transform, vec3f v) {
+  return get_vec3f(v.x * transform->cos + v.z * transform->sin, v.y,
+                   v.z * transform->cos - v.x * transform->sin);
+}
+
+vec3f transform_point(const transform_t *transform, vec3f point) {
+  vec3f turned = turn_vector(transform, vec3f_sub(point, transform->pivot));
+  return vec3f_add(vec3f_add(turned, transform->pivot), transform->shift);
+}
+
+
+
+size_t get_object_data_size(enum object_type_t type) {
+  switch (type) {
+  case SPHERE:
+    return sizeof(sphere_t);
+  case TRIANGLE:
+    return sizeof(triangle_t);
+  case PLANE:
+    return sizeof(plane_t);
+  default:
+    return 0;
+  }
+}
+
+void *copy_rest_pose(const object_t *object) {
+#ifdef WITH_OBJ
+  if (object->type == OBJ_MODEL) {
+    const model_t *model = object->data;
+    size_t         size  = model->mesh.n_vertices * sizeof(vec3f);
+    void *         rest  = malloc(size + 1);
+    if (rest != NULL) {
+      memcpy(rest, model->mesh.vertices, size);
+    }
+    return rest;
+  }
+#endif
+
+  size_t size = get_object_data_size(object->type);
+  if (size == 0) {
+    return NULL;
+  }
+
+  void *rest = malloc(size);
+  if (rest != NULL) {
+    memcpy(rest, object->data, size);
+  }
+  return rest;
+}
+
+vec3f get_pivot(const object_t *object) {
+  if (object->type == PLANE) {
+    const plane_t *plane = object->data;
+    return plane->r0;
+  }
+
+  return aabb_center(get_object_bounds(object));
+}
+
+int init_animator(animator_t *animator, scene_pack_t *pack) {
+  assert(animator);
+  assert(pack);
+  assert(pack->animation);
+
+  const animation_t *animation = pack->animation;
+  if ((animation->scene < 0) || (animation->scene >= pack->n_scenes)) {
+    fprintf(stderr, "animated scene #%d doesn't exist\n", animation->scene);
+    return -1;
+  }
+
+  animator->pack   = pack;
+  animator->rest   = calloc(animation->n_tracks + 1, sizeof(void *));
+  animator->pivots = calloc(animation->n_tracks + 1, sizeof(vec3f));
+  if ((animator->rest == NULL) || (animator->pivots == NULL)) {
+    free_animator(animator);
+    return -1;
+  }
+
+  for (int i = 0; i < animation->n_tracks; ++i) {
+    int object_idx = animation->tracks[i].object;
+    if (object_idx == CAMERA_TRACK) {
+      continue;
+    }
+
+    if (object_idx >= pack->n_objects) {
+      fprintf(stderr, "animated object #%d doesn't exist\n", object_idx);
+      free_animator(animator);
+      return -1;
+    }
+
+    const object_t *object = &pack->objects[object_idx];
+    animator->rest[i]      = copy_rest_pose(object);
+    if (animator->rest[i] == NULL) {
+      fprintf(stderr, "object #%d can't be animated\n", object_idx);
+      free_animator(animator);
+      return -1;
+    }
+
+    animator->pivots[i] = get_pivot(object);
+  }
+
+  return 0;
+}
+
+void free_animator(animator_t *animator) {
+  assert(animator);
+
+  if (animator->rest != NULL) {
+    for (int i = 0; i < animator->pack->animation->n_tracks; ++i) {
+      free(animator->rest[i]);
+    }
+  }
+
+  free(animator->rest);
+  free(animator->pivots);
+  animator->rest   = NULL;
+  animator->pivots = NULL;
+}
+
+
+
+int pose_object(object_t *object, const void *rest,
+                const transform_t *transform, int n_threads) {
+  (void) n_threads; // only the vertices of models are moved by threads
+
+  switch (object->type) {
+  case SPHERE: {
+    const sphere_t *rest_sphere = rest;
+    sphere_t *      sphere      = object->data;
+
+    sphere->center = transform_point(transform, rest_sphere->center);
+    break;
+  }
+  case TRIANGLE: {
+    const triangle_t *rest_triangle = rest;
+    triangle_t *      triangle      = object->data;
+
+    triangle->a = transform_point(transform, rest_triangle->a);
+    triangle->b = transform_point(transform, rest_triangle->b);
+    triangle->c = transform_point(transform, rest_triangle->c);
+    break;
+  }
+  case PLANE: {
+    const plane_t *rest_plane = rest;
+    plane_t *      plane      = object->data;
+
+    plane->r0 = transform_point(transform, rest_plane->r0);
+    plane->n  = turn_vector(transform, rest_plane->n);
+    break;
+  }
+#ifdef WITH_OBJ
+  case OBJ_MODEL: {
+    const vec3f *rest_vertices = rest;
+    model_t *    model         = object->data;
+  #pragma omp parallel for num_threads(n_threads) default(none)               \
+      shared(model, rest_vertices, transform)
+    for (int i = 0; i < model->mesh.n_vertices; ++i) {
+      model->mesh.vertices[i] = transform_point(transform, rest_vertices[i]);
+    }
+    return refit_model(model);
+  }
+#endif
+  default:
+    return -1;
+  }
+
+  return 0;
+}
+
+int set_animation_frame(animator_t *animator, int frame, int n_threads) {
+  assert(animator);
+  assert(n_threads > 0);
+
+  scene_pack_t *     pack      = animator->pack;
+  const animation_t *animation = pack->animation;
+  scene_t *          scene     = &pack->scenes[animation->scene];
+
+  for (int i = 0; i < animation->n_tracks; ++i) {
+    const track_t *track = &animation->tracks[i];
+    keyframe_t     pose  = get_track_pose(track, frame);
+    if (track->object == CAMERA_TRACK) {
+      scene->view_point = pose.pos;
+      scene->view_dir   = pose.dir;
+      continue;
+    }
+
+    transform_t transform = get_transform(&pose, animator->pivots[i]);
+    if (pose_object(&pack->objects[track->object], animator->rest[i],
+                    &transform, n_threads) != 0) {
+      return -1;
+    }
+  }
+
+  return refit_scene_accel(pack, scene->accel);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "geometry.h"
+#include "scene.h"
+
+
+
+// The animated scene of a pack is posed for every frame from the rest pose
+// the pack was loaded in, so frames may be posed in any order; its compiled
+// scene is refitted to the moved objects rather than rebuilt.
+
+typedef struct {
+  scene_pack_t *pack;
+
+  // rest pose of the object of every track: a copy of the object data or of
+  // the model vertices, NULL for the camera
+  void **rest;
+  // objects turn about the vertical axis through these points
+  vec3f *pivots;
+} animator_t;
+
+
+
+int  init_animator(animator_t *animator, scene_pack_t *pack);
+void free_animator(animator_t *animator);
+
+// poses the camera and the objects of the animated scene for the frame, the
+// vertices of models are moved by 'n_threads' threads
+int set_animation_frame(animator_t *animator, int frame, int n_threads);
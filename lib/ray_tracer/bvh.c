@@ -0,0 +1,704 @@
+#include "bvh.h"
+#include "geometry.h"
+#include "simd.h"
+
+#include "flt_type.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+
+
+enum {
+  BVH_N_BINS        = 16,
+  BVH_MAX_LEAF_SIZE = 16,
+
+  // subtrees with more primitives are built in separate OpenMP tasks
+  BVH_TASK_THRESHOLD = 1024,
+  // nodes with more primitives are binned by several tasks
+  BVH_BIN_CHUNK = 64 * 1024,
+};
+
+// cost of the node traversal relative to the cost of a primitive test
+static const flt_type BVH_TRAVERSAL_COST = 1.0;
+
+
+
+typedef struct {
+  const aabb_t *prim_bounds;
+  vec3f *       centers;
+  bvh_t *       bvh;
+} bvh_builder_t;
+
+typedef struct {
+  aabb_t bounds;
+  aabb_t center_bounds;
+  int    count;
+} bvh_bin_t;
+
+typedef bvh_bin_t bvh_bins_t[3][BVH_N_BINS];
+
+typedef struct {
+  int      axis;
+  int      bin; // primitives from bins [0, bin] go to the left child
+  flt_type cost;
+
+  bvh_bin_t left;
+  bvh_bin_t right;
+} bvh_split_t;
+
+
+
+flt_type aabb_half_area(const aabb_t box) {
+  vec3f extent = vec3f_sub(box.max, box.min);
+  if ((extent.x < 0) || (extent.y < 0) || (extent.z < 0)) {
+    return 0;
+  }
+  return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+}
+
+bvh_bin_t bvh_bin_empty() {
+  bvh_bin_t bin = {aabb_empty(), aabb_empty(), 0};
+  return bin;
+}
+
+bvh_bin_t bvh_bin_union(const bvh_bin_t bin1, const bvh_bin_t bin2) {
+  bvh_bin_t bin = {
+      aabb_union(bin1.bounds, bin2.bounds),
+      aabb_union(bin1.center_bounds, bin2.center_bounds),
+      bin1.count + bin2.count,
+  };
+  return bin;
+}
+
+bvh_bin_t bvh_range_bin(const bvh_builder_t *builder, int first, int count) {
+  bvh_bin_t bin = bvh_bin_empty();
+  for (int i = first; i < first + count; ++i) {
+    int prim          = builder->bvh->prims[i];
+    bin.bounds        = aabb_union(bin.bounds, builder->prim_bounds[prim]);
+    bin.center_bounds = aabb_add_point(bin.center_bounds,
+                                       builder->centers[prim]);
+  }
+  bin.count = count;
+  return bin;
+}
+
+int bvh_bin_index(const aabb_t *center_bounds, const vec3f center, int axis) {
+  flt_type min    = vec3f_get(center_bounds->min, axis);
+  flt_type extent = vec3f_get(center_bounds->max, axis) - min;
+  int      bin =
+      (int) ((vec3f_get(center, axis) - min) / extent * BVH_N_BINS);
+  return (bin < 0) ? 0 : (bin >= BVH_N_BINS) ? BVH_N_BINS - 1 : bin;
+}
+
+void bvh_fill_bins(const bvh_builder_t *builder, int first, int count,
+                   const aabb_t *center_bounds, bvh_bins_t bins) {
+  for (int axis = 0; axis < 3; ++axis) {
+    for (int b = 0; b < BVH_N_BINS; ++b) {
+      bins[axis][b] = bvh_bin_empty();
+    }
+  }
+
+  for (int i = first; i < first + count; ++i) {
+    int prim = builder->bvh->prims[i];
+    for (int axis = 0; axis < 3; ++axis) {
+      bvh_bin_t *bin =
+          &bins[axis][bvh_bin_index(center_bounds, builder->centers[prim],
+                                    axis)];
+      bin->bounds = aabb_union(bin->bounds, builder->prim_bounds[prim]);
+      bin->center_bounds =
+          aabb_add_point(bin->center_bounds, builder->centers[prim]);
+      bin->count++;
+    }
+  }
+}
+
+// big nodes are binned by chunks in parallel and then merged
+void bvh_fill_bins_parallel(const bvh_builder_t *builder, int first,
+                            int count, const aabb_t *center_bounds,
+                            bvh_bins_t bins) {
+  if (count <= BVH_BIN_CHUNK) {
+    bvh_fill_bins(builder, first, count, center_bounds, bins);
+    return;
+  }
+
+  int         n_chunks    = (count + BVH_BIN_CHUNK - 1) / BVH_BIN_CHUNK;
+  bvh_bins_t *chunks_bins = malloc(n_chunks * sizeof(bvh_bins_t));
+  assert(chunks_bins);
+
+  for (int c = 0; c < n_chunks; ++c) {
+    int chunk_first = first + c * BVH_BIN_CHUNK;
+    int chunk_count = (c == n_chunks - 1) ? first + count - chunk_first
+                                          : BVH_BIN_CHUNK;
+#pragma omp task default(none) firstprivate(builder, chunk_first, chunk_count, \
+                                            center_bounds, chunks_bins, c)
+    bvh_fill_bins(builder, chunk_first, chunk_count, center_bounds,
+                  chunks_bins[c]);
+  }
+#pragma omp taskwait
+
+  for (int axis = 0; axis < 3; ++axis) {
+    for (int b = 0; b < BVH_N_BINS; ++b) {
+      bins[axis][b] = chunks_bins[0][axis][b];
+      for (int c = 1; c < n_chunks; ++c) {
+        bins[axis][b] = bvh_bin_union(bins[axis][b], chunks_bins[c][axis][b]);
+      }
+    }
+  }
+
+  free(chunks_bins);
+}
+
+// binned surface area heuristic: choose the plane between bins that minimizes
+// the expected cost of the ray traversal through both children
+bvh_split_t bvh_find_split(const bvh_builder_t *builder,
+                           const bvh_bin_t *node_bin, int first) {
+  bvh_split_t best = {-1, -1, FLT_TYPE_MAX, bvh_bin_empty(), bvh_bin_empty()};
+
+  bvh_bins_t bins;
+  bvh_fill_bins_parallel(builder, first, node_bin->count,
+                         &node_bin->center_bounds, bins);
+
+  flt_type node_area = aabb_half_area(node_bin->bounds);
+  if (node_area <= 0) {
+    node_area = FLT_ONE;
+  }
+
+  for (int axis = 0; axis < 3; ++axis) {
+    if (vec3f_get(node_bin->center_bounds.max, axis) <=
+        vec3f_get(node_bin->center_bounds.min, axis)) {
+      continue;
+    }
+
+    bvh_bin_t right[BVH_N_BINS];
+    right[BVH_N_BINS - 1] = bins[axis][BVH_N_BINS - 1];
+    for (int b = BVH_N_BINS - 2; b >= 0; --b) {
+      right[b] = bvh_bin_union(right[b + 1], bins[axis][b]);
+    }
+
+    bvh_bin_t left = bvh_bin_empty();
+    for (int b = 0; b < BVH_N_BINS - 1; ++b) {
+      left = bvh_bin_union(left, bins[axis][b]);
+      if ((left.count == 0) || (right[b + 1].count == 0)) {
+        continue;
+      }
+
+      flt_type cost =
+          BVH_TRAVERSAL_COST +
+          (aabb_half_area(left.bounds) * left.count +
+           aabb_half_area(right[b + 1].bounds) * right[b + 1].count) /
+              node_area;
+      if (cost < best.cost) {
+        best.axis  = axis;
+        best.bin   = b;
+        best.cost  = cost;
+        best.left  = left;
+        best.right = right[b + 1];
+      }
+    }
+  }
+
+  return best;
+}
+
+int bvh_partition(const bvh_builder_t *builder, int first, int count,
+                  const aabb_t *center_bounds, const bvh_split_t *split) {
+  int *prims = builder->bvh->prims;
+  int  left  = first;
+  int  right = first + count - 1;
+  while (left <= right) {
+    if (bvh_bin_index(center_bounds, builder->centers[prims[left]],
+                      split->axis) <= split->bin) {
+      left++;
+    } else {
+      int tmp      = prims[left];
+      prims[left]  = prims[right];
+      prims[right] = tmp;
+      right--;
+    }
+  }
+
+  return left - first;
+}
+
+void bvh_build_node(bvh_builder_t *builder, int node_idx, int first,
+                    bvh_bin_t node_bin, int depth) {
+  bvh_node_t *node  = &builder->bvh->nodes[node_idx];
+  int         count = node_bin.count;
+  node->bounds      = node_bin.bounds;
+  node->first       = first;
+  node->count       = count;
+
+  if (count <= BVH_LEAF_SIZE) {
+    return;
+  }
+
+  bvh_split_t split = {-1, -1, FLT_TYPE_MAX, bvh_bin_empty(), bvh_bin_empty()};
+  // too deep trees can't be traversed with the fixed size stack
+  if (depth < BVH_STACK_DEPTH / 2) {
+    split = bvh_find_split(builder, &node_bin, first);
+  }
+
+  if ((count <= BVH_MAX_LEAF_SIZE) && (split.cost >= count)) {
+    return;
+  }
+
+  int n_left = 0;
+  if (split.axis >= 0) {
+    n_left = bvh_partition(builder, first, count, &node_bin.center_bounds,
+                           &split);
+    assert(n_left == split.left.count);
+  } else {
+    // all centers coincide: split the range in halves
+    n_left      = count / 2;
+    split.left  = bvh_range_bin(builder, first, n_left);
+    split.right = bvh_range_bin(builder, first + n_left, count - n_left);
+  }
+
+  int left_idx;
+#pragma omp atomic capture
+  {
+    left_idx = builder->bvh->n_nodes;
+    builder->bvh->n_nodes += 2;
+  }
+  node->first = left_idx;
+  node->count = 0;
+
+  if (count > BVH_TASK_THRESHOLD) {
+    bvh_bin_t left_bin = split.left;
+#pragma omp task default(none) \
+    firstprivate(builder, left_idx, first, left_bin, depth)
+    bvh_build_node(builder, left_idx, first, left_bin, depth + 1);
+  } else {
+    bvh_build_node(builder, left_idx, first, split.left, depth + 1);
+  }
+  bvh_build_node(builder, left_idx + 1, first + n_left, split.right,
+                 depth + 1);
+}
+
+int bvh_build(bvh_t *bvh, const aabb_t *prim_bounds, int n_prims) {
+  assert(bvh);
+  assert(n_prims >= 0);
+
+  bvh->nodes   = NULL;
+  bvh->n_nodes = 0;
+  bvh->prims   = NULL;
+  bvh->n_prims = n_prims;
+
+  if (n_prims == 0) {
+    return 0;
+  }
+
+  assert(prim_bounds);
+
+  bvh->nodes     = malloc(2 * n_prims * sizeof(bvh_node_t));
+  bvh->prims     = malloc(n_prims * sizeof(int));
+  vec3f *centers = malloc(n_prims * sizeof(vec3f));
+  if ((bvh->nodes == NULL) || (bvh->prims == NULL) || (centers == NULL)) {
+    free(centers);
+    bvh_free(bvh);
+    return -1;
+  }
+
+  bvh_bin_t root_bin = bvh_bin_empty();
+#pragma omp parallel default(none) shared(bvh, centers, prim_bounds, n_prims, \
+                                          root_bin)
+  {
+    bvh_bin_t thread_bin = bvh_bin_empty();
+#pragma omp for
+    for (int i = 0; i < n_prims; ++i) {
+      bvh->prims[i] = i;
+      centers[i]    = aabb_center(prim_bounds[i]);
+
+      thread_bin.bounds = aabb_union(thread_bin.bounds, prim_bounds[i]);
+      thread_bin.center_bounds =
+          aabb_add_point(thread_bin.center_bounds, centers[i]);
+      thread_bin.count++;
+    }
+#pragma omp critical
+    root_bin = bvh_bin_union(root_bin, thread_bin);
+  }
+
+  bvh_builder_t builder = {prim_bounds, centers, bvh};
+  bvh->n_nodes          = 1;
+
+#pragma omp parallel default(none) shared(builder, root_bin)
+#pragma omp single
+  bvh_build_node(&builder, 0, 0, root_bin, 0);
+
+  free(centers);
+  return 0;
+}
+
+// children always go after their parent, so walking the nodes backwards
+// meets both children of a node before the node itself
+void bvh_refit(bvh_t *bvh, const aabb_t *prim_bounds) {
+  assert(bvh);
+  assert(prim_bounds || (bvh->n_prims == 0));
+
+#pragma omp parallel for default(none) shared(bvh, prim_bounds)
+  for (int node_idx = 0; node_idx < bvh->n_nodes; ++node_idx) {
+    bvh_node_t *node = &bvh->nodes[node_idx];
+    if (node->count == 0) {
+      continue;
+    }
+
+    node->bounds = aabb_empty();
+    for (int i = node->first; i < node->first + node->count; ++i) {
+      node->bounds = aabb_union(node->bounds, prim_bounds[bvh->prims[i]]);
+    }
+  }
+
+  for (int node_idx = bvh->n_nodes - 1; node_idx >= 0; --node_idx) {
+    bvh_node_t *node = &bvh->nodes[node_idx];
+    if (node->count == 0) {
+      node->bounds = aabb_union(bvh->nodes[node->first].bounds,
+                                bvh->nodes[node->first + 1].bounds);
+    }
+  }
+}
+
+void bvh_free(bvh_t *bvh) {
+  assert(bvh);
+  free(bvh->nodes);
+  free(bvh->prims);
+  bvh->nodes   = NULL;
+  bvh->prims   = NULL;
+  bvh->n_nodes = 0;
+  bvh->n_prims = 0;
+}
+
+
+
+// zero components are replaced with a huge value instead of infinity: the slab
+// test would get 0 * inf = NaN for rays going along the box faces
+vec3f get_inv_dir(const vec3f dir) {
+  vec3f inv_dir = {
+      (dir.x == 0) ? FLT_TYPE_MAX : FLT_ONE / dir.x,
+      (dir.y == 0) ? FLT_TYPE_MAX : FLT_ONE / dir.y,
+      (dir.z == 0) ? FLT_TYPE_MAX : FLT_ONE / dir.z,
+  };
+  return inv_dir;
+}
+
+// slab test
+int ray_intersect_aabb(const aabb_t *box, const vec3f src, const vec3f inv_dir,
+                       const flt_type max_dist, flt_type *dist) {
+  assert(box);
+
+  flt_type tx1    = (box->min.x - src.x) * inv_dir.x;
+  flt_type tx2    = (box->max.x - src.x) * inv_dir.x;
+  flt_type t_near = flt_min(tx1, tx2);
+  flt_type t_far  = flt_max(tx1, tx2);
+
+  flt_type ty1 = (box->min.y - src.y) * inv_dir.y;
+  flt_type ty2 = (box->max.y - src.y) * inv_dir.y;
+  t_near       = flt_max(t_near, flt_min(ty1, ty2));
+  t_far        = flt_min(t_far, flt_max(ty1, ty2));
+
+  flt_type tz1 = (box->min.z - src.z) * inv_dir.z;
+  flt_type tz2 = (box->max.z - src.z) * inv_dir.z;
+  t_near       = flt_max(t_near, flt_min(tz1, tz2));
+  t_far        = flt_min(t_far, flt_max(tz1, tz2));
+
+  if ((t_far < t_near) || (t_far < 0) || (t_near > max_dist)) {
+    return 0;
+  }
+
+  if (dist != NULL) {
+    *dist = t_near;
+  }
+
+  return 1;
+}
+
+int bvh_intersect(const bvh_t *bvh, bvh_leaf_intersect_t intersect,
+                  const void *data, const vec3f src, const vec3f dir,
+                  const flt_type max_dist, flt_type *dist) {
+  assert(bvh);
+  assert(intersect);
+
+  flt_type shortest_dist = max_dist;
+  int      hit           = 0;
+
+  if (bvh->n_nodes == 0) {
+    return 0;
+  }
+
+  vec3f inv_dir = get_inv_dir(dir);
+
+  // nodes are pushed with the distance to their boxes to skip the ones that
+  // are farther than a hit found after they were pushed
+  int      stack[BVH_STACK_DEPTH];
+  flt_type stack_dist[BVH_STACK_DEPTH];
+  int      stack_size = 0;
+
+  if (ray_intersect_aabb(&bvh->nodes[0].bounds, src, inv_dir, shortest_dist,
+                         &stack_dist[0])) {
+    stack[stack_size++] = 0;
+  }
+
+  while (stack_size > 0) {
+    stack_size--;
+    if (stack_dist[stack_size] > shortest_dist) {
+      continue;
+    }
+
+    const bvh_node_t *node = &bvh->nodes[stack[stack_size]];
+
+    if (node->count > 0) {
+      if (intersect(data, node, src, dir, shortest_dist, &shortest_dist)) {
+        hit = 1;
+      }
+      continue;
+    }
+
+    // visit the nearest child first, so the farther one can be culled
+    flt_type left_dist  = FLT_TYPE_MAX;
+    flt_type right_dist = FLT_TYPE_MAX;
+    int      hit_left   = ray_intersect_aabb(&bvh->nodes[node->first].bounds,
+                                             src, inv_dir, shortest_dist,
+                                             &left_dist);
+    int      hit_right  = ray_intersect_aabb(
+        &bvh->nodes[node->first + 1].bounds, src, inv_dir, shortest_dist,
+        &right_dist);
+
+    assert(stack_size + 2 <= BVH_STACK_DEPTH);
+    if (hit_left && hit_right && (left_dist <= right_dist)) {
+      stack_dist[stack_size] = right_dist;
+      stack[stack_size++]    = node->first + 1;
+      stack_dist[stack_size] = left_dist;
+      stack[stack_size++]    = node->first;
+    } else if (hit_left && hit_right) {
+      stack_dist[stack_size] = left_dist;
+      stack[stack_size++]    = node->first;
+      stack_dist[stack_size] = right_dist;
+      stack[stack_size++]    = node->first + 1;
+    } else if (hit_left) {
+      stack_dist[stack_size] = left_dist;
+      stack[stack_size++]    = node->first;
+    } else if (hit_right) {
+      stack_dist[stack_size] = right_dist;
+      stack[stack_size++]    = node->first + 1;
+    }
+  }
+
+  if (hit && (dist != NULL)) {
+    *dist = shortest_dist;
+  }
+
+  return hit;
+}
+
+// the order of the children doesn't matter here as 'max_dist' never shrinks
+int bvh_occluded(const bvh_t *bvh, bvh_leaf_intersect_t intersect,
+                 const void *data, const vec3f src, const vec3f dir,
+                 const flt_type max_dist) {
+  assert(bvh);
+  assert(intersect);
+
+  if (bvh->n_nodes == 0) {
+    return 0;
+  }
+
+  vec3f    inv_dir = get_inv_dir(dir);
+  flt_type box_dist;
+  flt_type hit_dist;
+
+  int stack[BVH_STACK_DEPTH];
+  int stack_size = 0;
+
+  if (ray_intersect_aabb(&bvh->nodes[0].bounds, src, inv_dir, max_dist,
+                         &box_dist)) {
+    stack[stack_size++] = 0;
+  }
+
+  while (stack_size > 0) {
+    const bvh_node_t *node = &bvh->nodes[stack[--stack_size]];
+
+    if (node->count > 0) {
+      if (intersect(data, node, src, dir, max_dist, &hit_dist)) {
+        return 1;
+      }
+      continue;
+    }
+
+    assert(stack_size + 2 <= BVH_STACK_DEPTH);
+    for (int child = node->first; child < node->first + 2; ++child) {
+      if (ray_intersect_aabb(&bvh->nodes[child].bounds, src, inv_dir,
+                             max_dist, &box_dist)) {
+        stack[stack_size++] = child;
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+
+typedef struct {
+  flt_type x[RAY_PACKET_SIZE];
+  flt_type y[RAY_PACKET_SIZE];
+  flt_type z[RAY_PACKET_SIZE];
+} packet_inv_dir_t;
+
+// slab test for all rays of the packet; returns 1 if any of them hits the box
+// nearer than its 'dist' and writes the nearest entry distance to 'dist'
+int ray_packet_intersect_aabb(const aabb_t *box, const ray_packet_t *packet,
+                              const packet_inv_dir_t *inv_dir,
+                              flt_type *dist) {
+  assert(box);
+  assert(packet);
+
+  flt_type entry = FLT_TYPE_MAX;
+  int      hit   = 0;
+
+#if SIMD_ENABLED
+  const vflt zero  = vflt_set1(FLT_ZERO);
+  const vflt min_x = vflt_set1(box->min.x);
+  const vflt min_y = vflt_set1(box->min.y);
+  const vflt min_z = vflt_set1(box->min.z);
+  const vflt max_x = vflt_set1(box->max.x);
+  const vflt max_y = vflt_set1(box->max.y);
+  const vflt max_z = vflt_set1(box->max.z);
+  vflt       near  = vflt_set1(FLT_TYPE_MAX);
+
+  for (int i = 0; i < RAY_PACKET_SIZE; i += SIMD_WIDTH) {
+    vflt src_x = vflt_loadu(packet->src_x + i);
+    vflt src_y = vflt_loadu(packet->src_y + i);
+    vflt src_z = vflt_loadu(packet->src_z + i);
+    vflt inv_x = vflt_loadu(inv_dir->x + i);
+    vflt inv_y = vflt_loadu(inv_dir->y + i);
+    vflt inv_z = vflt_loadu(inv_dir->z + i);
+
+    vflt tx1    = vflt_mul(vflt_sub(min_x, src_x), inv_x);
+    vflt tx2    = vflt_mul(vflt_sub(max_x, src_x), inv_x);
+    vflt t_near = vflt_min(tx1, tx2);
+    vflt t_far  = vflt_max(tx1, tx2);
+
+    vflt ty1 = vflt_mul(vflt_sub(min_y, src_y), inv_y);
+    vflt ty2 = vflt_mul(vflt_sub(max_y, src_y), inv_y);
+    t_near   = vflt_max(t_near, vflt_min(ty1, ty2));
+    t_far    = vflt_min(t_far, vflt_max(ty1, ty2));
+
+    vflt tz1 = vflt_mul(vflt_sub(min_z, src_z), inv_z);
+    vflt tz2 = vflt_mul(vflt_sub(max_z, src_z), inv_z);
+    t_near   = vflt_max(t_near, vflt_min(tz1, tz2));
+    t_far    = vflt_min(t_far, vflt_max(tz1, tz2));
+
+    vflt valid = vflt_and(vflt_le(t_near, t_far), vflt_le(zero, t_far));
+    valid = vflt_and(valid, vflt_le(t_near, vflt_loadu(packet->dist + i)));
+
+    if (vflt_mask(valid)) {
+      hit  = 1;
+      near = vflt_min(near, vflt_select(valid, near, t_near));
+    }
+  }
+
+  if (hit) {
+    flt_type lanes[SIMD_WIDTH];
+    vflt_storeu(lanes, near);
+    for (int lane = 0; lane < SIMD_WIDTH; ++lane) {
+      entry = flt_min(entry, lanes[lane]);
+    }
+  }
+#else
+  for (int i = 0; i < packet->n; ++i) {
+    vec3f    src        = ray_packet_src(packet, i);
+    vec3f    inv        = {inv_dir->x[i], inv_dir->y[i], inv_dir->z[i]};
+    flt_type lane_entry = FLT_TYPE_MAX;
+    if (ray_intersect_aabb(box, src, inv, packet->dist[i], &lane_entry)) {
+      entry = flt_min(entry, lane_entry);
+      hit   = 1;
+    }
+  }
+#endif
+
+  if (hit) {
+    *dist = entry;
+  }
+
+  return hit;
+}
+
+flt_type ray_packet_max_dist(const ray_packet_t *packet) {
+  flt_type max_dist = -FLT_TYPE_MAX;
+  for (int i = 0; i < packet->n; ++i) {
+    max_dist = flt_max(max_dist, packet->dist[i]);
+  }
+  return max_dist;
+}
+
+void bvh_intersect_packet(const bvh_t *               bvh,
+                          bvh_packet_leaf_intersect_t intersect,
+                          const void *data, ray_packet_t *packet) {
+  assert(bvh);
+  assert(intersect);
+  assert(packet);
+
+  if (bvh->n_nodes == 0) {
+    return;
+  }
+
+  packet_inv_dir_t inv_dir;
+  for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+    vec3f inv    = get_inv_dir(ray_packet_dir(packet, i));
+    inv_dir.x[i] = inv.x;
+    inv_dir.y[i] = inv.y;
+    inv_dir.z[i] = inv.z;
+  }
+
+  // the same near-first traversal as for a single ray, where a node is
+  // culled only when it is farther than the hits of all the rays
+  int      stack[BVH_STACK_DEPTH];
+  flt_type stack_dist[BVH_STACK_DEPTH];
+  int      stack_size = 0;
+  flt_type max_dist   = ray_packet_max_dist(packet);
+
+  if (ray_packet_intersect_aabb(&bvh->nodes[0].bounds, packet, &inv_dir,
+                                &stack_dist[0])) {
+    stack[stack_size++] = 0;
+  }
+
+  while (stack_size > 0) {
+    stack_size--;
+    if (stack_dist[stack_size] > max_dist) {
+      continue;
+    }
+
+    const bvh_node_t *node = &bvh->nodes[stack[stack_size]];
+
+    if (node->count > 0) {
+      intersect(data, node, packet);
+      max_dist = ray_packet_max_dist(packet);
+      continue;
+    }
+
+    flt_type left_dist  = FLT_TYPE_MAX;
+    flt_type right_dist = FLT_TYPE_MAX;
+    int      hit_left   = ray_packet_intersect_aabb(
+        &bvh->nodes[node->first].bounds, packet, &inv_dir, &left_dist);
+    int hit_right = ray_packet_intersect_aabb(
+        &bvh->nodes[node->first + 1].bounds, packet, &inv_dir, &right_dist);
+
+    assert(stack_size + 2 <= BVH_STACK_DEPTH);
+    if (hit_left && hit_right && (left_dist <= right_dist)) {
+      stack_dist[stack_size] = right_dist;
+      stack[stack_size++]    = node->first + 1;
+      stack_dist[stack_size] = left_dist;
+      stack[stack_size++]    = node->first;
+    } else if (hit_left && hit_right) {
+      stack_dist[stack_size] = left_dist;
+      stack[stack_size++]    = node->first;
+      stack_dist[stack_size] = right_dist;
+      stack[stack_size++]    = node->first + 1;
+    } else if (hit_left) {
+      stack_dist[stack_size] = left_dist;
+      stack[stack_size++]    = node->first;
+    } else if (hit_right) {
+      stack_dist[stack_size] = right_dist;
+      stack[stack_size++]    = node->first + 1;
+    }
+  }
+}
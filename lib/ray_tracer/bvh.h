@@ -0,0 +1,80 @@
+#pragma once
+
+#include "geometry.h"
+
+#include "flt_type.h"
+
+
+
+enum {
+  BVH_LEAF_SIZE   = 4,
+  BVH_STACK_DEPTH = 64,
+};
+
+
+
+typedef struct {
+  aabb_t bounds;
+
+  // for inner nodes 'first' is the index of the left child (the right one
+  // goes right after it) and 'count' is 0; for leaves 'first' is the index of
+  // the first primitive in 'bvh_t::prims' and 'count' is number of primitives
+  int first;
+  int count;
+} bvh_node_t;
+
+typedef struct {
+  bvh_node_t *nodes;
+  int         n_nodes;
+
+  // primitive indices ordered the way leaves refer to them
+  int *prims;
+  int  n_prims;
+} bvh_t;
+
+
+
+// tests the ray against primitives of 'leaf'; returns 1 and writes distance
+// to 'dist' if some of them is hit nearer than 'max_dist'; as the traversal
+// only narrows 'max_dist', the last leaf reporting a hit holds the closest one
+typedef int (*bvh_leaf_intersect_t)(const void *data, const bvh_node_t *leaf,
+                                    vec3f src, vec3f dir, flt_type max_dist,
+                                    flt_type *dist);
+
+
+// tests rays of the packet against primitives of 'leaf' and narrows 'dist' of
+// the rays which hit something
+typedef void (*bvh_packet_leaf_intersect_t)(const void *      data,
+                                            const bvh_node_t *leaf,
+                                            ray_packet_t *    packet);
+
+
+
+// binned SAH build, parallelized with OpenMP tasks
+int  bvh_build(bvh_t *bvh, const aabb_t *prim_bounds, int n_prims);
+void bvh_free(bvh_t *bvh);
+
+// updates bounds of the nodes after the primitives have moved keeping the
+// tree as it is: much cheaper than a rebuild, but the tree degrades if the
+// primitives move far from each other
+void bvh_refit(bvh_t *bvh, const aabb_t *prim_bounds);
+
+vec3f get_inv_dir(vec3f dir);
+int   ray_intersect_aabb(const aabb_t *box, vec3f src, vec3f inv_dir,
+                         flt_type max_dist, flt_type *dist);
+
+// returns 1 if a primitive nearer than 'max_dist' is hit; which one it was is
+// up to 'intersect' to remember in 'data'
+int bvh_intersect(const bvh_t *bvh, bvh_leaf_intersect_t intersect,
+                  const void *data, vec3f src, vec3f dir, flt_type max_dist,
+                  flt_type *dist);
+
+// returns 1 as soon as any primitive nearer than 'max_dist' is hit; 'dist' of
+// 'intersect' is scratch space there and it may report the first hit it meets
+int bvh_occluded(const bvh_t *bvh, bvh_leaf_intersect_t intersect,
+                 const void *data, vec3f src, vec3f dir, flt_type max_dist);
+
+// traverses the tree once for all rays of the packet
+void bvh_intersect_packet(const bvh_t *               bvh,
+                          bvh_packet_leaf_intersect_t intersect,
+                          const void *data, ray_packet_t *packet);
@@ -58,3 +58,80 @@ vec3f vec3f_normalize(vec3f v) {
   return res;
 }
 
+
+vec3f vec3f_min(const vec3f v1, const vec3f v2) {
+  vec3f res = {flt_min(v1.x, v2.x), flt_min(v1.y, v2.y), flt_min(v1.z, v2.z)};
+  return res;
+}
+
+vec3f vec3f_max(const vec3f v1, const vec3f v2) {
+  vec3f res = {flt_max(v1.x, v2.x), flt_max(v1.y, v2.y), flt_max(v1.z, v2.z)};
+  return res;
+}
+
+flt_type vec3f_get(const vec3f v, const int axis) {
+  assert((axis >= 0) && (axis < 3));
+  return (axis == 0) ? v.x : (axis == 1) ? v.y : v.z;
+}
+
+
+
+aabb_t aabb_empty() {
+  aabb_t res = {
+      {FLT_TYPE_MAX, FLT_TYPE_MAX, FLT_TYPE_MAX},
+      {-FLT_TYPE_MAX, -FLT_TYPE_MAX, -FLT_TYPE_MAX},
+  };
+  return res;
+}
+
+aabb_t aabb_add_point(const aabb_t box, const vec3f point) {
+  aabb_t res = {vec3f_min(box.min, point), vec3f_max(box.max, point)};
+  return res;
+}
+
+aabb_t aabb_union(const aabb_t box1, const aabb_t box2) {
+  aabb_t res = {vec3f_min(box1.min, box2.min), vec3f_max(box1.max, box2.max)};
+  return res;
+}
+
+vec3f aabb_center(const aabb_t box) {
+  return vec3f_mul(vec3f_add(box.min, box.max), (flt_type) 0.5);
+}
+
+
+
+void ray_packet_set(ray_packet_t *packet, const int lane, const vec3f src,
+                    const vec3f dir, const flt_type max_dist) {
+  assert(packet);
+  assert((lane >= 0) && (lane < RAY_PACKET_SIZE));
+
+  packet->src_x[lane] = src.x;
+  packet->src_y[lane] = src.y;
+  packet->src_z[lane] = src.z;
+  packet->dir_x[lane] = dir.x;
+  packet->dir_y[lane] = dir.y;
+  packet->dir_z[lane] = dir.z;
+  packet->dist[lane]  = max_dist;
+}
+
+// padding lanes copy the first ray, so they stay well-defined for the
+// kernels, but with negative 'dist' no hit can be nearer
+void ray_packet_pad(ray_packet_t *packet) {
+  assert(packet);
+  assert((packet->n > 0) && (packet->n <= RAY_PACKET_SIZE));
+
+  for (int lane = packet->n; lane < RAY_PACKET_SIZE; ++lane) {
+    ray_packet_set(packet, lane, ray_packet_src(packet, 0),
+                   ray_packet_dir(packet, 0), -FLT_TYPE_MAX);
+  }
+}
+
+vec3f ray_packet_src(const ray_packet_t *packet, const int lane) {
+  vec3f res = {packet->src_x[lane], packet->src_y[lane], packet->src_z[lane]};
+  return res;
+}
+
+vec3f ray_packet_dir(const ray_packet_t *packet, const int lane) {
+  vec3f res = {packet->dir_x[lane], packet->dir_y[lane], packet->dir_z[lane]};
+  return res;
+}
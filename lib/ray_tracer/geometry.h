@@ -44,6 +44,34 @@ typedef struct {
 
 
 
+typedef struct {
+  vec3f min;
+  vec3f max;
+} aabb_t;
+
+
+
+enum {
+  RAY_PACKET_SIZE = 16,
+};
+
+// rays traced together, stored lane by lane for the SIMD kernels; 'dist' is
+// the distance to the closest hit found so far; lanes from 'n' up to
+// RAY_PACKET_SIZE are padding, which never hits anything
+typedef struct {
+  flt_type src_x[RAY_PACKET_SIZE];
+  flt_type src_y[RAY_PACKET_SIZE];
+  flt_type src_z[RAY_PACKET_SIZE];
+  flt_type dir_x[RAY_PACKET_SIZE];
+  flt_type dir_y[RAY_PACKET_SIZE];
+  flt_type dir_z[RAY_PACKET_SIZE];
+  flt_type dist[RAY_PACKET_SIZE];
+
+  int n;
+} ray_packet_t;
+
+
+
 flt_type flt_min(flt_type f1, flt_type f2);
 flt_type flt_max(flt_type f1, flt_type f2);
 
@@ -55,4 +83,18 @@ vec3f    vec3f_vec_mul(vec3f v1, vec3f v2);
 flt_type vec3f_scalar_mul(vec3f v1, vec3f v2);
 flt_type vec3f_norm(vec3f v);
 vec3f    vec3f_normalize(vec3f v);
+vec3f    vec3f_min(vec3f v1, vec3f v2);
+vec3f    vec3f_max(vec3f v1, vec3f v2);
+flt_type vec3f_get(vec3f v, int axis);
+
+aabb_t aabb_empty();
+aabb_t aabb_add_point(aabb_t box, vec3f point);
+aabb_t aabb_union(aabb_t box1, aabb_t box2);
+vec3f  aabb_center(aabb_t box);
+
+void  ray_packet_set(ray_packet_t *packet, int lane, vec3f src, vec3f dir,
+                     flt_type max_dist);
+void  ray_packet_pad(ray_packet_t *packet);
+vec3f ray_packet_src(const ray_packet_t *packet, int lane);
+vec3f ray_packet_dir(const ray_packet_t *packet, int lane);
 
@@ -0,0 +1,557 @@
+#include "image_file.h"
+
+#include <SDL2/SDL.h>
+#include <zlib.h>
+
+#include <assert.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+
+enum {
+  RGB_SIZE = 3,
+
+  PNG_N_FILTERS   = 5,
+  PNG_BIT_DEPTH   = 8,
+  PNG_COLOR_TYPE  = 2, // RGB
+  PNG_IHDR_SIZE   = 13,
+  PNG_MEM_LEVEL   = 8,
+  PNG_FLUSH_SLACK = 64,
+
+  // a zlib stream with the window of 32K and the default level
+  ZLIB_CMF = 0x78,
+  ZLIB_FLG = 0x9C,
+
+  QOI_HEADER_SIZE = 14,
+  QOI_INDEX_SIZE  = 64,
+  QOI_MAX_RUN     = 62,
+  QOI_MAX_CHUNK   = 4,
+  QOI_OP_INDEX    = 0x00,
+  QOI_OP_DIFF     = 0x40,
+  QOI_OP_LUMA     = 0x80,
+  QOI_OP_RUN      = 0xC0,
+  QOI_OP_RGB      = 0xFE,
+};
+
+static const uint8_t PNG_SIGNATURE[] = {137, 80, 78, 71, 13, 10, 26, 10};
+static const uint8_t QOI_END[]       = {0, 0, 0, 0, 0, 0, 0, 1};
+
+
+
+int has_extension(const char *filename, const char *extension) {
+  size_t len     = strlen(filename);
+  size_t ext_len = strlen(extension);
+  return (len >= ext_len) && (strcmp(filename + len - ext_len, extension) == 0);
+}
+
+image_format_t get_image_format(const char *filename) {
+  assert(filename);
+
+  if (has_extension(filename, ".qoi")) {
+    return QOI_IMAGE;
+  }
+  if (has_extension(filename, ".ppm")) {
+    return PPM_IMAGE;
+  }
+  if (has_extension(filename, ".pam")) {
+    return PAM_IMAGE;
+  }
+  return PNG_IMAGE;
+}
+
+int is_raw_image(image_format_t format) {
+  return (format == PPM_IMAGE) || (format == PAM_IMAGE);
+}
+
+int get_bytes_per_pixel(image_format_t format) {
+  return (format == PAM_IMAGE) ? 4 : RGB_SIZE;
+}
+
+int get_image_header(image_format_t format, int width, int height,
+                     char *header) {
+  assert(is_raw_image(format));
+
+  int len = (format == PAM_IMAGE)
+                ? snprintf(header, MAX_IMAGE_HEADER_LEN,
+                           "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\n"
+                           "TUPLTYPE RGB_ALPHA\nENDHDR\n",
+                           width, height)
+                : snprintf(header, MAX_IMAGE_HEADER_LEN, "P6\n%d %d\n255\n",
+                           width, height);
+  assert((len > 0) && (len < MAX_IMAGE_HEADER_LEN));
+  return len;
+}
+
+void convert_pixels(image_format_t format, const SDL_PixelFormat *pixel_format,
+                    const uint32_t *pixels, int n_pixels, uint8_t *dst) {
+  int bpp = get_bytes_per_pixel(format);
+  for (int i = 0; i < n_pixels; ++i) {
+    uint8_t alpha = 0;
+    SDL_GetRGBA(pixels[i], pixel_format, &dst[0], &dst[1], &dst[2], &alpha);
+    if (bpp == 4) {
+      dst[3] = alpha;
+    }
+    dst += bpp;
+  }
+}
+
+void convert_rows(const SDL_Surface *surface, int first_row, int n_rows,
+                  uint8_t *dst) {
+  const uint8_t *pixels = (const uint8_t *) surface->pixels;
+  for (int y = first_row; y < first_row + n_rows; ++y) {
+    convert_pixels(PNG_IMAGE, surface->format,
+                   (const uint32_t *) (pixels + y * surface->pitch),
+                   surface->w, dst);
+    dst += surface->w * RGB_SIZE;
+  }
+}
+
+void write_be32(uint8_t *dst, uint32_t value) {
+  dst[0] = value >> 24;
+  dst[1] = value >> 16;
+  dst[2] = value >> 8;
+  dst[3] = value;
+}
+
+
+
+int paeth_predictor(int left, int up, int up_left) {
+  int p         = left + up - up_left;
+  int left_d    = abs(p - left);
+  int up_d      = abs(p - up);
+  int up_left_d = abs(p - up_left);
+  if ((left_d <= up_d) && (left_d <= up_left_d)) {
+    return left;
+  }
+  return (up_d <= up_left_d) ? up : up_left;
+}
+
+// the row is filtered with every filter and the one with the least sum of
+// the bytes taken as signed is kept, as libpng does; 'dst' gets the type of
+// the filter and the filtered row
+void filter_png_row(const uint8_t *row, const uint8_t *above, int size,
+                    uint8_t *filtered, uint8_t *dst) {
+  unsigned long best_sum = ULONG_MAX;
+  for (int filter = 0; filter < PNG_N_FILTERS; ++filter) {
+    unsigned long sum = 0;
+    for (int i = 0; i < size; ++i) {
+      int left      = (i >= RGB_SIZE) ? row[i - RGB_SIZE] : 0;
+      int up_left   = (i >= RGB_SIZE) ? above[i - RGB_SIZE] : 0;
+      int predicted = 0;
+      switch (filter) {
+      case 1:
+        predicted = left;
+        break;
+      case 2:
+        predicted = above[i];
+        break;
+      case 3:
+        predicted = (left + above[i]) / 2;
+        break;
+      case 4:
+        predicted = paeth_predictor(left, above[i], up_left);
+        break;
+      }
+
+      filtered[i] = (uint8_t)(row[i] - predicted);
+      sum += (filtered[i] < 128) ? filtered[i] : 256 - filtered[i];
+    }
+
+    if (sum < best_sum) {
+      best_sum = sum;
+      dst[0]   = filter;
+      memcpy(dst + 1, filtered, size);
+    }
+  }
+}
+
+size_t get_png_strip_size(const image_encoder_t *encoder, int strip) {
+  int first_row = strip * TILE_SIZE;
+  int n_rows    = (encoder->height - first_row < TILE_SIZE)
+                   ? encoder->height - first_row
+                   : TILE_SIZE;
+  return (size_t) n_rows * (1 + encoder->width * RGB_SIZE);
+}
+
+// the strip is deflated into blocks of its own which end on a byte boundary
+// and, unless the strip is the last one, aren't final, so the strips are
+// joined by concatenation
+void encode_png_strip(const image_encoder_t *encoder,
+                      const SDL_Surface *surface, int strip,
+                      encoded_strip_t *encoded) {
+  int    first_row = strip * TILE_SIZE;
+  size_t size      = get_png_strip_size(encoder, strip);
+  int    row_size  = encoder->width * RGB_SIZE;
+  int    n_rows    = size / (1 + row_size);
+
+  // the row above the strip comes first, it is all zeros for the first strip
+  uint8_t *rows     = calloc((size_t)(n_rows + 1) * row_size + 1, 1);
+  uint8_t *filtered = malloc(row_size + 1);
+  uint8_t *data     = malloc(size + 1);
+  assert(rows && filtered && data);
+
+  if (first_row > 0) {
+    convert_rows(surface, first_row - 1, n_rows + 1, rows);
+  } else {
+    convert_rows(surface, first_row, n_rows, rows + row_size);
+  }
+  for (int y = 0; y < n_rows; ++y) {
+    filter_png_row(rows + (size_t)(y + 1) * row_size,
+                   rows + (size_t) y * row_size, row_size, filtered,
+                   data + (size_t) y * (1 + row_size));
+  }
+  free(rows);
+  free(filtered);
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                   PNG_MEM_LEVEL, Z_FILTERED) != Z_OK) {
+    fprintf(stderr, "Can't allocate deflate stream\n");
+    exit(EXIT_FAILURE);
+  }
+
+  int      is_last  = (strip == encoder->n_strips - 1);
+  size_t   capacity = deflateBound(&stream, size) + PNG_FLUSH_SLACK;
+  uint8_t *out      = malloc(capacity);
+  assert(out);
+
+  stream.next_in   = data;
+  stream.avail_in  = size;
+  stream.next_out  = out;
+  stream.avail_out = capacity;
+  int res          = deflate(&stream, is_last ? Z_FINISH : Z_SYNC_FLUSH);
+  if ((stream.avail_in != 0) ||
+      (is_last ? (res != Z_STREAM_END)
+               : ((res != Z_OK) || (stream.avail_out == 0)))) {
+    fprintf(stderr, "Can't deflate strip #%d\n", strip);
+    exit(EXIT_FAILURE);
+  }
+
+  encoded->data  = out;
+  encoded->size  = capacity - stream.avail_out;
+  encoded->adler = adler32(adler32(0, NULL, 0), data, size);
+
+  deflateEnd(&stream);
+  free(data);
+}
+
+
+
+uint32_t pack_qoi_pixel(const uint8_t *rgb) {
+  return ((uint32_t) rgb[0] << 24) | ((uint32_t) rgb[1] << 16) |
+         ((uint32_t) rgb[2] << 8) | 0xFF;
+}
+
+int get_qoi_hash(uint32_t pixel) {
+  int r = (pixel >> 24) & 0xFF;
+  int g = (pixel >> 16) & 0xFF;
+  int b = (pixel >> 8) & 0xFF;
+  int a = pixel & 0xFF;
+  return (r * 3 + g * 5 + b * 7 + a * 11) % QOI_INDEX_SIZE;
+}
+
+uint8_t *encode_qoi_pixel(uint32_t pixel, uint32_t prev, uint8_t *dst) {
+  int8_t dr = (int8_t)((pixel >> 24) - (prev >> 24));
+  int8_t dg = (int8_t)((pixel >> 16) - (prev >> 16));
+  int8_t db = (int8_t)((pixel >> 8) - (prev >> 8));
+  int    dr_dg = dr - dg;
+  int    db_dg = db - dg;
+
+  if ((dr >= -2) && (dr <= 1) && (dg >= -2) && (dg <= 1) && (db >= -2) &&
+      (db <= 1)) {
+    *dst++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+  } else if ((dg >= -32) && (dg <= 31) && (dr_dg >= -8) && (dr_dg <= 7) &&
+             (db_dg >= -8) && (db_dg <= 7)) {
+    *dst++ = QOI_OP_LUMA | (dg + 32);
+    *dst++ = (dr_dg + 8) << 4 | (db_dg + 8);
+  } else {
+    *dst++ = QOI_OP_RGB;
+    *dst++ = pixel >> 24;
+    *dst++ = pixel >> 16;
+    *dst++ = pixel >> 8;
+  }
+  return dst;
+}
+
+// the decoder keeps the last pixel of every hash in its index, so the strip
+// starts with the index of the last pixels of the strip above; the hashes
+// which don't occur there stay empty and aren't used until the strip sets
+// them, so the encoder never refers to a pixel the decoder doesn't have
+void encode_qoi_strip(const image_encoder_t *encoder,
+                      const SDL_Surface *surface, int strip,
+                      encoded_strip_t *encoded) {
+  int first_row = strip * TILE_SIZE;
+  int n_rows    = (encoder->height - first_row < TILE_SIZE)
+                   ? encoder->height - first_row
+                   : TILE_SIZE;
+  int n_above   = (first_row > 0) ? TILE_SIZE : 0;
+  int width     = encoder->width;
+
+  uint8_t *rgb = malloc((size_t)(n_above + n_rows) * width * RGB_SIZE + 1);
+  uint8_t *out = malloc((size_t) n_rows * width * QOI_MAX_CHUNK + 1);
+  assert(rgb && out);
+  convert_rows(surface, first_row - n_above, n_above + n_rows, rgb);
+
+  uint32_t index[QOI_INDEX_SIZE] = {0};
+  uint32_t prev                  = 0xFF;
+  for (int i = n_above * width - 1; i >= 0; --i) {
+    uint32_t pixel = pack_qoi_pixel(rgb + (size_t) i * RGB_SIZE);
+    int      hash  = get_qoi_hash(pixel);
+    index[hash]    = (index[hash] == 0) ? pixel : index[hash];
+  }
+  if (n_above > 0) {
+    prev = pack_qoi_pixel(rgb + ((size_t) n_above * width - 1) * RGB_SIZE);
+  }
+
+  uint8_t *dst = out;
+  int      run = 0;
+  for (size_t i = (size_t) n_above * width;
+       i < (size_t)(n_above + n_rows) * width; ++i) {
+    uint32_t pixel = pack_qoi_pixel(rgb + i * RGB_SIZE);
+    if (pixel == prev) {
+      if (++run == QOI_MAX_RUN) {
+        *dst++ = QOI_OP_RUN | (run - 1);
+        run    = 0;
+      }
+      continue;
+    }
+
+    if (run > 0) {
+      *dst++ = QOI_OP_RUN | (run - 1);
+      run    = 0;
+    }
+
+    int hash = get_qoi_hash(pixel);
+    if (index[hash] == pixel) {
+      *dst++ = QOI_OP_INDEX | hash;
+    } else {
+      index[hash] = pixel;
+      dst         = encode_qoi_pixel(pixel, prev, dst);
+    }
+    prev = pixel;
+  }
+  if (run > 0) {
+    *dst++ = QOI_OP_RUN | (run - 1);
+  }
+
+  encoded->data  = out;
+  encoded->size  = dst - out;
+  encoded->adler = 0;
+  free(rgb);
+}
+
+
+
+void image_encoder_init(image_encoder_t *encoder, const char *filename,
+                        int width, int height) {
+  assert(encoder);
+  assert((width > 0) && (height > 0));
+
+  encoder->format       = get_image_format(filename);
+  encoder->width        = width;
+  encoder->height       = height;
+  encoder->n_strips     = 0;
+  encoder->n_tiles_left = NULL;
+  encoder->strips       = NULL;
+  if (is_raw_image(encoder->format)) {
+    return;
+  }
+
+  int n_cols            = (width + TILE_SIZE - 1) / TILE_SIZE;
+  encoder->n_strips     = (height + TILE_SIZE - 1) / TILE_SIZE;
+  encoder->n_tiles_left = malloc(encoder->n_strips * sizeof(_Atomic int));
+  encoder->strips = calloc(encoder->n_strips, sizeof(encoded_strip_t));
+  assert(encoder->n_tiles_left && encoder->strips);
+
+  for (int i = 0; i < encoder->n_strips; ++i) {
+    atomic_init(&encoder->n_tiles_left[i], (i > 0) ? 2 * n_cols : n_cols);
+  }
+}
+
+void image_encoder_free(image_encoder_t *encoder) {
+  for (int i = 0; i < encoder->n_strips; ++i) {
+    free(encoder->strips[i].data);
+  }
+  free(encoder->n_tiles_left);
+  free(encoder->strips);
+  encoder->n_tiles_left = NULL;
+  encoder->strips       = NULL;
+  encoder->n_strips     = 0;
+}
+
+void encode_strip(const image_encoder_t *encoder, const SDL_Surface *surface,
+                  int strip) {
+  if (encoder->format == QOI_IMAGE) {
+    encode_qoi_strip(encoder, surface, strip, &encoder->strips[strip]);
+  } else {
+    encode_png_strip(encoder, surface, strip, &encoder->strips[strip]);
+  }
+}
+
+void image_encoder_add_tile(image_encoder_t *encoder,
+                            const SDL_Surface *surface, tile_t tile) {
+  int strip = tile.y / TILE_SIZE;
+  for (int i = strip; (i <= strip + 1) && (i < encoder->n_strips); ++i) {
+    if (atomic_fetch_sub(&encoder->n_tiles_left[i], 1) == 1) {
+      encode_strip(encoder, surface, i);
+    }
+  }
+}
+
+
+
+int write_png_chunk(FILE *file, const char *type, const uint8_t *data,
+                    size_t size) {
+  // zlib takes a NULL buffer for a request of the initial value
+  uLong crc = crc32(crc32(0, NULL, 0), (const Bytef *) type, 4);
+  if (size > 0) {
+    crc = crc32(crc, data, size);
+  }
+
+  uint8_t length[4];
+  uint8_t checksum[4];
+  write_be32(length, size);
+  write_be32(checksum, crc);
+
+  return ((fwrite(length, 1, 4, file) == 4) &&
+          (fwrite(type, 1, 4, file) == 4) &&
+          ((size == 0) || (fwrite(data, 1, size, file) == size)) &&
+          (fwrite(checksum, 1, 4, file) == 4))
+             ? 0
+             : -1;
+}
+
+// the zlib header and the checksum of the stream get IDAT chunks of their
+// own, every strip gets one between them
+int write_png(FILE *file, const image_encoder_t *encoder) {
+  uint8_t header[PNG_IHDR_SIZE] = {0};
+  write_be32(header, encoder->width);
+  write_be32(header + 4, encoder->height);
+  header[8] = PNG_BIT_DEPTH;
+  header[9] = PNG_COLOR_TYPE;
+
+  const uint8_t zlib_header[] = {ZLIB_CMF, ZLIB_FLG};
+  int res = (fwrite(PNG_SIGNATURE, 1, sizeof(PNG_SIGNATURE), file) ==
+             sizeof(PNG_SIGNATURE))
+                ? 0
+                : -1;
+  res |= write_png_chunk(file, "IHDR", header, PNG_IHDR_SIZE);
+  res |= write_png_chunk(file, "IDAT", zlib_header, sizeof(zlib_header));
+
+  uLong adler = adler32(0, NULL, 0);
+  for (int i = 0; (res == 0) && (i < encoder->n_strips); ++i) {
+    const encoded_strip_t *strip = &encoder->strips[i];
+    res |= write_png_chunk(file, "IDAT", strip->data, strip->size);
+    adler = adler32_combine(adler, strip->adler,
+                            get_png_strip_size(encoder, i));
+  }
+
+  uint8_t checksum[4];
+  write_be32(checksum, adler);
+  res |= write_png_chunk(file, "IDAT", checksum, sizeof(checksum));
+  res |= write_png_chunk(file, "IEND", NULL, 0);
+  return res;
+}
+
+int write_qoi(FILE *file, const image_encoder_t *encoder) {
+  uint8_t header[QOI_HEADER_SIZE] = {'q', 'o', 'i', 'f'};
+  write_be32(header + 4, encoder->width);
+  write_be32(header + 8, encoder->height);
+  header[12] = RGB_SIZE;
+  header[13] = 0; // sRGB with linear alpha
+
+  int res =
+      (fwrite(header, 1, QOI_HEADER_SIZE, file) == QOI_HEADER_SIZE) ? 0 : -1;
+  for (int i = 0; (res == 0) && (i < encoder->n_strips); ++i) {
+    const encoded_strip_t *strip = &encoder->strips[i];
+    res = (fwrite(strip->data, 1, strip->size, file) == strip->size) ? 0 : -1;
+  }
+
+  if ((res == 0) &&
+      (fwrite(QOI_END, 1, sizeof(QOI_END), file) != sizeof(QOI_END))) {
+    res = -1;
+  }
+  return res;
+}
+
+int write_raw_image(FILE *file, const SDL_Surface *surface,
+                    image_format_t format) {
+  char header[MAX_IMAGE_HEADER_LEN];
+  int  header_len = get_image_header(format, surface->w, surface->h, header);
+  int  row_size   = surface->w * get_bytes_per_pixel(format);
+
+  uint8_t *row = malloc(row_size);
+  assert(row);
+  int res = (fwrite(header, 1, header_len, file) == (size_t) header_len)
+                ? 0
+                : -1;
+
+  for (int y = 0; (res == 0) && (y < surface->h); ++y) {
+    const uint8_t *pixels = (const uint8_t *) surface->pixels;
+    convert_pixels(format, surface->format,
+                   (const uint32_t *) (pixels + y * surface->pitch),
+                   surface->w, row);
+    res = (fwrite(row, 1, row_size, file) == (size_t) row_size) ? 0 : -1;
+  }
+
+  free(row);
+  return res;
+}
+
+int image_encoder_save(image_encoder_t *encoder, const SDL_Surface *surface,
+                       const char *filename, int n_threads) {
+  assert(encoder);
+  assert(surface);
+  assert(filename);
+  assert((surface->w == encoder->width) && (surface->h == encoder->height));
+  assert(n_threads > 0);
+
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic)            \
+    default(none) shared(encoder, surface)
+  for (int i = 0; i < encoder->n_strips; ++i) {
+    if (encoder->strips[i].data == NULL) {
+      encode_strip(encoder, surface, i);
+    }
+  }
+
+  FILE *file = fopen(filename, "wb");
+  if (file == NULL) {
+    SDL_SetError("can't open %s", filename);
+    return -1;
+  }
+
+  int res = 0;
+  switch (encoder->format) {
+  case PNG_IMAGE:
+    res = write_png(file, encoder);
+    break;
+  case QOI_IMAGE:
+    res = write_qoi(file, encoder);
+    break;
+  default:
+    res = write_raw_image(file, surface, encoder->format);
+    break;
+  }
+
+  if (fclose(file) != 0) {
+    res = -1;
+  }
+  if (res != 0) {
+    SDL_SetError("can't write %s", filename);
+  }
+  return res;
+}
+
+int save_image(const SDL_Surface *surface, const char *filename,
+               int n_threads) {
+  image_encoder_t encoder;
+  image_encoder_init(&encoder, filename, surface->w, surface->h);
+  int res = image_encoder_save(&encoder, surface, filename, n_threads);
+  image_encoder_free(&encoder);
+  return res;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "tiles.h"
+
+#include <SDL2/SDL.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+// Images are saved as PNG unless the file name ends with ".qoi" (QOI of RGB
+// pixels), ".ppm" (binary PPM of RGB pixels) or ".pam" (PAM of RGB_ALPHA
+// tuples). PPM and PAM are uncompressed with a header of known length, so
+// every pixel has its place in the file and parts of the image can be written
+// apart.
+//
+// PNG and QOI are compressed by strips of TILE_SIZE rows, every strip apart
+// from the others: a PNG strip is filtered against the last row of the strip
+// above and deflated into blocks of its own, which are joined into one zlib
+// stream; a QOI strip starts from the pixel before it and from the index of
+// colors the strip above leaves. So the strips of an image are encoded in
+// parallel and a strip may be encoded as soon as it and the strip above are
+// drawn, while the rest of the image is still being drawn.
+
+typedef enum {
+  PNG_IMAGE,
+  QOI_IMAGE,
+  PPM_IMAGE,
+  PAM_IMAGE,
+} image_format_t;
+
+enum {
+  MAX_IMAGE_HEADER_LEN = 128,
+};
+
+typedef struct {
+  uint8_t *data;
+  size_t   size;
+
+  // adler32 of the filtered rows of a PNG strip
+  uint32_t adler;
+} encoded_strip_t;
+
+// strips are encoded once the tiles they need are drawn; 'n_tiles_left' of a
+// strip counts down the tiles of the strip and of the one above it
+typedef struct {
+  image_format_t format;
+  int            width;
+  int            height;
+
+  int              n_strips;
+  _Atomic int *    n_tiles_left;
+  encoded_strip_t *strips;
+} image_encoder_t;
+
+
+
+image_format_t get_image_format(const char *filename);
+// whether every pixel has a fixed offset in the file
+int is_raw_image(image_format_t format);
+
+// bytes of a pixel in the file before the compression
+int get_bytes_per_pixel(image_format_t format);
+// for the raw formats only, 'header' gets MAX_IMAGE_HEADER_LEN bytes at most,
+// returns the length
+int get_image_header(image_format_t format, int width, int height,
+                     char *header);
+// 'dst' gets the pixels in the format of the file
+void convert_pixels(image_format_t format, const SDL_PixelFormat *pixel_format,
+                    const uint32_t *pixels, int n_pixels, uint8_t *dst);
+
+
+
+// the format is taken from the file name
+void image_encoder_init(image_encoder_t *encoder, const char *filename,
+                        int width, int height);
+void image_encoder_free(image_encoder_t *encoder);
+
+// to be called by the thread which has drawn the tile; the strips the tile
+// completes are encoded by that thread right away, the surface must not
+// change after that
+void image_encoder_add_tile(image_encoder_t *encoder,
+                            const SDL_Surface *surface, tile_t tile);
+
+// the strips which aren't encoded yet are encoded on 'n_threads' threads;
+// returns 0 or -1 with the SDL error set
+int image_encoder_save(image_encoder_t *encoder, const SDL_Surface *surface,
+                       const char *filename, int n_threads);
+
+// returns 0 or -1 with the SDL error set
+int save_image(const SDL_Surface *surface, const char *filename,
+               int n_threads);
@@ -0,0 +1,43 @@
+#include "mapped_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+
+int map_file(const char *filename, mapped_file_t *mapped) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  mapped->size = st.st_size;
+  mapped->data = NULL;
+  if (mapped->size > 0) {
+    void *data = mmap(NULL, mapped->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    mapped->data = data;
+  }
+
+  close(fd);
+  return 0;
+}
+
+void unmap_file(mapped_file_t *mapped) {
+  if (mapped->data != NULL) {
+    munmap((void *) mapped->data, mapped->size);
+  }
+  mapped->data = NULL;
+  mapped->size = 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+// read-only mapping of a whole file, 'data' is NULL for an empty file
+typedef struct {
+  const uint8_t *data;
+  size_t         size;
+} mapped_file_t;
+
+int  map_file(const char *filename, mapped_file_t *mapped);
+void unmap_file(mapped_file_t *mapped);
@@ -0,0 +1,1072 @@
+#include "mpi_render.h"
+#include "image_file.h"
+#include "pack_cache.h"
+#include "ray_casting.h"
+#include "ray_tracer.h"
+#include "scene.h"
+#include "tiles.h"
+
+#define EXIT_ON_FAIL
+#include "mpi_error.h"
+#include "sdl_error.h"
+
+#include <mpi/mpi.h>
+
+#include <SDL2/SDL.h>
+
+#include <assert.h>
+#include <limits.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+
+enum {
+  TILE_TAG,
+  RESULT_TAG,
+  NODE_TILES_TAG,
+  NODE_PART_TAG,
+};
+
+enum {
+  // batches of tiles a worker holds at once: it renders one while the
+  // request for the next one is served
+  TILES_IN_FLIGHT = 2,
+  NO_TILE         = -1,
+};
+
+enum {
+  // MPI counts are ints, so the serialized pack is broadcast by chunks and
+  // the tiles of a rank are written as blocks of a derived type
+  BCAST_CHUNK_SIZE = 1 << 30,
+  IO_BLOCK_SIZE    = 1 << 30,
+};
+
+
+
+// ranks of a node keep the pack and draw the frame in memory they share, the
+// first rank of every node is its leader and talks to the other nodes
+void init_node_layout(node_layout_t *nodes) {
+  int rank = -1;
+  TRY_MPI(MPI_Comm_rank(MPI_COMM_WORLD, &rank));
+  TRY_MPI(MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank,
+                              MPI_INFO_NULL, &nodes->node_comm));
+  TRY_MPI(MPI_Comm_rank(nodes->node_comm, &nodes->node_rank));
+  TRY_MPI(MPI_Comm_size(nodes->node_comm, &nodes->node_size));
+
+  // ordered by the ranks, so the root is the leader of its node and the root
+  // of the leaders
+  int is_leader = (nodes->node_rank == 0);
+  TRY_MPI(MPI_Comm_split(MPI_COMM_WORLD, is_leader ? 0 : MPI_UNDEFINED, rank,
+                         &nodes->leader_comm));
+
+  int layout[3] = {rank, 0, 0};
+  if (is_leader) {
+    int leader_rank = -1;
+    TRY_MPI(MPI_Comm_rank(nodes->leader_comm, &leader_rank));
+    TRY_MPI(MPI_Exscan(&nodes->node_size, &layout[1], 1, MPI_INT, MPI_SUM,
+                       nodes->leader_comm));
+    layout[1] = (leader_rank == ROOT_RANK) ? 0 : layout[1];
+    TRY_MPI(MPI_Comm_size(nodes->leader_comm, &layout[2]));
+  }
+
+  TRY_MPI(MPI_Bcast(layout, 3, MPI_INT, 0, nodes->node_comm));
+  nodes->is_root_node = (layout[0] == ROOT_RANK);
+  nodes->node_first   = layout[1];
+  nodes->n_nodes      = layout[2];
+
+  nodes->node_firsts = NULL;
+  if (is_leader) {
+    int size = -1;
+    TRY_MPI(MPI_Comm_size(MPI_COMM_WORLD, &size));
+    nodes->node_firsts = malloc((nodes->n_nodes + 1) * sizeof(int));
+    assert(nodes->node_firsts);
+    TRY_MPI(MPI_Allgather(&nodes->node_first, 1, MPI_INT, nodes->node_firsts,
+                          1, MPI_INT, nodes->leader_comm));
+    nodes->node_firsts[nodes->n_nodes] = size;
+  }
+}
+
+void free_node_layout(node_layout_t *nodes) {
+  free(nodes->node_firsts);
+  nodes->node_firsts = NULL;
+  if (nodes->leader_comm != MPI_COMM_NULL) {
+    TRY_MPI(MPI_Comm_free(&nodes->leader_comm));
+  }
+  TRY_MPI(MPI_Comm_free(&nodes->node_comm));
+}
+
+
+
+// the leader of every node allocates 'size' bytes shared by the ranks of the
+// node; they are accessed with plain loads and stores, so the window stays
+// locked until it is freed and the stores are published by sync_node_window
+uint8_t *alloc_node_window(const node_layout_t *nodes, size_t size,
+                           MPI_Win *win) {
+  uint8_t *base       = NULL;
+  MPI_Aint local_size = (nodes->node_rank == 0) ? (MPI_Aint) size : 0;
+  TRY_MPI(MPI_Win_allocate_shared(local_size, 1, MPI_INFO_NULL,
+                                  nodes->node_comm, &base, win));
+
+  MPI_Aint shared_size = 0;
+  int      disp_unit   = 0;
+  TRY_MPI(MPI_Win_shared_query(*win, 0, &shared_size, &disp_unit, &base));
+  TRY_MPI(MPI_Win_lock_all(MPI_MODE_NOCHECK, *win));
+  return base;
+}
+
+// the stores of every rank of the node are seen by all of them after it
+void sync_node_window(const node_layout_t *nodes, MPI_Win win) {
+  TRY_MPI(MPI_Win_sync(win));
+  TRY_MPI(MPI_Barrier(nodes->node_comm));
+  TRY_MPI(MPI_Win_sync(win));
+}
+
+void free_node_window(MPI_Win *win) {
+  TRY_MPI(MPI_Win_unlock_all(*win));
+  TRY_MPI(MPI_Win_free(win));
+}
+
+
+
+// tiles a rank keeps when every rank writes its own tiles to the output file:
+// slot i has TILE_SIZE x TILE_SIZE pixels for tile tiles[i], its rows are as
+// long as the tile is wide
+typedef struct {
+  int *     tiles;
+  uint32_t *slots;
+  int       n_tiles;
+  int       capacity;
+} tile_slots_t;
+
+// the last 'n_tiles' of the slots are left for the tiles to draw
+void add_tile_slots(tile_slots_t *slots, const int *tiles, int first,
+                    int n_tiles) {
+  if (slots->n_tiles + n_tiles > slots->capacity) {
+    slots->capacity = 2 * slots->capacity + n_tiles;
+    slots->tiles    = realloc(slots->tiles, slots->capacity * sizeof(int));
+    slots->slots    = realloc(slots->slots, (size_t) slots->capacity *
+                                             TILE_SIZE * TILE_SIZE *
+                                             sizeof(uint32_t));
+    assert(slots->tiles && slots->slots);
+  }
+
+  for (int i = 0; i < n_tiles; ++i) {
+    slots->tiles[slots->n_tiles++] = (tiles != NULL) ? tiles[i] : first + i;
+  }
+}
+
+void free_tile_slots(tile_slots_t *slots) {
+  free(slots->tiles);
+  free(slots->slots);
+  slots->tiles    = NULL;
+  slots->slots    = NULL;
+  slots->n_tiles  = 0;
+  slots->capacity = 0;
+}
+
+
+
+// the thread pool of a rank draws the tiles the rank has got, every thread
+// with a shadow cache of its own which lives as long as the frame
+typedef struct {
+  int             n_threads;
+  shadow_cache_t *caches;
+
+  // the tiles go to the slots rather than to the frame if there are any
+  tile_slots_t *slots;
+
+  // time the threads have been drawing for, summed over the threads
+  double busy_time;
+} rank_pool_t;
+
+void rank_pool_init(rank_pool_t *pool, const scene_t *scene, int n_threads,
+                    tile_slots_t *slots) {
+  pool->n_threads = n_threads;
+  pool->caches    = malloc(n_threads * sizeof(shadow_cache_t));
+  pool->slots     = slots;
+  pool->busy_time = 0;
+  assert(pool->caches);
+
+  for (int i = 0; i < n_threads; ++i) {
+    init_shadow_cache(&pool->caches[i], scene);
+  }
+}
+
+// 'stats' get the shadow cache statistics of all the threads
+void rank_pool_free(rank_pool_t *pool, long long *stats) {
+  stats[0] = stats[1] = stats[2] = 0;
+  for (int i = 0; i < pool->n_threads; ++i) {
+    stats[0] += pool->caches[i].n_queries;
+    stats[1] += pool->caches[i].n_shadowed;
+    stats[2] += pool->caches[i].n_hits;
+    shadow_cache_free(&pool->caches[i]);
+  }
+
+  free(pool->caches);
+  pool->caches = NULL;
+}
+
+// the threads share the tiles with the work-stealing scheduler and draw them
+// right into the frame or into the slots of the pool; 'tiles' lists indices
+// of the tiles, without it the tiles are 'first', 'first' + 1 and so on; only
+// the thread which called it makes MPI calls, so MPI_THREAD_FUNNELED is enough
+void draw_tiles(rank_pool_t *pool, const scene_pack_t *pack, int scene_idx,
+                int packet_side, SDL_PixelFormat *format, uint32_t *frame,
+                const int *tiles, int first, int n_tiles) {
+  const scene_t *scene = &pack->scenes[scene_idx];
+  tile_slots_t * slots = pool->slots;
+  int            slot  = -1;
+  if (slots != NULL) {
+    add_tile_slots(slots, tiles, first, n_tiles);
+    slot = slots->n_tiles - n_tiles;
+  }
+
+  tile_scheduler_t scheduler;
+  if (tile_scheduler_init(&scheduler, n_tiles, pool->n_threads) != 0) {
+    fprintf(stderr, "Can't allocate tile scheduler\n");
+    exit(EXIT_FAILURE);
+  }
+
+  double busy_time = 0;
+#pragma omp parallel num_threads(pool->n_threads) default(none)               \
+    shared(pool, pack, scene_idx, scene, packet_side, format, frame, tiles,   \
+           first, slots, slot, scheduler) reduction(+ : busy_time)
+  {
+    int    worker = omp_get_thread_num();
+    double start  = omp_get_wtime();
+
+    int idx;
+    while ((idx = tile_scheduler_next(&scheduler, worker)) >= 0) {
+      int    tile_idx = (tiles != NULL) ? tiles[idx] : first + idx;
+      tile_t tile     = get_tile(scene->width, scene->height, tile_idx);
+      if (slots != NULL) {
+        draw_tile(pack, scene_idx, packet_side, &pool->caches[worker], format,
+                  tile,
+                  slots->slots + (size_t)(slot + idx) * TILE_SIZE * TILE_SIZE,
+                  tile.w);
+      } else {
+        draw_tile(pack, scene_idx, packet_side, &pool->caches[worker], format,
+                  tile, frame + tile.y * scene->width + tile.x, scene->width);
+      }
+    }
+
+    busy_time += omp_get_wtime() - start;
+  }
+
+  tile_scheduler_free(&scheduler);
+  pool->busy_time += busy_time;
+}
+
+
+
+// tiles go between the nodes as their pixels one tile after another, every
+// tile row by row; 'tiles' and 'first' select the tiles as in draw_tiles
+int get_tiles_size(const scene_t *scene, const int *tiles, int first,
+                   int n_tiles) {
+  int size = 0;
+  for (int i = 0; i < n_tiles; ++i) {
+    int    tile_idx = (tiles != NULL) ? tiles[i] : first + i;
+    tile_t tile     = get_tile(scene->width, scene->height, tile_idx);
+    size += tile.w * tile.h;
+  }
+  return size;
+}
+
+void pack_tiles(const scene_t *scene, const uint32_t *frame, const int *tiles,
+                int first, int n_tiles, uint32_t *buf) {
+  for (int i = 0; i < n_tiles; ++i) {
+    int    tile_idx = (tiles != NULL) ? tiles[i] : first + i;
+    tile_t tile     = get_tile(scene->width, scene->height, tile_idx);
+    for (int y = tile.y; y < tile.y + tile.h; ++y) {
+      memcpy(buf, frame + y * scene->width + tile.x,
+             tile.w * sizeof(uint32_t));
+      buf += tile.w;
+    }
+  }
+}
+
+void unpack_tiles(const scene_t *scene, uint32_t *frame, const int *tiles,
+                  int first, int n_tiles, const uint32_t *buf) {
+  for (int i = 0; i < n_tiles; ++i) {
+    int    tile_idx = (tiles != NULL) ? tiles[i] : first + i;
+    tile_t tile     = get_tile(scene->width, scene->height, tile_idx);
+    for (int y = tile.y; y < tile.y + tile.h; ++y) {
+      memcpy(frame + y * scene->width + tile.x, buf,
+             tile.w * sizeof(uint32_t));
+      buf += tile.w;
+    }
+  }
+}
+
+
+
+// the static schedule splits the tiles into equal ranges, the parts are
+// numbered node by node, so the parts of a node make one range; 'first' and
+// 'n_tiles' get the tiles of the parts from 'first_part' to 'end_part'
+void get_parts_of_scene(const scene_t *scene, int size, int first_part,
+                        int end_part, int *first, int *n_tiles) {
+  long long total = get_n_tiles(scene->width, scene->height);
+  *first          = total * first_part / size;
+  *n_tiles        = total * end_part / size - *first;
+}
+
+// every rank of the static schedule draws its part right into the frame of
+// its node or into its slots
+void draw_part_of_scene(rank_pool_t *pool, const scene_pack_t *pack,
+                        int scene_idx, int packet_side,
+                        SDL_PixelFormat *format, uint32_t *frame,
+                        const node_layout_t *nodes) {
+  assert(pack);
+  assert(pack->n_scenes > scene_idx);
+
+  int size = -1;
+  TRY_MPI(MPI_Comm_size(MPI_COMM_WORLD, &size));
+
+  int first   = -1;
+  int n_tiles = -1;
+  int part = nodes->node_first + nodes->node_rank;
+  get_parts_of_scene(&pack->scenes[scene_idx], size, part, part + 1, &first,
+                     &n_tiles);
+  draw_tiles(pool, pack, scene_idx, packet_side, format, frame, NULL, first,
+             n_tiles);
+}
+
+// the rows of the tiles in the frame, so the parts of the nodes go between
+// the frames without copies
+MPI_Datatype create_tiles_type(const scene_t *scene, int first, int n_tiles) {
+  int n_rows = 0;
+  for (int i = 0; i < n_tiles; ++i) {
+    n_rows += get_tile(scene->width, scene->height, first + i).h;
+  }
+
+  int *     lengths = malloc(n_rows * sizeof(int) + 1);
+  MPI_Aint *offsets = malloc(n_rows * sizeof(MPI_Aint) + 1);
+  assert(lengths && offsets);
+
+  n_rows = 0;
+  for (int i = 0; i < n_tiles; ++i) {
+    tile_t tile = get_tile(scene->width, scene->height, first + i);
+    for (int y = tile.y; y < tile.y + tile.h; ++y) {
+      lengths[n_rows] = tile.w;
+      offsets[n_rows] =
+          ((MPI_Aint) y * scene->width + tile.x) * sizeof(uint32_t);
+      n_rows++;
+    }
+  }
+
+  MPI_Datatype type;
+  TRY_MPI(MPI_Type_create_hindexed(n_rows, lengths, offsets, MPI_UINT32_T,
+                                   &type));
+  TRY_MPI(MPI_Type_commit(&type));
+  free(lengths);
+  free(offsets);
+  return type;
+}
+
+// receives the root has posted for the parts of the other nodes
+typedef struct {
+  int           n_parts;
+  MPI_Request * requests;
+  MPI_Datatype *types;
+} node_parts_t;
+
+// the root posts the receives before it draws its own part, so the parts of
+// the other nodes land in its frame while its node is still drawing
+void post_node_parts(const scene_t *scene, uint32_t *frame,
+                     const node_layout_t *nodes, node_parts_t *parts) {
+  parts->n_parts  = 0;
+  parts->requests = NULL;
+  parts->types    = NULL;
+  if (!nodes->is_root_node || (nodes->leader_comm == MPI_COMM_NULL)) {
+    return;
+  }
+
+  int size = -1;
+  TRY_MPI(MPI_Comm_size(MPI_COMM_WORLD, &size));
+
+  parts->n_parts  = nodes->n_nodes - 1;
+  parts->requests = malloc(parts->n_parts * sizeof(MPI_Request) + 1);
+  parts->types    = malloc(parts->n_parts * sizeof(MPI_Datatype) + 1);
+  assert(parts->requests && parts->types);
+
+  for (int i = 0; i < parts->n_parts; ++i) {
+    int node    = i + 1;
+    int first   = -1;
+    int n_tiles = -1;
+    get_parts_of_scene(scene, size, nodes->node_firsts[node],
+                       nodes->node_firsts[node + 1], &first, &n_tiles);
+    parts->types[i] = create_tiles_type(scene, first, n_tiles);
+    TRY_MPI(MPI_Irecv(frame, 1, parts->types[i], node, NODE_PART_TAG,
+                      nodes->leader_comm, &parts->requests[i]));
+  }
+}
+
+// the root waits for the parts once its own node has drawn its part
+void wait_node_parts(node_parts_t *parts) {
+  TRY_MPI(
+      MPI_Waitall(parts->n_parts, parts->requests, MPI_STATUSES_IGNORE));
+  for (int i = 0; i < parts->n_parts; ++i) {
+    TRY_MPI(MPI_Type_free(&parts->types[i]));
+  }
+  free(parts->requests);
+  free(parts->types);
+}
+
+// the leader of a node other than the root one sends the part of its node
+// right from the frame as soon as the node has drawn it; the root has posted
+// the receive long before
+void send_node_part(const scene_t *scene, const uint32_t *frame,
+                    const node_layout_t *nodes) {
+  if (nodes->is_root_node || (nodes->leader_comm == MPI_COMM_NULL)) {
+    return;
+  }
+
+  int size = -1;
+  TRY_MPI(MPI_Comm_size(MPI_COMM_WORLD, &size));
+
+  int first   = -1;
+  int n_tiles = -1;
+  get_parts_of_scene(scene, size, nodes->node_first,
+                     nodes->node_first + nodes->node_size, &first, &n_tiles);
+  MPI_Datatype type = create_tiles_type(scene, first, n_tiles);
+  TRY_MPI(MPI_Send(frame, 1, type, ROOT_RANK, NODE_PART_TAG,
+                   nodes->leader_comm));
+  TRY_MPI(MPI_Type_free(&type));
+}
+
+
+
+// worker side of the dynamic schedule: tiles come by batches of one tile per
+// thread and are drawn right into the frame of the node, so the root gets
+// back only the indices of a drawn batch, which is a request for one more
+// batch as well; 'tiles' get the indices and have room for one batch more
+// than the whole frame, returns their number
+int draw_batches_into_frame(rank_pool_t *pool, const scene_pack_t *pack,
+                            int scene_idx, int packet_side,
+                            SDL_PixelFormat *format, uint32_t *frame,
+                            int *tiles) {
+  assert(pack);
+  assert(pack->n_scenes > scene_idx);
+
+  int n_drawn = 0;
+
+  MPI_Request requests[TILES_IN_FLIGHT];
+  for (int i = 0; i < TILES_IN_FLIGHT; ++i) {
+    requests[i] = MPI_REQUEST_NULL;
+  }
+
+  for (int cur = 0;; cur = (cur + 1) % TILES_IN_FLIGHT) {
+    int *      batch = tiles + n_drawn;
+    int        n     = 0;
+    MPI_Status status;
+    TRY_MPI(MPI_Recv(batch, pool->n_threads, MPI_INT, ROOT_RANK, TILE_TAG,
+                     MPI_COMM_WORLD, &status));
+    TRY_MPI(MPI_Get_count(&status, MPI_INT, &n));
+    if (batch[0] == NO_TILE) {
+      break;
+    }
+
+    draw_tiles(pool, pack, scene_idx, packet_side, format, frame, batch, 0, n);
+    n_drawn += n;
+
+    // the batch stays in 'tiles', so only the request is waited for
+    TRY_MPI(MPI_Wait(&requests[cur], MPI_STATUS_IGNORE));
+    TRY_MPI(MPI_Isend(batch, n, MPI_INT, ROOT_RANK, RESULT_TAG,
+                      MPI_COMM_WORLD, &requests[cur]));
+  }
+
+  TRY_MPI(MPI_Waitall(TILES_IN_FLIGHT, requests, MPI_STATUSES_IGNORE));
+  return n_drawn;
+}
+
+
+
+typedef struct {
+  int n_tiles;
+  int next_tile;
+  int n_drawn;
+
+  // every rank has as many threads as the root, so a batch is a tile per
+  // thread
+  int  batch_size;
+  int *batch;
+
+  // workers which have got NO_TILE
+  int *is_stopped;
+} tile_dispatcher_t;
+
+void send_next_batch(tile_dispatcher_t *dispatcher, int worker) {
+  int n = dispatcher->n_tiles - dispatcher->next_tile;
+  n     = (n < dispatcher->batch_size) ? n : dispatcher->batch_size;
+  if (n > 0) {
+    for (int i = 0; i < n; ++i) {
+      dispatcher->batch[i] = dispatcher->next_tile++;
+    }
+  } else if (dispatcher->is_stopped[worker]) {
+    return;
+  } else {
+    dispatcher->is_stopped[worker] = 1;
+    dispatcher->batch[0]           = NO_TILE;
+    n                              = 1;
+  }
+
+  TRY_MPI(MPI_Send(dispatcher->batch, n, MPI_INT, worker, TILE_TAG,
+                   MPI_COMM_WORLD));
+}
+
+// the tiles are in the frame of the worker's node already, the worker gets
+// the next batch
+void receive_batch(tile_dispatcher_t *dispatcher) {
+  int        n = 0;
+  MPI_Status status;
+  TRY_MPI(MPI_Recv(dispatcher->batch, dispatcher->batch_size, MPI_INT,
+                   MPI_ANY_SOURCE, RESULT_TAG, MPI_COMM_WORLD, &status));
+  TRY_MPI(MPI_Get_count(&status, MPI_INT, &n));
+
+  send_next_batch(dispatcher, status.MPI_SOURCE);
+  dispatcher->n_drawn += n;
+}
+
+// root side of the dynamic schedule: the root renders batches as well and
+// serves requests of the workers between its own batches
+void dispatch_and_draw_tiles(rank_pool_t *pool, const scene_pack_t *pack,
+                             int scene_idx, int packet_side,
+                             SDL_PixelFormat *format, uint32_t *frame,
+                             int size) {
+  const scene_t *   scene      = &pack->scenes[scene_idx];
+  tile_dispatcher_t dispatcher = {get_n_tiles(scene->width, scene->height), 0,
+                                  0, pool->n_threads, NULL, NULL};
+  dispatcher.batch             = malloc(pool->n_threads * sizeof(int));
+  dispatcher.is_stopped        = calloc(size, sizeof(int));
+  assert(dispatcher.batch && dispatcher.is_stopped);
+
+  for (int i = 0; i < TILES_IN_FLIGHT; ++i) {
+    for (int worker = 1; worker < size; ++worker) {
+      send_next_batch(&dispatcher, worker);
+    }
+  }
+
+  while (dispatcher.n_drawn < dispatcher.n_tiles) {
+    int is_pending = 0;
+    TRY_MPI(MPI_Iprobe(MPI_ANY_SOURCE, RESULT_TAG, MPI_COMM_WORLD, &is_pending,
+                       MPI_STATUS_IGNORE));
+    if (is_pending || (dispatcher.next_tile == dispatcher.n_tiles)) {
+      receive_batch(&dispatcher);
+      continue;
+    }
+
+    int n = dispatcher.n_tiles - dispatcher.next_tile;
+    n     = (n < dispatcher.batch_size) ? n : dispatcher.batch_size;
+    draw_tiles(pool, pack, scene_idx, packet_side, format, frame, NULL,
+               dispatcher.next_tile, n);
+    dispatcher.next_tile += n;
+    dispatcher.n_drawn += n;
+  }
+
+  for (int worker = 1; worker < size; ++worker) {
+    send_next_batch(&dispatcher, worker);
+  }
+
+  free(dispatcher.batch);
+  free(dispatcher.is_stopped);
+}
+
+// the leader of a node other than the root one collects indices of the tiles
+// drawn on the node and sends them to the root in one message: their number,
+// the indices and the pixels of the tiles in the same order
+void send_node_tiles(const scene_t *scene, const uint32_t *frame,
+                     const int *tiles, int n_tiles,
+                     const node_layout_t *nodes) {
+  int  is_leader  = (nodes->node_rank == 0);
+  int *counts     = NULL;
+  int *firsts     = NULL;
+  int *node_tiles = NULL;
+  int  n          = 0;
+  if (is_leader) {
+    counts = malloc(nodes->node_size * sizeof(int));
+    firsts = malloc(nodes->node_size * sizeof(int));
+    assert(counts && firsts);
+  }
+
+  TRY_MPI(MPI_Gather(&n_tiles, 1, MPI_INT, counts, 1, MPI_INT, 0,
+                     nodes->node_comm));
+  for (int i = 0; is_leader && (i < nodes->node_size); ++i) {
+    firsts[i] = n;
+    n += counts[i];
+  }
+  if (is_leader) {
+    node_tiles = malloc(n * sizeof(int) + 1);
+    assert(node_tiles);
+  }
+
+  TRY_MPI(MPI_Gatherv(tiles, n_tiles, MPI_INT, node_tiles, counts, firsts,
+                      MPI_INT, 0, nodes->node_comm));
+  free(counts);
+  free(firsts);
+  if (!is_leader) {
+    return;
+  }
+
+  int       len     = 1 + n + get_tiles_size(scene, node_tiles, 0, n);
+  uint32_t *message = malloc(len * sizeof(uint32_t));
+  assert(message);
+  message[0] = n;
+  memcpy(message + 1, node_tiles, n * sizeof(int));
+  pack_tiles(scene, frame, node_tiles, 0, n, message + 1 + n);
+
+  TRY_MPI(MPI_Send(message, len, MPI_UINT32_T, ROOT_RANK, NODE_TILES_TAG,
+                   MPI_COMM_WORLD));
+  free(message);
+  free(node_tiles);
+}
+
+void receive_node_tiles(const scene_t *scene, uint32_t *frame,
+                        const node_layout_t *nodes) {
+  for (int i = 1; i < nodes->n_nodes; ++i) {
+    MPI_Status status;
+    int        len = 0;
+    TRY_MPI(MPI_Probe(MPI_ANY_SOURCE, NODE_TILES_TAG, MPI_COMM_WORLD,
+                      &status));
+    TRY_MPI(MPI_Get_count(&status, MPI_UINT32_T, &len));
+
+    uint32_t *message = malloc(len * sizeof(uint32_t));
+    assert(message);
+    TRY_MPI(MPI_Recv(message, len, MPI_UINT32_T, status.MPI_SOURCE,
+                     NODE_TILES_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
+
+    int n = message[0];
+    unpack_tiles(scene, frame, (const int *) message + 1, 0, n,
+                 message + 1 + n);
+    free(message);
+  }
+}
+
+
+
+// time the threads of every rank have been rendering for against the time
+// the rank has spent on the image since the ranks started it together at
+// 'start', and shadow cache statistics of all the ranks
+void report_utilization(const rank_pool_t *pool, double start,
+                        const long long *stats, int size, int rank) {
+  double *times = NULL;
+  if (rank == ROOT_RANK) {
+    times = malloc(2 * size * sizeof(double));
+    assert(times);
+  }
+
+  // the busy time of an average thread of the rank and the time of the rank
+  double own_times[2] = {pool->busy_time / pool->n_threads,
+                         MPI_Wtime() - start};
+  TRY_MPI(MPI_Gather(own_times, 2, MPI_DOUBLE, times, 2, MPI_DOUBLE,
+                     ROOT_RANK, MPI_COMM_WORLD));
+
+  if (rank == ROOT_RANK) {
+    printf("rendered in %.3f s\n", own_times[1]);
+    for (int i = 0; i < size; ++i) {
+      double busy_time    = times[2 * i];
+      double elapsed_time = times[2 * i + 1];
+      printf("  rank %d: busy %.3f s of %.3f s, utilization %.1f%%\n", i,
+             busy_time, elapsed_time,
+             (elapsed_time > 0) ? 100 * busy_time / elapsed_time : 100.0);
+    }
+    free(times);
+  }
+
+  long long total_stats[3];
+  TRY_MPI(MPI_Reduce(stats, total_stats, 3, MPI_LONG_LONG, MPI_SUM, ROOT_RANK,
+                     MPI_COMM_WORLD));
+  if (rank == ROOT_RANK) {
+    print_shadow_cache_stats(total_stats);
+  }
+}
+
+
+
+SDL_Surface *draw_scene_on_surface_parallel(const context_t *   ctx,
+                                            const scene_pack_t *pack,
+                                            int                 scene_idx) {
+  int size = -1;
+  int rank = -1;
+  TRY_MPI(MPI_Comm_size(MPI_COMM_WORLD, &size));
+  assert(size > ROOT_RANK);
+  TRY_MPI(MPI_Comm_rank(MPI_COMM_WORLD, &rank));
+  assert(rank >= 0);
+
+  // the ranks start the clocks together, so the times of the ranks compare
+  TRY_MPI(MPI_Barrier(MPI_COMM_WORLD));
+  const scene_t *scene = &pack->scenes[scene_idx];
+  double         start = MPI_Wtime();
+
+  rank_pool_t pool;
+  rank_pool_init(&pool, scene, ctx->n_threads, NULL);
+
+  const node_layout_t *nodes   = &ctx->nodes;
+  SDL_Surface *        surface = NULL;
+  SDL_PixelFormat *    format  = NULL;
+  if (rank == ROOT_RANK) {
+    surface = SDL_CreateRGBSurface(0, scene->width, scene->height,
+                                   SURFACE_DEPTH, 0, 0, 0, 0);
+    SDL_NOT_NULL(surface);
+    assert(surface->pitch == surface->w * (int) sizeof(uint32_t));
+    format = surface->format;
+  } else {
+    format = malloc(sizeof(SDL_PixelFormat));
+    assert(format);
+  }
+
+  TRY_MPI(MPI_Bcast(format, sizeof(SDL_PixelFormat), MPI_BYTE, ROOT_RANK,
+                    MPI_COMM_WORLD));
+
+  // the ranks of a node draw into one frame, so only the nodes exchange
+  // pixels
+  MPI_Win   window;
+  uint32_t *frame = (uint32_t *) alloc_node_window(
+      nodes, scene->width * scene->height * sizeof(uint32_t), &window);
+
+  if (ctx->schedule == STATIC_SCHEDULE) {
+    node_parts_t parts;
+    post_node_parts(scene, frame, nodes, &parts);
+    draw_part_of_scene(&pool, pack, scene_idx, ctx->packet_side, format,
+                       frame, nodes);
+    sync_node_window(nodes, window);
+    send_node_part(scene, frame, nodes);
+    wait_node_parts(&parts);
+  } else if (rank == ROOT_RANK) {
+    dispatch_and_draw_tiles(&pool, pack, scene_idx, ctx->packet_side, format,
+                            frame, size);
+    sync_node_window(nodes, window);
+    receive_node_tiles(scene, frame, nodes);
+  } else {
+    int  n_tiles = get_n_tiles(scene->width, scene->height);
+    int *tiles   = malloc((n_tiles + ctx->n_threads) * sizeof(int));
+    assert(tiles);
+    n_tiles = draw_batches_into_frame(&pool, pack, scene_idx,
+                                      ctx->packet_side, format, frame, tiles);
+    sync_node_window(nodes, window);
+    if (!nodes->is_root_node) {
+      send_node_tiles(scene, frame, tiles, n_tiles, nodes);
+    }
+    free(tiles);
+  }
+
+  if (rank == ROOT_RANK) {
+    memcpy(surface->pixels, frame,
+           scene->width * scene->height * sizeof(uint32_t));
+  } else {
+    free(format);
+  }
+  free_node_window(&window);
+
+  long long stats[3];
+  rank_pool_free(&pool, stats);
+  report_utilization(&pool, start, stats, size, rank);
+
+  return surface;
+}
+
+
+
+// a row of a tile kept in the slots, the rows go to the file in the order of
+// their offsets
+typedef struct {
+  MPI_Aint        offset;
+  const uint32_t *pixels;
+  int             n_pixels;
+} tile_row_t;
+
+int compare_tile_rows(const void *lhs, const void *rhs) {
+  MPI_Aint lhs_offset = ((const tile_row_t *) lhs)->offset;
+  MPI_Aint rhs_offset = ((const tile_row_t *) rhs)->offset;
+  return (lhs_offset > rhs_offset) - (lhs_offset < rhs_offset);
+}
+
+// 'size' bytes as one element: IO_BLOCK_SIZE-byte blocks and the rest;
+// returns -1 if there are more blocks than an int counts
+int create_bytes_type(size_t size, MPI_Datatype *type) {
+  size_t n_blocks = size / IO_BLOCK_SIZE;
+  if (n_blocks > INT_MAX) {
+    return -1;
+  }
+
+  MPI_Datatype block;
+  TRY_MPI(MPI_Type_contiguous(IO_BLOCK_SIZE, MPI_BYTE, &block));
+
+  int          lengths[2] = {(int) n_blocks, (int) (size % IO_BLOCK_SIZE)};
+  MPI_Aint     offsets[2] = {0, (MPI_Aint) n_blocks * IO_BLOCK_SIZE};
+  MPI_Datatype types[2]   = {block, MPI_BYTE};
+  TRY_MPI(MPI_Type_create_struct(2, lengths, offsets, types, type));
+  TRY_MPI(MPI_Type_commit(type));
+  TRY_MPI(MPI_Type_free(&block));
+  return 0;
+}
+
+// the root writes the header and every rank writes the rows of its tiles with
+// one collective write through a file view of the offsets of the rows;
+// returns -1 on every rank if the file can't be written
+int write_tile_slots(const scene_t *scene, const SDL_PixelFormat *format,
+                     const tile_slots_t *slots, const char *filename) {
+  int rank = -1;
+  TRY_MPI(MPI_Comm_rank(MPI_COMM_WORLD, &rank));
+
+  image_format_t image_format = get_image_format(filename);
+  int            bpp          = get_bytes_per_pixel(image_format);
+  char           header[MAX_IMAGE_HEADER_LEN];
+  int            header_len   = get_image_header(image_format, scene->width,
+                                          scene->height, header);
+
+  int n_rows = 0;
+  for (int i = 0; i < slots->n_tiles; ++i) {
+    n_rows += get_tile(scene->width, scene->height, slots->tiles[i]).h;
+  }
+
+  tile_row_t *rows    = malloc(n_rows * sizeof(tile_row_t) + 1);
+  int *       lengths = malloc(n_rows * sizeof(int) + 1);
+  MPI_Aint *  offsets = malloc(n_rows * sizeof(MPI_Aint) + 1);
+  assert(rows && lengths && offsets);
+
+  size_t size = 0;
+  n_rows      = 0;
+  for (int i = 0; i < slots->n_tiles; ++i) {
+    tile_t tile = get_tile(scene->width, scene->height, slots->tiles[i]);
+    for (int y = 0; y < tile.h; ++y) {
+      rows[n_rows].offset =
+          ((MPI_Aint)(tile.y + y) * scene->width + tile.x) * bpp;
+      rows[n_rows].pixels = slots->slots +
+                            (size_t) i * TILE_SIZE * TILE_SIZE + y * tile.w;
+      rows[n_rows].n_pixels = tile.w;
+      n_rows++;
+    }
+    size += (size_t) tile.w * tile.h * bpp;
+  }
+  qsort(rows, n_rows, sizeof(tile_row_t), compare_tile_rows);
+
+  uint8_t *buf = malloc(size + 1);
+  assert(buf);
+  uint8_t *pos = buf;
+  for (int i = 0; i < n_rows; ++i) {
+    convert_pixels(image_format, format, rows[i].pixels, rows[i].n_pixels,
+                   pos);
+    lengths[i] = rows[i].n_pixels * bpp;
+    offsets[i] = rows[i].offset;
+    pos += lengths[i];
+  }
+
+  MPI_Datatype file_type;
+  TRY_MPI(MPI_Type_create_hindexed(n_rows, lengths, offsets, MPI_BYTE,
+                                   &file_type));
+  TRY_MPI(MPI_Type_commit(&file_type));
+
+  // the tiles of a rank may take more than INT_MAX bytes
+  MPI_Datatype buf_type     = MPI_BYTE;
+  int          has_buf_type = (create_bytes_type(size, &buf_type) == 0);
+  if (!has_buf_type) {
+    fprintf(stderr, "Can't write %zu bytes of rank #%d at once\n", size,
+            rank);
+  }
+
+  // MPI-IO calls return their errors rather than abort
+  MPI_File   file;
+  MPI_Offset file_size =
+      header_len + (MPI_Offset) scene->width * scene->height * bpp;
+  int failed = !has_buf_type;
+  TRY_MPI(MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_LOR,
+                        MPI_COMM_WORLD));
+  failed = failed || (MPI_File_open(MPI_COMM_WORLD, filename,
+                                    MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                                    MPI_INFO_NULL, &file) != MPI_SUCCESS);
+  if (!failed) {
+    failed = (MPI_File_set_size(file, file_size) != MPI_SUCCESS);
+    if ((rank == ROOT_RANK) && !failed) {
+      failed = (MPI_File_write_at(file, 0, header, header_len, MPI_BYTE,
+                                  MPI_STATUS_IGNORE) != MPI_SUCCESS);
+    }
+    failed |= (MPI_File_set_view(file, header_len, MPI_BYTE, file_type,
+                                 "native", MPI_INFO_NULL) != MPI_SUCCESS);
+    failed |= (MPI_File_write_all(file, buf, 1, buf_type, MPI_STATUS_IGNORE) !=
+               MPI_SUCCESS);
+    failed |= (MPI_File_close(&file) != MPI_SUCCESS);
+  }
+
+  TRY_MPI(MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_LOR,
+                        MPI_COMM_WORLD));
+  TRY_MPI(MPI_Type_free(&file_type));
+  if (has_buf_type) {
+    TRY_MPI(MPI_Type_free(&buf_type));
+  }
+  free(buf);
+  free(rows);
+  free(lengths);
+  free(offsets);
+  return failed ? -1 : 0;
+}
+
+int draw_scene_to_file_parallel(const context_t *ctx, const scene_pack_t *pack,
+                                int scene_idx, const char *filename) {
+  int size = -1;
+  int rank = -1;
+  TRY_MPI(MPI_Comm_size(MPI_COMM_WORLD, &size));
+  assert(size > ROOT_RANK);
+  TRY_MPI(MPI_Comm_rank(MPI_COMM_WORLD, &rank));
+  assert(rank >= 0);
+
+  // the ranks start the clocks together, so the times of the ranks compare
+  TRY_MPI(MPI_Barrier(MPI_COMM_WORLD));
+  const scene_t *scene = &pack->scenes[scene_idx];
+  double         start = MPI_Wtime();
+
+  SDL_PixelFormat *format = SDL_AllocFormat(SURFACE_FORMAT);
+  SDL_NOT_NULL(format);
+
+  tile_slots_t slots = {NULL, NULL, 0, 0};
+  rank_pool_t  pool;
+  rank_pool_init(&pool, scene, ctx->n_threads, &slots);
+
+  if (ctx->schedule == STATIC_SCHEDULE) {
+    draw_part_of_scene(&pool, pack, scene_idx, ctx->packet_side, format, NULL,
+                       &ctx->nodes);
+  } else if (rank == ROOT_RANK) {
+    dispatch_and_draw_tiles(&pool, pack, scene_idx, ctx->packet_side, format,
+                            NULL, size);
+  } else {
+    int *tiles = malloc((get_n_tiles(scene->width, scene->height) +
+                         ctx->n_threads) *
+                        sizeof(int));
+    assert(tiles);
+    draw_batches_into_frame(&pool, pack, scene_idx, ctx->packet_side, format,
+                            NULL, tiles);
+    free(tiles);
+  }
+
+  long long stats[3];
+  rank_pool_free(&pool, stats);
+  report_utilization(&pool, start, stats, size, rank);
+
+  double write_start = MPI_Wtime();
+  int    res         = write_tile_slots(scene, format, &slots, filename);
+  if ((rank == ROOT_RANK) && (res == 0)) {
+    printf("%s written by %d ranks in %.3f s\n", filename, size,
+           MPI_Wtime() - write_start);
+  } else if (rank == ROOT_RANK) {
+    fprintf(stderr, "Can't write %s\n", filename);
+  }
+
+  free_tile_slots(&slots);
+  SDL_FreeFormat(format);
+  return res;
+}
+
+
+
+void bcast_bytes(uint8_t *data, size_t size, MPI_Comm comm) {
+  for (size_t offset = 0; offset < size; offset += BCAST_CHUNK_SIZE) {
+    size_t left  = size - offset;
+    int    count = (left < BCAST_CHUNK_SIZE) ? (int) left : BCAST_CHUNK_SIZE;
+    TRY_MPI(MPI_Bcast(data + offset, count, MPI_BYTE, ROOT_RANK, comm));
+  }
+}
+
+void free_pack_window(void *window) {
+  free_node_window(window);
+  free(window);
+}
+
+// only the root reads the scenes file and the models; the pack is serialized
+// into one buffer, which is broadcast to the leaders of the nodes into windows
+// shared by the ranks of their nodes; every rank reads the pack from the
+// window of its node leaving the arrays of the models there, so the geometry
+// is kept once per node, and compiles the scenes itself; the models of an
+// animated pack move, so every rank copies them; returns NULL on every rank if
+// the root can't load the pack or any rank can't read or compile it
+scene_pack_t *load_scenes_on_root(const char *scenes_file,
+                                  const node_layout_t *nodes) {
+  int rank = -1;
+  TRY_MPI(MPI_Comm_rank(MPI_COMM_WORLD, &rank));
+
+  uint8_t *          data      = NULL;
+  size_t             size      = 0;
+  unsigned long long header[2] = {0, 0};
+  double             load      = 0;
+  double             start     = MPI_Wtime();
+  if (rank == ROOT_RANK) {
+    // the ranks compile the scenes of their copies, the root's own pack is
+    // only serialized
+    scene_pack_t *loaded = read_scenes(scenes_file);
+    data      = (loaded != NULL) ? serialize_pack(loaded, &size) : NULL;
+    header[0] = (data != NULL) ? size : 0;
+    if (loaded != NULL) {
+      header[1] = (loaded->animation != NULL);
+      if (data == NULL) {
+        fprintf(stderr, "Can't serialize the pack\n");
+      }
+      free_scene_pack(loaded);
+    }
+    load = MPI_Wtime() - start;
+  }
+
+  TRY_MPI(MPI_Bcast(header, 2, MPI_UNSIGNED_LONG_LONG, ROOT_RANK,
+                    MPI_COMM_WORLD));
+  if (header[0] == 0) {
+    return NULL;
+  }
+
+  size            = header[0];
+  MPI_Win *window = malloc(sizeof(MPI_Win));
+  assert(window);
+  uint8_t *shared = alloc_node_window(nodes, size, window);
+  if (rank == ROOT_RANK) {
+    memcpy(shared, data, size);
+    free(data);
+  }
+  if (nodes->leader_comm != MPI_COMM_NULL) {
+    bcast_bytes(shared, size, nodes->leader_comm);
+  }
+  sync_node_window(nodes, *window);
+
+  int           is_animated = (int) header[1];
+  scene_pack_t *pack        = deserialize_pack(shared, size, !is_animated);
+  int           failed      = (pack == NULL) || (compile_scenes(pack) != 0);
+  if (failed) {
+    fprintf(stderr, "Can't read the pack on rank #%d\n", rank);
+  }
+
+  // the ranks fail together, so none of them waits for the others in the
+  // collectives of the scenes; the window is freed after that on every rank
+  TRY_MPI(MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_LOR,
+                        MPI_COMM_WORLD));
+  if (!is_animated && (pack != NULL)) {
+    pack->arena      = window;
+    pack->free_arena = free_pack_window;
+  } else {
+    free_pack_window(window);
+  }
+
+  if (failed && (pack != NULL)) {
+    free_scene_pack(pack);
+    pack = NULL;
+  }
+  if ((pack != NULL) && (rank == ROOT_RANK)) {
+    printf("%s loaded in %.3f s, broadcast as %zu bytes in %.3f s\n",
+           scenes_file, load, size, MPI_Wtime() - start - load);
+  }
+
+  return pack;
+}
+
+int hash_file_on_root(const char *filename, uint64_t *hash) {
+  int rank = -1;
+  TRY_MPI(MPI_Comm_rank(MPI_COMM_WORLD, &rank));
+
+  unsigned long long result[2] = {0, 0};
+  if (rank == ROOT_RANK) {
+    result[0] = (hash_file(filename, hash) == 0);
+    result[1] = result[0] ? *hash : 0;
+  }
+
+  TRY_MPI(MPI_Bcast(result, 2, MPI_UNSIGNED_LONG_LONG, ROOT_RANK,
+                    MPI_COMM_WORLD));
+  *hash = result[1];
+  return result[0] ? 0 : -1;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "scene.h"
+
+#include <mpi/mpi.h>
+
+#include <SDL2/SDL.h>
+
+#include <stdint.h>
+
+
+
+// With MPI every rank draws tiles of the scene with a thread pool of its own.
+// The ranks of a node keep the pack and draw the frame in memory they share
+// through MPI windows, so only the leaders of the nodes exchange pixels. The
+// ranks either render equal ranges of tiles (the static schedule) or request
+// batches of a tile per thread from the root (the dynamic one).
+
+enum {
+  ROOT_RANK = 0,
+};
+
+// ranks of a node share the pack and the frame through MPI windows
+typedef struct {
+  MPI_Comm node_comm;
+  int      node_rank;
+  int      node_size;
+
+  // leaders of the nodes, MPI_COMM_NULL on the other ranks
+  MPI_Comm leader_comm;
+  int      n_nodes;
+  int      is_root_node;
+
+  // number of the ranks on the nodes before this one
+  int node_first;
+
+  // 'node_first' of every node and the number of all the ranks after them,
+  // NULL on the ranks other than the leaders
+  int *node_firsts;
+} node_layout_t;
+
+// the context of the ray tracer, see ray_tracer.h
+typedef struct context_t context_t;
+
+
+
+// collective over MPI_COMM_WORLD
+void init_node_layout(node_layout_t *nodes);
+void free_node_layout(node_layout_t *nodes);
+
+// only the root reads the scenes file and the models, the ranks of a node
+// share the geometry of the pack; returns NULL on every rank if the root
+// can't load the pack or any rank can't compile it
+scene_pack_t *load_scenes_on_root(const char *scenes_file,
+                                  const node_layout_t *nodes);
+// the file is read by the root only
+int hash_file_on_root(const char *filename, uint64_t *hash);
+
+// all the ranks draw the scene together, each one with its thread pool, only
+// the root gets the surface
+SDL_Surface *draw_scene_on_surface_parallel(const context_t *   ctx,
+                                            const scene_pack_t *pack,
+                                            int                 scene_idx);
+
+// all the ranks draw the scene together and every one writes its tiles to the
+// file, so none of them holds the whole frame; returns -1 on every rank if the
+// file can't be written
+int draw_scene_to_file_parallel(const context_t *ctx, const scene_pack_t *pack,
+                                int scene_idx, const char *filename);
@@ -1,258 +1,555 @@
+#include "bvh.h"
 #include "geometry.h"
+#include "mapped_file.h"
 #include "obj_model.h"
 
+#include <limits.h>
+#include <omp.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-#define ever ;;
+enum {
+  // files are split into line-aligned chunks of about this size which are
+  // parsed in parallel
+  CHUNK_SIZE = 1 << 20,
+
+  // longer numbers are not parsed
+  MAX_NUMBER_LEN = 64,
+
+  // a decimal mantissa of up to 19 digits below 2^53 scaled by an exact power
+  // of ten gives the correctly rounded double, other numbers go to strtod
+  MAX_EXACT_DIGITS = 19,
+  MAX_EXACT_POW10 = 22,
+  MAX_EXPONENT = 9999,
+};
+
+static const double POW10[MAX_EXACT_POW10 + 1] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// records which are skipped with a warning
+static const char *IGNORED_RECORDS[] = {
+  "vt", "vn", "vp", "l", "g", "s", "o", "mtllib", "usemtl",
+};
 
 enum {
-  VERTICES_ALLOC_SIZE = 1000,
-  TRIANGLES_ALLOC_SIZE = 1000,
+  N_IGNORED_RECORDS = sizeof(IGNORED_RECORDS) / sizeof(IGNORED_RECORDS[0]),
 };
 
-ssize_t skip_line(FILE *file) {
-  char *tmp = NULL;
-  size_t tmp_sz = 0;
-  ssize_t ret = getline(&tmp, &tmp_sz, file);
-  free(tmp);
-  return ret;
-}
+typedef enum {
+  EMPTY_RECORD,
+  VERTEX_RECORD,
+  FACE_RECORD,
+  IGNORED_RECORD,
+  UNKNOWN_RECORD,
+} record_type_t;
+
+typedef struct {
+  const char *begin;
+  const char *end;
+
+  int n_lines;
+  int n_vertices;
+  int n_triangles;
+
+  // vertices and triangles of the previous chunks
+  int first_vertex;
+  int first_triangle;
+
+  // bit per type of ignored records met in the chunk
+  unsigned ignored;
+  aabb_t bounds;
+
+  // first bad line of the chunk, 'bad_line' is 0 if there is none
+  int bad_line;
+  const char *bad_record;
+} obj_chunk_t;
+
+
+
 
 void free_model(model_t *model) {
   if(model != NULL) {
-    free(model->triangles);
-    model->n_triangles = 0;
+    free(model->filename);
+    if(!model->is_borrowed) {
+      free_triangle_mesh(&model->mesh);
+      bvh_free(&model->bvh);
+    }
     free(model);
   }
 }
 
-model_t *extract_obj_model_from_file(const char *filename, const vec3f shift, const flt_type scale) {
-  model_t *model = malloc(sizeof(model_t));
-  if(model == NULL)
-    return NULL;
+// leaves refer to ranges of the triangles then
+static int sort_triangles_by_bvh(model_t *model) {
+  triangle_mesh_t *mesh = &model->mesh;
+  uint32_t *indices = malloc(3 * mesh->n * sizeof(uint32_t) + 1);
+  if(indices == NULL)
+    return -1;
 
-  FILE *file = fopen(filename, "r");
-  if(file == NULL) {
-    fprintf(stderr, "Can't open file: %s\n", filename);
-    free_model(model);
-    return NULL;
+#pragma omp parallel for default(none) shared(model, mesh, indices)
+  for(int i = 0; i < mesh->n; ++i) {
+    memcpy(&indices[3 * i], &mesh->indices[3 * model->bvh.prims[i]], 3 * sizeof(uint32_t));
+    model->bvh.prims[i] = i;
   }
 
-  int is_vt_warning_shown = 0;
-  int is_vn_warning_shown = 0;
-  int is_vp_warning_shown = 0;
-  int is_l_warning_shown = 0;
-  int is_g_warning_shown = 0;
-  int is_s_warning_shown = 0;
-  int is_o_warning_shown = 0;
-  int is_mtllib_warning_shown = 0;
-  int is_usemtl_warning_shown = 0;
-
-  int n_vertices = 0;
-  vec3f *vertices = malloc(VERTICES_ALLOC_SIZE * sizeof(vec3f));
-  if(vertices == NULL) {
-    free_model(model);
+  free(mesh->indices);
+  mesh->indices = indices;
+  return 0;
+}
+
+static aabb_t *get_triangles_bounds(const model_t *model) {
+  aabb_t *bounds = malloc(model->mesh.n * sizeof(aabb_t) + 1);
+  if(bounds == NULL)
     return NULL;
+
+#pragma omp parallel for default(none) shared(model, bounds)
+  for(int i = 0; i < model->mesh.n; ++i) {
+    triangle_t triangle = get_mesh_triangle(&model->mesh, i);
+    bounds[i] = aabb_add_point(aabb_empty(), triangle.a);
+    bounds[i] = aabb_add_point(bounds[i], triangle.b);
+    bounds[i] = aabb_add_point(bounds[i], triangle.c);
   }
 
-  model->n_triangles = 0;
-  model->triangles = malloc(TRIANGLES_ALLOC_SIZE * sizeof(triangle_t));
-  if(model->triangles == NULL) {
-    free_model(model);
-    return NULL;
+  return bounds;
+}
+
+static int build_model_bvh(model_t *model) {
+  aabb_t *bounds = get_triangles_bounds(model);
+  if(bounds == NULL)
+    return -1;
+
+  int ret = bvh_build(&model->bvh, bounds, model->mesh.n);
+  free(bounds);
+  if(ret != 0)
+    return ret;
+
+  return sort_triangles_by_bvh(model);
+}
+
+int refit_model(model_t *model) {
+  if(model->is_borrowed)
+    return -1;
+
+  aabb_t *bounds = get_triangles_bounds(model);
+  if(bounds == NULL)
+    return -1;
+
+  bvh_refit(&model->bvh, bounds);
+  free(bounds);
+
+  model->bounds = (model->bvh.n_nodes > 0) ? model->bvh.nodes[0].bounds : aabb_empty();
+  return 0;
+}
+
+static int is_blank(char c) {
+  return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\v') || (c == '\f');
+}
+
+static int is_digit(char c) {
+  return (c >= '0') && (c <= '9');
+}
+
+static const char *skip_blanks(const char *pos, const char *end) {
+  while((pos < end) && is_blank(*pos))
+    ++pos;
+  return pos;
+}
+
+static const char *skip_token(const char *pos, const char *end) {
+  while((pos < end) && !is_blank(*pos))
+    ++pos;
+  return pos;
+}
+
+static const char *get_line_end(const char *pos, const char *end) {
+  const char *line_end = memchr(pos, '\n', end - pos);
+  return (line_end == NULL) ? end : line_end;
+}
+
+static const char *get_next_line(const char *line_end, const char *end) {
+  return (line_end < end) ? line_end + 1 : end;
+}
+
+static record_type_t get_record_type(const char **pos, const char *end, int *ignored_idx) {
+  const char *type = skip_blanks(*pos, end);
+  if((type == end) || (*type == '#'))
+    return EMPTY_RECORD;
+
+  const char *type_end = skip_token(type, end);
+  size_t len = type_end - type;
+  *pos = type_end;
+
+  if((len == 1) && (*type == 'v'))
+    return VERTEX_RECORD;
+  if((len == 1) && (*type == 'f'))
+    return FACE_RECORD;
+
+  for(int i = 0; i < N_IGNORED_RECORDS; ++i)
+    if((strlen(IGNORED_RECORDS[i]) == len) && (memcmp(IGNORED_RECORDS[i], type, len) == 0)) {
+      *ignored_idx = i;
+      return IGNORED_RECORD;
+    }
+
+  return UNKNOWN_RECORD;
+}
+
+static int parse_slow_double(const char *begin, const char *end, double *value) {
+  char number[MAX_NUMBER_LEN + 1];
+  size_t len = end - begin;
+  if(len > MAX_NUMBER_LEN)
+    return -1;
+
+  memcpy(number, begin, len);
+  number[len] = '\0';
+
+  char *endptr;
+  *value = strtod(number, &endptr);
+  return ((len > 0) && (endptr == number + len)) ? 0 : -1;
+}
+
+// gives the same value as strtod
+static int parse_double(const char **pos, const char *end, double *value) {
+  const char *begin = skip_blanks(*pos, end);
+  const char *number_end = skip_token(begin, end);
+  *pos = number_end;
+
+  const char *p = begin;
+  int is_negative = 0;
+  if((p < number_end) && ((*p == '-') || (*p == '+')))
+    is_negative = (*p++ == '-');
+
+  uint64_t mantissa = 0;
+  int n_digits = 0;
+  int exponent = 0;
+  int is_exact = 1;
+  int has_digits = 0;
+  for(; (p < number_end) && is_digit(*p); ++p) {
+    has_digits = 1;
+    if(n_digits < MAX_EXACT_DIGITS) {
+      mantissa = mantissa * 10 + (*p - '0');
+      n_digits += (mantissa != 0);
+    } else
+      is_exact = 0;
   }
 
-  model->min_x =  FLT_TYPE_MAX;
-  model->min_y =  FLT_TYPE_MAX;
-  model->min_z =  FLT_TYPE_MAX;
-  model->max_x = -FLT_TYPE_MAX;
-  model->max_y = -FLT_TYPE_MAX;
-  model->max_z = -FLT_TYPE_MAX;
+  if((p < number_end) && (*p == '.'))
+    for(++p; (p < number_end) && is_digit(*p); ++p) {
+      has_digits = 1;
+      if(n_digits < MAX_EXACT_DIGITS) {
+        mantissa = mantissa * 10 + (*p - '0');
+        n_digits += (mantissa != 0);
+        exponent--;
+      } else
+        is_exact = 0;
+    }
 
-  flt_type shift_arr[3] = { shift.x, shift.y, shift.z };
+  if(has_digits && (p < number_end) && ((*p == 'e') || (*p == 'E'))) {
+    ++p;
+    int is_negative_exponent = 0;
+    if((p < number_end) && ((*p == '-') || (*p == '+')))
+      is_negative_exponent = (*p++ == '-');
 
-  for(ever) {
-    char type[3];
-    if(fscanf(file, "%s", type) != 1)
-      break;
+    int explicit_exponent = 0;
+    if((p == number_end) || !is_digit(*p))
+      has_digits = 0;
+    for(; (p < number_end) && is_digit(*p); ++p)
+      if(explicit_exponent < MAX_EXPONENT)
+        explicit_exponent = explicit_exponent * 10 + (*p - '0');
+    exponent += is_negative_exponent ? -explicit_exponent : explicit_exponent;
+  }
+
+  if(!has_digits || (p != number_end) || !is_exact || (mantissa > (1ull << 53))
+     || (exponent < -MAX_EXACT_POW10) || (exponent > MAX_EXACT_POW10))
+    return parse_slow_double(begin, number_end, value);
+
+  double abs_value = (double) mantissa;
+  if(exponent < 0)
+    abs_value /= POW10[-exponent];
+  else
+    abs_value *= POW10[exponent];
+
+  *value = is_negative ? -abs_value : abs_value;
+  return 0;
+}
+
+// reads the vertex number of a "v", "v/vt", "v//vn" or "v/vt/vn" token
+static int parse_index(const char **pos, const char *end, int *index) {
+  const char *p = skip_blanks(*pos, end);
+  const char *token_end = skip_token(p, end);
+  *pos = token_end;
+
+  int is_negative = 0;
+  if((p < token_end) && (*p == '-'))
+    is_negative = (*p++ == '-');
+
+  if((p == token_end) || !is_digit(*p))
+    return -1;
+
+  int value = 0;
+  for(; (p < token_end) && is_digit(*p); ++p) {
+    if(value > (INT_MAX - 9) / 10)
+      return -1;
+    value = value * 10 + (*p - '0');
+  }
+
+  if((p != token_end) && (*p != '/'))
+    return -1;
+
+  *index = is_negative ? -value : value;
+  return 0;
+}
+
+static int count_face_vertices(const char *pos, const char *end) {
+  int n = 0;
+  for(pos = skip_blanks(pos, end); pos < end; pos = skip_blanks(pos, end)) {
+    pos = skip_token(pos, end);
+    n++;
+  }
+  return n;
+}
+
+static void set_bad_line(obj_chunk_t *chunk, int line, const char *record) {
+  chunk->bad_line = line;
+  chunk->bad_record = record;
+}
+
+// first pass: numbers of lines, vertices and triangles
+static void count_chunk(obj_chunk_t *chunk) {
+  for(const char *line = chunk->begin; line < chunk->end; ) {
+    const char *line_end = get_line_end(line, chunk->end);
+    const char *pos = line;
+    chunk->n_lines++;
 
-    if(strcmp(type, "#") == 0) {
-      if(skip_line(file) < 0) {
-        free_model(model);
-        return NULL;
+    int ignored_idx = 0;
+    switch(get_record_type(&pos, line_end, &ignored_idx)) {
+    case EMPTY_RECORD:
+      break;
+    case VERTEX_RECORD:
+      chunk->n_vertices++;
+      break;
+    case FACE_RECORD: {
+      int n = count_face_vertices(pos, line_end);
+      if(n < 3) {
+        set_bad_line(chunk, chunk->n_lines, line);
+        return;
       }
-      continue;
-    } else if(strcmp(type, "v") == 0) {
+      chunk->n_triangles += n - 2;
+      break;
+    }
+    case IGNORED_RECORD:
+      chunk->ignored |= 1u << ignored_idx;
+      break;
+    case UNKNOWN_RECORD:
+      set_bad_line(chunk, chunk->n_lines, line);
+      return;
+    }
+
+    line = get_next_line(line_end, chunk->end);
+  }
+}
+
+// returns the index in the vertices of the model, negative indices count back
+// from the last vertex before the face
+static int resolve_index(int index, int n_vertices_before, int n_vertices) {
+  if(index > 0)
+    return (index <= n_vertices) ? index - 1 : -1;
+  if(index < 0)
+    return (n_vertices_before + index >= 0) ? n_vertices_before + index : -1;
+  return -1;
+}
+
+// second pass: vertices and fan-triangulated faces as vertex indices
+static void parse_chunk(obj_chunk_t *chunk, triangle_mesh_t *mesh, const vec3f shift, const flt_type scale) {
+  flt_type shift_arr[3] = { shift.x, shift.y, shift.z };
+  int vertex_idx = chunk->first_vertex;
+  int triangle_idx = chunk->first_triangle;
+  int line_no = 0;
+
+  for(const char *line = chunk->begin; line < chunk->end; ) {
+    const char *line_end = get_line_end(line, chunk->end);
+    const char *pos = line;
+    line_no++;
+
+    int ignored_idx = 0;
+    record_type_t type = get_record_type(&pos, line_end, &ignored_idx);
+    if(type == VERTEX_RECORD) {
       double tmp[3];
       for(int i = 0; i < 3; ++i) {
-        if(fscanf(file, "%lf", &tmp[i]) != 1) {
-          free_model(model);
-          return NULL;
+        if(parse_double(&pos, line_end, &tmp[i]) != 0) {
+          set_bad_line(chunk, line_no, line);
+          return;
         }
         tmp[i] *= scale;
         tmp[i] += shift_arr[i];
       }
       vec3f tmp_vec = { tmp[0], tmp[1], tmp[2], };
-      vertices[n_vertices] = tmp_vec;
-      n_vertices++;
-      if((n_vertices % VERTICES_ALLOC_SIZE) == 0) {
-        vertices = realloc(vertices, (n_vertices + VERTICES_ALLOC_SIZE) * sizeof(vec3f));
-        if(vertices == NULL) {
-          free_model(model);
-          return NULL;
-        }
-      }
-
-      if(tmp_vec.x < model->min_x)
-        model->min_x = tmp_vec.x;
-      if(tmp_vec.x > model->max_x)
-        model->max_x = tmp_vec.x;
-
-      if(tmp_vec.y < model->min_y)
-        model->min_y = tmp_vec.y;
-      if(tmp_vec.y > model->max_y)
-        model->max_y = tmp_vec.y;
-
-      if(tmp_vec.z < model->min_z)
-        model->min_z = tmp_vec.z;
-      if(tmp_vec.z > model->max_z)
-        model->max_z = tmp_vec.z;
-
-      continue;
-    } else if(strcmp(type, "vt") == 0) {
-      if(is_vt_warning_shown == 0) {
-        printf("vt doesn't supported and will be ignored further\n");
-        is_vt_warning_shown = 1;
-      }
-      if(skip_line(file) < 0) {
-        free_model(model);
-        return NULL;
-      }
-      continue;
-    } else if(strcmp(type, "vn") == 0) {
-      if(is_vn_warning_shown == 0) {
-        printf("vn doesn't supported and will be ignored further\n");
-        is_vn_warning_shown = 1;
-      }
-      if(skip_line(file) < 0) {
-        free_model(model);
-        return NULL;
-      }
-      continue;
-    } else if(strcmp(type, "vp") == 0) {
-      if(is_vp_warning_shown == 0) {
-        printf("vp doesn't supported and will be ignored further\n");
-        is_vp_warning_shown = 1;
-      }
-      if(skip_line(file) < 0) {
-        free_model(model);
-        return NULL;
-      }
-      continue;
-    } else if(strcmp(type, "f") == 0) {
+      mesh->vertices[vertex_idx++] = tmp_vec;
+      chunk->bounds = aabb_add_point(chunk->bounds, tmp_vec);
+    } else if(type == FACE_RECORD) {
       int tmp[3];
-      for(int i = 0; i < 3; ++i) {
-        char tmp_str[32];
-        if(fscanf(file, "%s", tmp_str) != 1) {
-          free_model(model);
-          return NULL;
+      for(int i = 0; (pos = skip_blanks(pos, line_end)) < line_end; ++i) {
+        // polygons are split into fans of triangles sharing the first vertex
+        int slot = (i < 2) ? i : 2;
+        int index;
+        if((parse_index(&pos, line_end, &index) != 0) || ((tmp[slot] = resolve_index(index, vertex_idx, mesh->n_vertices)) < 0)) {
+          set_bad_line(chunk, line_no, line);
+          return;
         }
 
-        char *endptr;
-        tmp[i] = strtol(tmp_str, &endptr, 10);
-        if((tmp[i] < 0) || !((*endptr == '\0') || (*endptr == '/'))) {
-          free_model(model);
-          return NULL;
+        if(slot == 2) {
+          uint32_t *indices = &mesh->indices[3 * triangle_idx++];
+          indices[0] = tmp[0];
+          indices[1] = tmp[1];
+          indices[2] = tmp[2];
+          tmp[1] = tmp[2];
         }
-        tmp[i]--;
       }
+    }
 
-      //vec3i tmp_vec = { tmp[0] - 1, tmp[1] - 1, tmp[2] - 1, };
-      triangle_t tmp_triangle = { vertices[tmp[0]], vertices[tmp[1]], vertices[tmp[2]], };
-      model->triangles[model->n_triangles] = tmp_triangle;
-      model->n_triangles++;
-      if((model->n_triangles % TRIANGLES_ALLOC_SIZE) == 0) {
-        model->triangles = realloc(model->triangles, (model->n_triangles + TRIANGLES_ALLOC_SIZE) * sizeof(triangle_t));
-        if(model->triangles == NULL) {
-          free_model(model);
-          return NULL;
-        }
-      }
-      continue;
-    } else if(strcmp(type, "l") == 0) {
-      if(is_l_warning_shown == 0) {
-        printf("l doesn't supported and will be ignored further\n");
-        is_l_warning_shown = 1;
-      }
-      if(skip_line(file) < 0) {
-        free_model(model);
-        return NULL;
-      }
-      continue;
-    } else if(strcmp(type, "g") == 0) {
-      if(is_g_warning_shown == 0) {
-        printf("g doesn't supported and will be ignored further\n");
-        is_g_warning_shown = 1;
-      }
-      if(skip_line(file) < 0) {
-        free_model(model);
-        return NULL;
-      }
-      continue;
-    } else if(strcmp(type, "s") == 0) {
-      if(is_s_warning_shown == 0) {
-        printf("s doesn't supported and will be ignored further\n");
-        is_s_warning_shown = 1;
-      }
-      if(skip_line(file) < 0) {
-        free_model(model);
-        return NULL;
-      }
-      continue;
-    } else if(strcmp(type, "o") == 0) {
-      if(is_o_warning_shown == 0) {
-        printf("o doesn't supported and will be ignored further\n");
-        is_o_warning_shown = 1;
-      }
-      if(skip_line(file) < 0) {
-        free_model(model);
-        return NULL;
-      }
-      continue;
-    } else if(strcmp(type, "mtllib") == 0) {
-      if(is_mtllib_warning_shown == 0) {
-        printf("mtllib doesn't supported and will be ignored further\n");
-        is_mtllib_warning_shown = 1;
-      }
-      if(skip_line(file) < 0) {
-        free_model(model);
-        return NULL;
-      }
-      continue;
-    } else if(strcmp(type, "usemtl") == 0) {
-      if(is_usemtl_warning_shown == 0) {
-        printf("usemtl doesn't supported and will be ignored further\n");
-        is_usemtl_warning_shown = 1;
-      }
-      if(skip_line(file) < 0) {
-        free_model(model);
-        return NULL;
-      }
-      continue;
-    } else {
-      fprintf(stderr, "Unknown data type '%s' in %s\n", type, filename);
-      free_model(model);
-      return NULL;
+    line = get_next_line(line_end, chunk->end);
+  }
+}
+
+static obj_chunk_t *split_into_chunks(const mapped_file_t *mapped, int *n_chunks) {
+  *n_chunks = mapped->size / CHUNK_SIZE + 1;
+  obj_chunk_t *chunks = calloc(*n_chunks, sizeof(obj_chunk_t));
+  if(chunks == NULL)
+    return NULL;
+
+  const char *data = (const char *) mapped->data;
+  const char *end = data + mapped->size;
+  const char *begin = data;
+  for(int i = 0; i < *n_chunks; ++i) {
+    const char *chunk_end = end;
+    if(i + 1 < *n_chunks) {
+      const char *pos = data + (i + 1) * (mapped->size / *n_chunks);
+      if(pos < begin)
+        pos = begin;
+      chunk_end = get_line_end(pos, end);
+      if(chunk_end < end)
+        chunk_end++;
     }
+
+    chunks[i].begin = begin;
+    chunks[i].end = chunk_end;
+    chunks[i].bounds = aabb_empty();
+    begin = chunk_end;
+  }
+
+  return chunks;
+}
+
+// returns 0 if no chunk has a bad line
+static int report_bad_line(const obj_chunk_t *chunks, int n_chunks, const char *filename) {
+  int line_no = 0;
+  for(int i = 0; i < n_chunks; ++i) {
+    if(chunks[i].bad_line != 0) {
+      const char *line_end = get_line_end(chunks[i].bad_record, chunks[i].end);
+      int len = line_end - chunks[i].bad_record;
+      fprintf(stderr, "Bad record in %s:%d: '%.*s'\n", filename, line_no + chunks[i].bad_line, (len < MAX_NUMBER_LEN) ? len : MAX_NUMBER_LEN, chunks[i].bad_record);
+      return -1;
+    }
+    line_no += chunks[i].n_lines;
+  }
+  return 0;
+}
+
+static int load_chunks(model_t *model, obj_chunk_t *chunks, int n_chunks, const char *filename, const vec3f shift, const flt_type scale) {
+#pragma omp parallel for default(none) shared(chunks, n_chunks) schedule(dynamic)
+  for(int i = 0; i < n_chunks; ++i)
+    count_chunk(&chunks[i]);
+
+  if(report_bad_line(chunks, n_chunks, filename) != 0)
+    return -1;
+
+  unsigned ignored = 0;
+  long long n_vertices = 0;
+  long long n_triangles = 0;
+  for(int i = 0; i < n_chunks; ++i) {
+    chunks[i].first_vertex = n_vertices;
+    chunks[i].first_triangle = n_triangles;
+    n_vertices += chunks[i].n_vertices;
+    n_triangles += chunks[i].n_triangles;
+    ignored |= chunks[i].ignored;
+  }
+
+  for(int i = 0; i < N_IGNORED_RECORDS; ++i)
+    if(ignored & (1u << i))
+      printf("%s doesn't supported and will be ignored further\n", IGNORED_RECORDS[i]);
+
+  // indices of the triangles are counted in int
+  if((n_vertices > INT_MAX) || (n_triangles > INT_MAX / 3)) {
+    fprintf(stderr, "Too many vertices or faces in %s\n", filename);
+    return -1;
+  }
+
+  triangle_mesh_t *mesh = &model->mesh;
+  mesh->n_vertices = n_vertices;
+  mesh->n = n_triangles;
+  mesh->vertices = malloc(n_vertices * sizeof(vec3f) + 1);
+  mesh->indices = malloc(3 * n_triangles * sizeof(uint32_t) + 1);
+  if((mesh->vertices == NULL) || (mesh->indices == NULL))
+    return -1;
+
+#pragma omp parallel for default(none) shared(chunks, n_chunks, mesh, shift, scale) schedule(dynamic)
+  for(int i = 0; i < n_chunks; ++i)
+    parse_chunk(&chunks[i], mesh, shift, scale);
+
+  for(int i = 0; i < n_chunks; ++i)
+    model->bounds = aabb_union(model->bounds, chunks[i].bounds);
+
+  return report_bad_line(chunks, n_chunks, filename);
+}
+
+model_t *extract_obj_model_from_file(const char *filename, const vec3f shift, const flt_type scale) {
+  double start_time = omp_get_wtime();
+
+  model_t *model = calloc(1, sizeof(model_t));
+  if(model == NULL)
+    return NULL;
+
+  model->filename = strdup(filename);
+  if(model->filename == NULL) {
+    free_model(model);
+    return NULL;
+  }
+
+  mapped_file_t mapped;
+  if(map_file(filename, &mapped) != 0) {
+    fprintf(stderr, "Can't open file: %s\n", filename);
+    free_model(model);
+    return NULL;
+  }
+
+  int n_chunks;
+  obj_chunk_t *chunks = split_into_chunks(&mapped, &n_chunks);
+  if(chunks == NULL) {
+    unmap_file(&mapped);
+    free_model(model);
+    return NULL;
   }
 
-  free(vertices);
+  model->bounds = aabb_empty();
+  int ret = load_chunks(model, chunks, n_chunks, filename, shift, scale);
+  free(chunks);
 
-  if(model->triangles == NULL) {
+  double size_mb = mapped.size / (1024.0 * 1024.0);
+  unmap_file(&mapped);
+  if(ret != 0) {
+    free_model(model);
+    return NULL;
+  }
+
+  double load_time = omp_get_wtime() - start_time;
+  printf("%s: %d triangles, %.1f MB loaded in %.3f s (%.1f MB/s)\n", filename, model->mesh.n, size_mb, load_time, (load_time > 0) ? size_mb / load_time : 0.0);
+
+  if(build_model_bvh(model) != 0) {
     free_model(model);
     return NULL;
   }
 
   return model;
 }
-
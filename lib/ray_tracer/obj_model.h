@@ -1,19 +1,25 @@
 #pragma once
 
+#include "bvh.h"
 #include "geometry.h"
+#include "primitives.h"
 
 
 
 typedef struct {
-  triangle_t *triangles;
-  int n_triangles;
+  // file the model was loaded from
+  char *filename;
 
-  flt_type min_x;
-  flt_type min_y;
-  flt_type min_z;
-  flt_type max_x;
-  flt_type max_y;
-  flt_type max_z;
+  // triangles are in order of BVH primitives, so leaves refer to ranges of
+  // them and 'bvh.prims' is the identity
+  triangle_mesh_t mesh;
+
+  aabb_t bounds;
+  bvh_t  bvh;
+
+  // 'mesh' and 'bvh' point into memory the model doesn't own (the arena of a
+  // pack shared by MPI ranks), so they are neither freed nor refitted
+  int is_borrowed;
 
 #ifdef WITH_TEXTURES
   vec2f *texture_verts;
@@ -27,3 +33,5 @@ void free_model(model_t *model);
 
 model_t *extract_obj_model_from_file(const char *filename, const vec3f shift, const flt_type scale);
 
+// updates the bounds and the BVH after vertices of the mesh have moved
+int refit_model(model_t *model);
@@ -0,0 +1,756 @@
+#include "pack_cache.h"
+#include "bvh.h"
+#include "geometry.h"
+#include "mapped_file.h"
+#include "scene.h"
+
+#ifdef WITH_OBJ
+  #include "obj_model.h"
+#endif
+
+#include "flt_type.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+
+// {{{ Format
+// header, then file name and stamp of every model, then lights, materials,
+// objects, scenes and the animation if there is one; arrays go as their
+// length followed by the elements, the elements of the model arrays start at
+// offsets which are multiples of PACK_ARRAY_ALIGNMENT
+enum {
+  PACK_CACHE_VERSION   = 5,
+  PACK_ARRAY_ALIGNMENT = 64,
+  MAX_FILENAME_LEN     = 4096,
+
+  // room for ".<pid>" of the temporary file
+  TMP_SUFFIX_LEN = 16,
+};
+
+static const char PACK_CACHE_MAGIC[8] = "RTRPACK";
+static const char PACK_CACHE_SUFFIX[] = ".cache";
+
+// the contents of a file are hashed only if its size is the same but its
+// modification time is not
+typedef struct {
+  uint64_t size;
+  int64_t  mtime_sec;
+  int64_t  mtime_nsec;
+  uint64_t hash;
+} file_stamp_t;
+
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+
+  // layout of the cached structures
+  uint32_t flt_size;
+  uint32_t material_size;
+  uint32_t scene_size;
+  uint32_t with_obj;
+
+  uint32_t     n_models;
+  // the models of an animated pack move, so they aren't left in the mapping
+  uint32_t     is_animated;
+  file_stamp_t scenes_file;
+} pack_cache_header_t;
+
+void init_pack_cache_header(pack_cache_header_t *header) {
+  memset(header, 0, sizeof(pack_cache_header_t));
+  memcpy(header->magic, PACK_CACHE_MAGIC, sizeof(PACK_CACHE_MAGIC));
+  header->version       = PACK_CACHE_VERSION;
+  header->flt_size      = sizeof(flt_type);
+  header->material_size = sizeof(material_t);
+  header->scene_size    = sizeof(scene_t);
+#ifdef WITH_OBJ
+  header->with_obj = 1;
+#endif
+}
+
+char *get_pack_cache_filename(const char *scenes_file) {
+  size_t len      = strlen(scenes_file) + sizeof(PACK_CACHE_SUFFIX);
+  char * filename = malloc(len);
+  if (filename != NULL) {
+    snprintf(filename, len, "%s%s", scenes_file, PACK_CACHE_SUFFIX);
+  }
+  return filename;
+}
+
+size_t get_array_padding(size_t offset) {
+  return (PACK_ARRAY_ALIGNMENT - offset % PACK_ARRAY_ALIGNMENT) %
+         PACK_ARRAY_ALIGNMENT;
+}
+// }}}
+
+// {{{ Hashes
+// FNV-1a over 64-bit words and then over the bytes of the tail; the product
+// carries the bits of a word up only, so its high half is folded down
+uint64_t hash_bytes(const uint8_t *bytes, size_t size) {
+  uint64_t hash = 14695981039346656037ull;
+  size_t   i    = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes + i, sizeof(word));
+    hash = (hash ^ word) * 1099511628211ull;
+    hash ^= hash >> 32;
+  }
+  for (; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+int hash_file(const char *filename, uint64_t *hash) {
+  mapped_file_t mapped;
+  if (map_file(filename, &mapped) != 0) {
+    return -1;
+  }
+
+  *hash = hash_bytes(mapped.data, mapped.size);
+  unmap_file(&mapped);
+  return 0;
+}
+
+int stamp_file(const char *filename, file_stamp_t *stamp) {
+  struct stat st;
+  if (stat(filename, &st) != 0) {
+    return -1;
+  }
+
+  stamp->size       = st.st_size;
+  stamp->mtime_sec  = st.st_mtim.tv_sec;
+  stamp->mtime_nsec = st.st_mtim.tv_nsec;
+  return hash_file(filename, &stamp->hash);
+}
+
+int check_file_stamp(const char *filename, const file_stamp_t *stamp) {
+  struct stat st;
+  if ((stat(filename, &st) != 0) || ((uint64_t) st.st_size != stamp->size)) {
+    return -1;
+  }
+  if ((st.st_mtim.tv_sec == stamp->mtime_sec) &&
+      (st.st_mtim.tv_nsec == stamp->mtime_nsec)) {
+    return 0;
+  }
+
+  uint64_t hash;
+  return ((hash_file(filename, &hash) == 0) && (hash == stamp->hash)) ? 0 : -1;
+}
+// }}}
+
+// {{{ Read cache
+typedef struct {
+  const uint8_t *begin;
+  const uint8_t *pos;
+  const uint8_t *end;
+
+  // the model arrays are pointed to in place rather than copied
+  int borrow;
+} cache_reader_t;
+
+int read_bytes(cache_reader_t *reader, void *dst, size_t size) {
+  if ((size_t)(reader->end - reader->pos) < size) {
+    return -1;
+  }
+
+  memcpy(dst, reader->pos, size);
+  reader->pos += size;
+  return 0;
+}
+
+// the array goes to a heap block of its own, so the pack is freed as a parsed
+// one is
+void *read_array(cache_reader_t *reader, size_t elem_size, int n) {
+  if (n < 0) {
+    return NULL;
+  }
+
+  void *arr = malloc(elem_size * n + 1);
+  if ((arr != NULL) && (read_bytes(reader, arr, elem_size * n) != 0)) {
+    free(arr);
+    return NULL;
+  }
+
+  return arr;
+}
+
+// reads length of the array and the array itself
+int read_counted_array(cache_reader_t *reader, size_t elem_size, void **arr,
+                       int *n) {
+  if (read_bytes(reader, n, sizeof(int)) != 0) {
+    return -1;
+  }
+
+  *arr = read_array(reader, elem_size, *n);
+  return (*arr == NULL) ? -1 : 0;
+}
+
+// the length is followed by padding up to the alignment of the elements
+int read_aligned_array(cache_reader_t *reader, size_t elem_size, void **arr,
+                       int *n) {
+  if ((read_bytes(reader, n, sizeof(int)) != 0) || (*n < 0)) {
+    return -1;
+  }
+
+  size_t padding = get_array_padding(reader->pos - reader->begin);
+  if ((size_t)(reader->end - reader->pos) < padding) {
+    return -1;
+  }
+  reader->pos += padding;
+
+  if (!reader->borrow) {
+    *arr = read_array(reader, elem_size, *n);
+    return (*arr == NULL) ? -1 : 0;
+  }
+
+  if ((size_t)(reader->end - reader->pos) < elem_size * *n) {
+    return -1;
+  }
+  *arr = (void *) reader->pos;
+  reader->pos += elem_size * *n;
+  return 0;
+}
+
+// the list is terminated with NULL
+void free_model_files(char **model_files) {
+  if (model_files != NULL) {
+    for (int i = 0; model_files[i] != NULL; ++i) {
+      free(model_files[i]);
+    }
+    free(model_files);
+  }
+}
+
+// checks the header and the stamps of the scenes file and of the models,
+// the stamps are skipped without 'scenes_file'; 'model_files' get names of the
+// models in order of the objects
+int check_pack_cache(cache_reader_t *reader, const char *scenes_file,
+                     pack_cache_header_t *header, char ***model_files) {
+  pack_cache_header_t expected;
+  init_pack_cache_header(&expected);
+  if ((read_bytes(reader, header, sizeof(*header)) != 0) ||
+      (memcmp(header->magic, expected.magic, sizeof(header->magic)) != 0) ||
+      (header->version != expected.version) ||
+      (header->flt_size != expected.flt_size) ||
+      (header->material_size != expected.material_size) ||
+      (header->scene_size != expected.scene_size) ||
+      (header->with_obj != expected.with_obj)) {
+    return -1;
+  }
+
+  if ((scenes_file != NULL) &&
+      (check_file_stamp(scenes_file, &header->scenes_file) != 0)) {
+    return -1;
+  }
+
+  *model_files = calloc(header->n_models + 1, sizeof(char *));
+  if (*model_files == NULL) {
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < header->n_models; ++i) {
+    uint32_t len;
+    if ((read_bytes(reader, &len, sizeof(len)) != 0) ||
+        (len >= MAX_FILENAME_LEN)) {
+      return -1;
+    }
+
+    file_stamp_t stamp;
+    char *       filename = calloc(len + 1, sizeof(char));
+    (*model_files)[i]     = filename;
+    if ((filename == NULL) || (read_bytes(reader, filename, len) != 0) ||
+        (read_bytes(reader, &stamp, sizeof(stamp)) != 0)) {
+      return -1;
+    }
+
+    if ((scenes_file != NULL) && (check_file_stamp(filename, &stamp) != 0)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+#ifdef WITH_OBJ
+model_t *read_model(cache_reader_t *reader, const char *filename) {
+  model_t *model = calloc(1, sizeof(model_t));
+  if (model == NULL) {
+    return NULL;
+  }
+
+  model->filename    = strdup(filename);
+  model->is_borrowed = reader->borrow;
+  if ((model->filename == NULL) ||
+      (read_aligned_array(reader, sizeof(vec3f),
+                          (void **) &model->mesh.vertices,
+                          &model->mesh.n_vertices) != 0) ||
+      (read_aligned_array(reader, 3 * sizeof(uint32_t),
+                          (void **) &model->mesh.indices,
+                          &model->mesh.n) != 0) ||
+      (read_bytes(reader, &model->bounds, sizeof(aabb_t)) != 0) ||
+      (read_aligned_array(reader, sizeof(bvh_node_t),
+                          (void **) &model->bvh.nodes,
+                          &model->bvh.n_nodes) != 0) ||
+      (read_aligned_array(reader, sizeof(int), (void **) &model->bvh.prims,
+                          &model->bvh.n_prims) != 0)) {
+    free_model(model);
+    return NULL;
+  }
+
+  return model;
+}
+#endif
+
+int read_object(cache_reader_t *reader, object_t *object, char **model_files,
+                int *n_models) {
+  int type;
+  if ((read_bytes(reader, &type, sizeof(type)) != 0) ||
+      (read_bytes(reader, &object->mtrl_idx, sizeof(int)) != 0)) {
+    return -1;
+  }
+
+  switch (type) {
+  case SPHERE:
+    object->data = read_array(reader, sizeof(sphere_t), 1);
+    break;
+  case PLANE:
+    object->data = read_array(reader, sizeof(plane_t), 1);
+    break;
+  case TRIANGLE:
+    object->data = read_array(reader, sizeof(triangle_t), 1);
+    break;
+#ifdef WITH_OBJ
+  case OBJ_MODEL:
+    if (model_files[*n_models] == NULL) {
+      return -1;
+    }
+    object->data = read_model(reader, model_files[(*n_models)++]);
+    break;
+#endif
+  default:
+    return -1;
+  }
+
+#ifndef WITH_OBJ
+  (void) model_files, (void) n_models;
+#endif
+
+  object->type = type;
+  return (object->data == NULL) ? -1 : 0;
+}
+
+int read_scene(cache_reader_t *reader, scene_t *scene) {
+  if (read_bytes(reader, scene, sizeof(scene_t)) != 0) {
+    return -1;
+  }
+
+  scene->objects = NULL;
+  scene->lights  = NULL;
+  scene->accel   = NULL;
+
+  if ((read_counted_array(reader, sizeof(int), (void **) &scene->objects,
+                          &scene->n_objects) != 0) ||
+      (read_counted_array(reader, sizeof(int), (void **) &scene->lights,
+                          &scene->n_lights) != 0)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+// the animation goes as a flag whether there is one, then the header and the
+// tracks with their keyframes
+int read_animation(cache_reader_t *reader, animation_t **animation) {
+  int has_animation = 0;
+  if (read_bytes(reader, &has_animation, sizeof(int)) != 0) {
+    return -1;
+  }
+  if (!has_animation) {
+    return 0;
+  }
+
+  *animation = calloc(1, sizeof(animation_t));
+  if (*animation == NULL) {
+    return -1;
+  }
+
+  animation_t *anim = *animation;
+  int          n    = 0;
+  if ((read_bytes(reader, &anim->scene, sizeof(int)) != 0) ||
+      (read_bytes(reader, &anim->n_frames, sizeof(int)) != 0) ||
+      (read_bytes(reader, &n, sizeof(int)) != 0) || (n < 0) ||
+      ((anim->tracks = calloc(n + 1, sizeof(track_t))) == NULL)) {
+    return -1;
+  }
+
+  anim->n_tracks = n;
+  for (int i = 0; i < anim->n_tracks; ++i) {
+    track_t *track = &anim->tracks[i];
+    if ((read_bytes(reader, &track->object, sizeof(int)) != 0) ||
+        (read_counted_array(reader, sizeof(keyframe_t), (void **) &track->keys,
+                            &track->n_keys) != 0)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// every array is counted in the pack as soon as it is allocated, so a pack
+// which is read partially is freed with 'free_scene_pack'
+scene_pack_t *read_pack(cache_reader_t *reader, char **model_files) {
+  scene_pack_t *pack = calloc(1, sizeof(scene_pack_t));
+  if (pack == NULL) {
+    return NULL;
+  }
+
+  int n_models = 0;
+  int n        = 0;
+  if ((read_counted_array(reader, sizeof(light_t), (void **) &pack->lights,
+                          &pack->n_lights) != 0) ||
+      (read_counted_array(reader, sizeof(material_t),
+                          (void **) &pack->materials,
+                          &pack->n_materials) != 0) ||
+      (read_bytes(reader, &n, sizeof(int)) != 0) || (n < 0) ||
+      ((pack->objects = calloc(n + 1, sizeof(object_t))) == NULL)) {
+    free_scene_pack(pack);
+    return NULL;
+  }
+
+  pack->n_objects = n;
+  for (int i = 0; i < pack->n_objects; ++i) {
+    if (read_object(reader, &pack->objects[i], model_files, &n_models) != 0) {
+      free_scene_pack(pack);
+      return NULL;
+    }
+  }
+
+  if ((read_bytes(reader, &n, sizeof(int)) != 0) || (n < 0) ||
+      ((pack->scenes = calloc(n + 1, sizeof(scene_t))) == NULL)) {
+    free_scene_pack(pack);
+    return NULL;
+  }
+
+  pack->n_scenes = n;
+  for (int i = 0; i < pack->n_scenes; ++i) {
+    if (read_scene(reader, &pack->scenes[i]) != 0) {
+      free_scene_pack(pack);
+      return NULL;
+    }
+  }
+
+  if (read_animation(reader, &pack->animation) != 0) {
+    free_scene_pack(pack);
+    return NULL;
+  }
+
+  return pack;
+}
+
+void free_mapped_arena(void *arena) {
+  unmap_file(arena);
+  free(arena);
+}
+
+// the model arrays of a pack which isn't animated stay in the mapping, it is
+// the arena of the pack then
+scene_pack_t *load_pack_cache(const char *scenes_file) {
+  assert(scenes_file);
+
+  char *         cache_file = get_pack_cache_filename(scenes_file);
+  mapped_file_t *mapped     = malloc(sizeof(mapped_file_t));
+  int            ret        = -1;
+  if ((cache_file != NULL) && (mapped != NULL)) {
+    ret = map_file(cache_file, mapped);
+  }
+  free(cache_file);
+  if (ret != 0) {
+    free(mapped);
+    return NULL;
+  }
+
+  cache_reader_t      reader      = {mapped->data, mapped->data,
+                           mapped->data + mapped->size, 0};
+  pack_cache_header_t header;
+  char **             model_files = NULL;
+  scene_pack_t *      pack        = NULL;
+  if (check_pack_cache(&reader, scenes_file, &header, &model_files) == 0) {
+    reader.borrow = (header.n_models > 0) && !header.is_animated;
+    pack          = read_pack(&reader, model_files);
+  }
+
+  free_model_files(model_files);
+  if ((pack != NULL) && reader.borrow) {
+    pack->arena      = mapped;
+    pack->free_arena = free_mapped_arena;
+  } else {
+    free_mapped_arena(mapped);
+  }
+
+  return pack;
+}
+
+scene_pack_t *deserialize_pack(const void *data, size_t size, int borrow) {
+  assert(data);
+
+  cache_reader_t      reader      = {data, data, (const uint8_t *) data + size,
+                           borrow};
+  pack_cache_header_t header;
+  char **             model_files = NULL;
+  scene_pack_t *      pack        = NULL;
+  if (check_pack_cache(&reader, NULL, &header, &model_files) == 0) {
+    pack = read_pack(&reader, model_files);
+  }
+
+  free_model_files(model_files);
+  return pack;
+}
+// }}}
+
+// {{{ Write cache
+int write_bytes(FILE *file, const void *src, size_t size) {
+  return (fwrite(src, 1, size, file) == size) ? 0 : -1;
+}
+
+int write_counted_array(FILE *file, const void *arr, size_t elem_size,
+                        int n) {
+  if ((write_bytes(file, &n, sizeof(int)) != 0) ||
+      (write_bytes(file, arr, elem_size * n) != 0)) {
+    return -1;
+  }
+  return 0;
+}
+
+int write_aligned_array(FILE *file, const void *arr, size_t elem_size, int n) {
+  static const uint8_t zeros[PACK_ARRAY_ALIGNMENT] = {0};
+
+  long offset = -1;
+  if ((write_bytes(file, &n, sizeof(int)) != 0) ||
+      ((offset = ftell(file)) < 0) ||
+      (write_bytes(file, zeros, get_array_padding(offset)) != 0) ||
+      (write_bytes(file, arr, elem_size * n) != 0)) {
+    return -1;
+  }
+  return 0;
+}
+
+// the stamps are left zero without 'scenes_file'
+int write_pack_header(FILE *file, const char *scenes_file,
+                      const scene_pack_t *pack) {
+  pack_cache_header_t header;
+  init_pack_cache_header(&header);
+  header.is_animated = (pack->animation != NULL);
+  if ((scenes_file != NULL) &&
+      (stamp_file(scenes_file, &header.scenes_file) != 0)) {
+    return -1;
+  }
+
+#ifndef WITH_OBJ
+  (void) pack;
+#else
+  for (int i = 0; i < pack->n_objects; ++i) {
+    header.n_models += (pack->objects[i].type == OBJ_MODEL);
+  }
+#endif
+
+  if (write_bytes(file, &header, sizeof(header)) != 0) {
+    return -1;
+  }
+
+#ifdef WITH_OBJ
+  for (int i = 0; i < pack->n_objects; ++i) {
+    if (pack->objects[i].type != OBJ_MODEL) {
+      continue;
+    }
+
+    const model_t *model = pack->objects[i].data;
+    uint32_t       len   = strlen(model->filename);
+    file_stamp_t   stamp = {0, 0, 0, 0};
+    if (((scenes_file != NULL) &&
+         (stamp_file(model->filename, &stamp) != 0)) ||
+        (write_bytes(file, &len, sizeof(len)) != 0) ||
+        (write_bytes(file, model->filename, len) != 0) ||
+        (write_bytes(file, &stamp, sizeof(stamp)) != 0)) {
+      return -1;
+    }
+  }
+#endif
+
+  return 0;
+}
+
+int write_object(FILE *file, const object_t *object) {
+  int type = object->type;
+  if ((write_bytes(file, &type, sizeof(type)) != 0) ||
+      (write_bytes(file, &object->mtrl_idx, sizeof(int)) != 0)) {
+    return -1;
+  }
+
+  switch (object->type) {
+  case SPHERE:
+    return write_bytes(file, object->data, sizeof(sphere_t));
+  case PLANE:
+    return write_bytes(file, object->data, sizeof(plane_t));
+  case TRIANGLE:
+    return write_bytes(file, object->data, sizeof(triangle_t));
+#ifdef WITH_OBJ
+  case OBJ_MODEL: {
+    const model_t *model = object->data;
+    if ((write_aligned_array(file, model->mesh.vertices, sizeof(vec3f),
+                             model->mesh.n_vertices) != 0) ||
+        (write_aligned_array(file, model->mesh.indices, 3 * sizeof(uint32_t),
+                             model->mesh.n) != 0) ||
+        (write_bytes(file, &model->bounds, sizeof(aabb_t)) != 0) ||
+        (write_aligned_array(file, model->bvh.nodes, sizeof(bvh_node_t),
+                             model->bvh.n_nodes) != 0) ||
+        (write_aligned_array(file, model->bvh.prims, sizeof(int),
+                             model->bvh.n_prims) != 0)) {
+      return -1;
+    }
+    return 0;
+  }
+#endif
+  default:
+    return -1;
+  }
+}
+
+int write_scene(FILE *file, const scene_t *scene) {
+  // copied with the padding, so the same scenes give the same bytes
+  scene_t cached;
+  memcpy(&cached, scene, sizeof(scene_t));
+  cached.objects = NULL;
+  cached.lights  = NULL;
+  cached.accel   = NULL;
+
+  if ((write_bytes(file, &cached, sizeof(scene_t)) != 0) ||
+      (write_counted_array(file, scene->objects, sizeof(int),
+                           scene->n_objects) != 0) ||
+      (write_counted_array(file, scene->lights, sizeof(int),
+                           scene->n_lights) != 0)) {
+    return -1;
+  }
+  return 0;
+}
+
+int write_animation(FILE *file, const animation_t *animation) {
+  int has_animation = (animation != NULL);
+  if (write_bytes(file, &has_animation, sizeof(int)) != 0) {
+    return -1;
+  }
+  if (!has_animation) {
+    return 0;
+  }
+
+  if ((write_bytes(file, &animation->scene, sizeof(int)) != 0) ||
+      (write_bytes(file, &animation->n_frames, sizeof(int)) != 0) ||
+      (write_bytes(file, &animation->n_tracks, sizeof(int)) != 0)) {
+    return -1;
+  }
+
+  for (int i = 0; i < animation->n_tracks; ++i) {
+    const track_t *track = &animation->tracks[i];
+    if ((write_bytes(file, &track->object, sizeof(int)) != 0) ||
+        (write_counted_array(file, track->keys, sizeof(keyframe_t),
+                             track->n_keys) != 0)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int write_pack(FILE *file, const char *scenes_file, const scene_pack_t *pack) {
+  if ((write_pack_header(file, scenes_file, pack) != 0) ||
+      (write_counted_array(file, pack->lights, sizeof(light_t),
+                           pack->n_lights) != 0) ||
+      (write_counted_array(file, pack->materials, sizeof(material_t),
+                           pack->n_materials) != 0) ||
+      (write_bytes(file, &pack->n_objects, sizeof(int)) != 0)) {
+    return -1;
+  }
+
+  for (int i = 0; i < pack->n_objects; ++i) {
+    if (write_object(file, &pack->objects[i]) != 0) {
+      return -1;
+    }
+  }
+
+  if (write_bytes(file, &pack->n_scenes, sizeof(int)) != 0) {
+    return -1;
+  }
+
+  for (int i = 0; i < pack->n_scenes; ++i) {
+    if (write_scene(file, &pack->scenes[i]) != 0) {
+      return -1;
+    }
+  }
+
+  return write_animation(file, pack->animation);
+}
+
+int save_pack_cache(const char *scenes_file, const scene_pack_t *pack) {
+  assert(scenes_file);
+  assert(pack);
+
+  char * cache_file = get_pack_cache_filename(scenes_file);
+  size_t len = strlen(scenes_file) + sizeof(PACK_CACHE_SUFFIX) + TMP_SUFFIX_LEN;
+  char * tmp_file = malloc(len);
+  if ((cache_file == NULL) || (tmp_file == NULL)) {
+    free(cache_file);
+    free(tmp_file);
+    return -1;
+  }
+  snprintf(tmp_file, len, "%s.%d", cache_file, (int) getpid());
+
+  int   ret  = -1;
+  FILE *file = fopen(tmp_file, "wb");
+  if (file != NULL) {
+    ret = write_pack(file, scenes_file, pack);
+    if (fclose(file) != 0) {
+      ret = -1;
+    }
+
+    if ((ret == 0) && (rename(tmp_file, cache_file) != 0)) {
+      ret = -1;
+    }
+
+    if (ret != 0) {
+      remove(tmp_file);
+    }
+  }
+
+  free(cache_file);
+  free(tmp_file);
+  return ret;
+}
+
+void *serialize_pack(const scene_pack_t *pack, size_t *size) {
+  assert(pack);
+  assert(size);
+
+  char *data = NULL;
+  FILE *file = open_memstream(&data, size);
+  if (file == NULL) {
+    return NULL;
+  }
+
+  int ret = write_pack(file, NULL, pack);
+  if (fclose(file) != 0) {
+    ret = -1;
+  }
+
+  if (ret != 0) {
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+// }}}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "scene.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+// Parsed scene packs are cached in binary form in "<scenes file>.cache". The
+// cache holds the whole pack with BVHs of the models and is valid while the
+// scenes file and every model file it refers to have the same contents as
+// when it was written. A file of the same size and modification time is taken
+// to be the same, the contents are hashed otherwise. It is read by the build
+// which has written it only: 'flt_type' and the layout of the structures are
+// part of the cache header.
+
+// FNV-1a-like hash of the contents of the file taken a word at a time, the
+// cache is validated with it
+int hash_file(const char *filename, uint64_t *hash);
+
+// returns NULL if there is no valid cache of the scenes file; the arrays of
+// the models are left in the mapping of the cache unless the pack is animated
+scene_pack_t *load_pack_cache(const char *scenes_file);
+
+// the cache is written to a temporary file first, so concurrent writers (MPI
+// ranks) never leave a torn cache behind
+int save_pack_cache(const char *scenes_file, const scene_pack_t *pack);
+
+// the pack goes in the cache format to a malloc'ed buffer, without hashes of
+// the files: a pack sent to other processes isn't checked against them
+void *serialize_pack(const scene_pack_t *pack, size_t *size);
+// with 'borrow' the arrays of the models point into 'data' (so they are
+// aligned if 'data' is), it must outlive the pack and models can't move
+scene_pack_t *deserialize_pack(const void *data, size_t size, int borrow);
@@ -0,0 +1,105 @@
+#include "pack_pool.h"
+#include "animation.h"
+#include "scene.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+
+int pack_pool_init(pack_pool_t *pool, int capacity, pack_loader_t load,
+                   const void *load_arg, file_hasher_t hash) {
+  assert(pool);
+  assert(capacity > 0);
+  assert(load);
+  assert(hash);
+
+  pool->packs    = calloc(capacity, sizeof(pooled_pack_t));
+  pool->n_packs  = 0;
+  pool->capacity = capacity;
+  pool->load     = load;
+  pool->load_arg = load_arg;
+  pool->hash     = hash;
+  pool->n_uses   = 0;
+
+  return (pool->packs == NULL) ? -1 : 0;
+}
+
+void drop_pooled_pack(pooled_pack_t *pooled) {
+  if (pooled->pack->animation != NULL) {
+    free_animator(&pooled->animator);
+  }
+  free_scene_pack(pooled->pack);
+  pooled->pack = NULL;
+}
+
+void pack_pool_free(pack_pool_t *pool) {
+  assert(pool);
+
+  for (int i = 0; i < pool->n_packs; ++i) {
+    drop_pooled_pack(&pool->packs[i]);
+  }
+
+  free(pool->packs);
+  pool->packs   = NULL;
+  pool->n_packs = 0;
+}
+
+
+
+// returns the least recently used pack if the pool is full
+pooled_pack_t *get_free_slot(pack_pool_t *pool) {
+  if (pool->n_packs < pool->capacity) {
+    return &pool->packs[pool->n_packs++];
+  }
+
+  pooled_pack_t *lru = &pool->packs[0];
+  for (int i = 1; i < pool->n_packs; ++i) {
+    if (pool->packs[i].last_use < lru->last_use) {
+      lru = &pool->packs[i];
+    }
+  }
+
+  drop_pooled_pack(lru);
+  return lru;
+}
+
+pooled_pack_t *pack_pool_get(pack_pool_t *pool, const char *scenes_file) {
+  assert(pool);
+  assert(scenes_file);
+
+  uint64_t hash;
+  if (pool->hash(scenes_file, &hash) != 0) {
+    fprintf(stderr, "Can't read %s\n", scenes_file);
+    return NULL;
+  }
+
+  for (int i = 0; i < pool->n_packs; ++i) {
+    if (pool->packs[i].hash == hash) {
+      pool->packs[i].last_use = ++pool->n_uses;
+      return &pool->packs[i];
+    }
+  }
+
+  scene_pack_t *pack = pool->load(scenes_file, pool->load_arg);
+  if (pack == NULL) {
+    return NULL;
+  }
+
+  animator_t animator = {NULL, NULL, NULL};
+  if ((pack->animation != NULL) && (init_animator(&animator, pack) != 0)) {
+    fprintf(stderr, "Can't animate the scene\n");
+    free_scene_pack(pack);
+    return NULL;
+  }
+
+  pooled_pack_t *pooled = get_free_slot(pool);
+  pooled->hash          = hash;
+  pooled->pack          = pack;
+  pooled->animator      = animator;
+  pooled->last_use      = ++pool->n_uses;
+
+  return pooled;
+}
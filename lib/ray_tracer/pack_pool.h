@@ -0,0 +1,54 @@
+#pragma once
+
+#include "animation.h"
+#include "scene.h"
+
+#include <stdint.h>
+
+
+
+// Packs the render server has loaded stay in memory with their compiled
+// scenes, so jobs on the same scenes file pay for parsing and building once.
+// Packs are keyed by the hash of the scenes file contents: an edited file is
+// loaded anew, and the least recently used pack is dropped when the pool is
+// full. Edits of the model files alone aren't noticed.
+
+// the loader prints what is wrong and returns NULL if the pack can't be
+// loaded, it gets the argument the pool was made with; the hasher returns -1
+// if the file can't be read; both may be collective over MPI ranks as long as
+// every rank asks its pool for the same files in the same order
+typedef scene_pack_t *(*pack_loader_t)(const char *scenes_file,
+                                       const void *arg);
+typedef int (*file_hasher_t)(const char *filename, uint64_t *hash);
+
+typedef struct {
+  uint64_t      hash;
+  scene_pack_t *pack;
+
+  // poses the animated scene if the pack has an animation
+  animator_t animator;
+
+  long long last_use;
+} pooled_pack_t;
+
+typedef struct {
+  pooled_pack_t *packs;
+  int            n_packs;
+  int            capacity;
+
+  pack_loader_t load;
+  const void *  load_arg;
+  file_hasher_t hash;
+
+  long long n_uses;
+} pack_pool_t;
+
+
+
+int  pack_pool_init(pack_pool_t *pool, int capacity, pack_loader_t load,
+                    const void *load_arg, file_hasher_t hash);
+void pack_pool_free(pack_pool_t *pool);
+
+// returns NULL if the scenes file can't be loaded; the pack is valid until
+// the next call
+pooled_pack_t *pack_pool_get(pack_pool_t *pool, const char *scenes_file);
@@ -0,0 +1,557 @@
+#include "primitives.h"
+#include "geometry.h"
+#include "simd.h"
+
+#include "flt_type.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+
+
+enum {
+  N_SPHERE_COMPONENTS   = 4,
+  N_TRIANGLE_COMPONENTS = 9,
+};
+
+static const flt_type TRIANGLE_EPSILON = 0.00001;
+
+
+
+// all components live in one zeroed block, each one padded with SIMD_WIDTH
+// elements
+flt_type *alloc_soa_components(flt_type **components, int n_components,
+                               int n) {
+  int       stride = n + SIMD_WIDTH;
+  flt_type *block  = calloc(n_components * stride, sizeof(flt_type));
+  if (block == NULL) {
+    return NULL;
+  }
+
+  for (int i = 0; i < n_components; ++i) {
+    components[i] = block + i * stride;
+  }
+
+  return block;
+}
+
+
+
+int alloc_spheres_soa(spheres_soa_t *spheres, int n) {
+  assert(spheres);
+  assert(n >= 0);
+
+  flt_type *components[N_SPHERE_COMPONENTS];
+  if (alloc_soa_components(components, N_SPHERE_COMPONENTS, n) == NULL) {
+    return -1;
+  }
+
+  spheres->center_x = components[0];
+  spheres->center_y = components[1];
+  spheres->center_z = components[2];
+  spheres->radius   = components[3];
+  spheres->n        = n;
+
+  return 0;
+}
+
+void set_soa_sphere(spheres_soa_t *spheres, int idx, const sphere_t *sphere) {
+  assert(spheres);
+  assert(sphere);
+  assert((idx >= 0) && (idx < spheres->n));
+
+  spheres->center_x[idx] = sphere->center.x;
+  spheres->center_y[idx] = sphere->center.y;
+  spheres->center_z[idx] = sphere->center.z;
+  spheres->radius[idx]   = sphere->radius;
+}
+
+void free_spheres_soa(spheres_soa_t *spheres) {
+  assert(spheres);
+  free(spheres->center_x);
+  spheres->center_x = NULL;
+  spheres->n        = 0;
+}
+
+
+
+// normalized twice to be bit-exact with the normals shading used to compute
+vec3f get_triangle_normal(const triangle_t *triangle) {
+  vec3f ab = vec3f_sub(triangle->b, triangle->a);
+  vec3f bc = vec3f_sub(triangle->c, triangle->b);
+  return vec3f_normalize(vec3f_normalize(vec3f_vec_mul(ab, bc)));
+}
+
+int alloc_triangles_soa(triangles_soa_t *triangles, int n) {
+  assert(triangles);
+  assert(n >= 0);
+
+  flt_type *components[N_TRIANGLE_COMPONENTS];
+  if (alloc_soa_components(components, N_TRIANGLE_COMPONENTS, n) == NULL) {
+    return -1;
+  }
+
+  triangles->a_x  = components[0];
+  triangles->a_y  = components[1];
+  triangles->a_z  = components[2];
+  triangles->ab_x = components[3];
+  triangles->ab_y = components[4];
+  triangles->ab_z = components[5];
+  triangles->ac_x = components[6]; // NOLINT: not a magic number
+  triangles->ac_y = components[7]; // NOLINT: not a magic number
+  triangles->ac_z = components[8]; // NOLINT: not a magic number
+  triangles->n    = n;
+
+  return 0;
+}
+
+void set_soa_triangle(triangles_soa_t *triangles, int idx,
+                      const triangle_t *triangle) {
+  assert(triangles);
+  assert(triangle);
+  assert((idx >= 0) && (idx < triangles->n));
+
+  vec3f ab = vec3f_sub(triangle->b, triangle->a);
+  vec3f ac = vec3f_sub(triangle->c, triangle->a);
+
+  triangles->a_x[idx]  = triangle->a.x;
+  triangles->a_y[idx]  = triangle->a.y;
+  triangles->a_z[idx]  = triangle->a.z;
+  triangles->ab_x[idx] = ab.x;
+  triangles->ab_y[idx] = ab.y;
+  triangles->ab_z[idx] = ab.z;
+  triangles->ac_x[idx] = ac.x;
+  triangles->ac_y[idx] = ac.y;
+  triangles->ac_z[idx] = ac.z;
+}
+
+void free_triangles_soa(triangles_soa_t *triangles) {
+  assert(triangles);
+  free(triangles->a_x);
+  triangles->a_x = NULL;
+  triangles->n   = 0;
+}
+
+triangle_t get_mesh_triangle(const triangle_mesh_t *mesh, int idx) {
+  assert(mesh);
+  assert((idx >= 0) && (idx < mesh->n));
+
+  const uint32_t *indices = mesh->indices + 3 * idx;
+
+  triangle_t triangle = {mesh->vertices[indices[0]], mesh->vertices[indices[1]],
+                         mesh->vertices[indices[2]]};
+  return triangle;
+}
+
+void free_triangle_mesh(triangle_mesh_t *mesh) {
+  assert(mesh);
+  free(mesh->vertices);
+  free(mesh->indices);
+  mesh->vertices   = NULL;
+  mesh->indices    = NULL;
+  mesh->n_vertices = 0;
+  mesh->n          = 0;
+}
+
+
+
+#if SIMD_ENABLED
+// picks the nearest lane set in 'mask' and narrows 'max_dist' to it
+int closest_lane(vflt distance, int mask, int first_idx, int hit,
+                 flt_type *max_dist) {
+  flt_type lanes[SIMD_WIDTH];
+  vflt_storeu(lanes, distance);
+
+  for (int lane = 0; lane < SIMD_WIDTH; ++lane) {
+    if ((mask & (1 << lane)) && (lanes[lane] < *max_dist)) {
+      *max_dist = lanes[lane];
+      hit       = first_idx + lane;
+    }
+  }
+
+  return hit;
+}
+
+int valid_lanes_mask(int n_left) {
+  return (n_left >= SIMD_WIDTH) ? (1 << SIMD_WIDTH) - 1 : (1 << n_left) - 1;
+}
+#endif
+
+
+
+// vectorized version of 'ray_intersect_sphere'
+int ray_intersect_spheres(const spheres_soa_t *spheres, int first, int count,
+                          const vec3f src, const vec3f dir, flt_type max_dist,
+                          flt_type *dist) {
+  assert(spheres);
+  assert((first >= 0) && (first + count <= spheres->n));
+
+  int hit = -1;
+
+#if SIMD_ENABLED
+  const vflt zero  = vflt_set1(FLT_ZERO);
+  const vflt src_x = vflt_set1(src.x);
+  const vflt src_y = vflt_set1(src.y);
+  const vflt src_z = vflt_set1(src.z);
+  const vflt dir_x = vflt_set1(dir.x);
+  const vflt dir_y = vflt_set1(dir.y);
+  const vflt dir_z = vflt_set1(dir.z);
+
+  for (int i = first; i < first + count; i += SIMD_WIDTH) {
+    vflt dc_x = vflt_sub(vflt_loadu(spheres->center_x + i), src_x);
+    vflt dc_y = vflt_sub(vflt_loadu(spheres->center_y + i), src_y);
+    vflt dc_z = vflt_sub(vflt_loadu(spheres->center_z + i), src_z);
+    vflt r    = vflt_loadu(spheres->radius + i);
+
+    vflt mul   = vflt_dot(dc_x, dc_y, dc_z, dir_x, dir_y, dir_z);
+    vflt dc_sq = vflt_dot(dc_x, dc_y, dc_z, dc_x, dc_y, dc_z);
+    vflt discriminant =
+        vflt_add(vflt_sub(vflt_mul(r, r), dc_sq), vflt_mul(mul, mul));
+    vflt valid = vflt_le(zero, discriminant);
+
+    vflt disc_sqrt = vflt_sqrt(vflt_max(discriminant, zero));
+    vflt near      = vflt_sub(mul, disc_sqrt);
+    vflt far       = vflt_add(mul, disc_sqrt);
+    vflt distance  = vflt_select(vflt_lt(near, zero), near, far);
+
+    valid = vflt_and(valid, vflt_le(zero, distance));
+    valid = vflt_and(valid, vflt_lt(distance, vflt_set1(max_dist)));
+
+    int mask = vflt_mask(valid) & valid_lanes_mask(first + count - i);
+    if (mask) {
+      hit = closest_lane(distance, mask, i, hit, &max_dist);
+    }
+  }
+#else
+  for (int i = first; i < first + count; ++i) {
+    vec3f dist_center = {spheres->center_x[i] - src.x,
+                         spheres->center_y[i] - src.y,
+                         spheres->center_z[i] - src.z};
+    flt_type mul      = vec3f_scalar_mul(dist_center, dir);
+
+    flt_type discriminant = spheres->radius[i] * spheres->radius[i] -
+                            vec3f_scalar_mul(dist_center, dist_center) +
+                            mul * mul;
+    if (discriminant < 0) {
+      continue;
+    }
+
+    flt_type disc_sqrt = flt_sqrt(discriminant);
+    flt_type distance =
+        (mul - disc_sqrt) < 0 ? mul + disc_sqrt : mul - disc_sqrt;
+    if ((distance >= 0) && (distance < max_dist)) {
+      max_dist = distance;
+      hit      = i;
+    }
+  }
+#endif
+
+  if ((hit >= 0) && (dist != NULL)) {
+    *dist = max_dist;
+  }
+
+  return hit;
+}
+
+
+
+// vectorized version of 'ray_intersect_triangle'
+int ray_intersect_triangles(const triangles_soa_t *triangles, int first,
+                            int count, const vec3f src, const vec3f dir,
+                            flt_type max_dist, flt_type *dist) {
+  assert(triangles);
+  assert((first >= 0) && (first + count <= triangles->n));
+
+  int hit = -1;
+
+#if SIMD_ENABLED
+  const vflt zero    = vflt_set1(FLT_ZERO);
+  const vflt one     = vflt_set1(FLT_ONE);
+  const vflt epsilon = vflt_set1(TRIANGLE_EPSILON);
+  const vflt src_x   = vflt_set1(src.x);
+  const vflt src_y   = vflt_set1(src.y);
+  const vflt src_z   = vflt_set1(src.z);
+  const vflt dir_x   = vflt_set1(dir.x);
+  const vflt dir_y   = vflt_set1(dir.y);
+  const vflt dir_z   = vflt_set1(dir.z);
+
+  for (int i = first; i < first + count; i += SIMD_WIDTH) {
+    vflt ab_x = vflt_loadu(triangles->ab_x + i);
+    vflt ab_y = vflt_loadu(triangles->ab_y + i);
+    vflt ab_z = vflt_loadu(triangles->ab_z + i);
+    vflt ac_x = vflt_loadu(triangles->ac_x + i);
+    vflt ac_y = vflt_loadu(triangles->ac_y + i);
+    vflt ac_z = vflt_loadu(triangles->ac_z + i);
+
+    vflt p_x = vflt_sub(vflt_mul(dir_y, ac_z), vflt_mul(dir_z, ac_y));
+    vflt p_y = vflt_sub(vflt_mul(dir_z, ac_x), vflt_mul(dir_x, ac_z));
+    vflt p_z = vflt_sub(vflt_mul(dir_x, ac_y), vflt_mul(dir_y, ac_x));
+    vflt mul = vflt_dot(ab_x, ab_y, ab_z, p_x, p_y, p_z);
+
+    // ray is parallel to the triangle
+    vflt valid = vflt_le(epsilon, vflt_abs(mul));
+
+    vflt t_x = vflt_sub(src_x, vflt_loadu(triangles->a_x + i));
+    vflt t_y = vflt_sub(src_y, vflt_loadu(triangles->a_y + i));
+    vflt t_z = vflt_sub(src_z, vflt_loadu(triangles->a_z + i));
+    vflt u   = vflt_div(vflt_dot(t_x, t_y, t_z, p_x, p_y, p_z), mul);
+    valid    = vflt_and(valid, vflt_and(vflt_le(zero, u), vflt_le(u, one)));
+
+    vflt q_x = vflt_sub(vflt_mul(t_y, ab_z), vflt_mul(t_z, ab_y));
+    vflt q_y = vflt_sub(vflt_mul(t_z, ab_x), vflt_mul(t_x, ab_z));
+    vflt q_z = vflt_sub(vflt_mul(t_x, ab_y), vflt_mul(t_y, ab_x));
+    vflt v   = vflt_div(vflt_dot(dir_x, dir_y, dir_z, q_x, q_y, q_z), mul);
+    valid    = vflt_and(valid, vflt_le(zero, v));
+    valid    = vflt_and(valid, vflt_le(vflt_add(u, v), one));
+
+    vflt distance = vflt_div(vflt_dot(ac_x, ac_y, ac_z, q_x, q_y, q_z), mul);
+    valid = vflt_and(valid, vflt_le(zero, distance));
+    valid = vflt_and(valid, vflt_lt(distance, vflt_set1(max_dist)));
+
+    int mask = vflt_mask(valid) & valid_lanes_mask(first + count - i);
+    if (mask) {
+      hit = closest_lane(distance, mask, i, hit, &max_dist);
+    }
+  }
+#else
+  for (int i = first; i < first + count; ++i) {
+    vec3f ab = {triangles->ab_x[i], triangles->ab_y[i], triangles->ab_z[i]};
+    vec3f ac = {triangles->ac_x[i], triangles->ac_y[i], triangles->ac_z[i]};
+    vec3f a  = {triangles->a_x[i], triangles->a_y[i], triangles->a_z[i]};
+
+    vec3f    p_vec = vec3f_vec_mul(dir, ac);
+    flt_type mul   = vec3f_scalar_mul(ab, p_vec);
+    if (flt_abs(mul) < TRIANGLE_EPSILON) {
+      continue; // ray is parallel to the triangle
+    }
+
+    vec3f    t_vec = vec3f_sub(src, a);
+    flt_type u     = vec3f_scalar_mul(t_vec, p_vec) / mul;
+    if ((u < 0) || (u > 1)) {
+      continue;
+    }
+
+    vec3f    q_vec = vec3f_vec_mul(t_vec, ab);
+    flt_type v     = vec3f_scalar_mul(dir, q_vec) / mul;
+    if ((v < 0) || (u + v > 1)) {
+      continue;
+    }
+
+    flt_type distance = vec3f_scalar_mul(ac, q_vec) / mul;
+    if ((distance >= 0) && (distance < max_dist)) {
+      max_dist = distance;
+      hit      = i;
+    }
+  }
+#endif
+
+  if ((hit >= 0) && (dist != NULL)) {
+    *dist = max_dist;
+  }
+
+  return hit;
+}
+
+
+
+// the triangles of every vector are gathered by their vertex indices right
+// before the SoA kernel runs on them, lanes past the range repeat its last
+// triangle and are masked out by the kernel; so the mesh keeps only the shared
+// vertices and indices and nothing is unpacked ahead
+int ray_intersect_mesh_triangles(const triangle_mesh_t *mesh, int first,
+                                 int count, const vec3f src, const vec3f dir,
+                                 flt_type max_dist, flt_type *dist) {
+  assert(mesh);
+  assert((first >= 0) && (first + count <= mesh->n));
+
+  flt_type components[N_TRIANGLE_COMPONENTS][SIMD_WIDTH];
+
+  triangles_soa_t lanes = {
+      components[0], components[1], components[2],
+      components[3], components[4], components[5],
+      components[6], components[7], components[8], // NOLINT: not magic
+      SIMD_WIDTH,
+  };
+
+  int hit = -1;
+  for (int i = first; i < first + count; i += SIMD_WIDTH) {
+    int n = first + count - i;
+    if (n > SIMD_WIDTH) {
+      n = SIMD_WIDTH;
+    }
+
+    for (int j = 0; j < SIMD_WIDTH; ++j) {
+      triangle_t triangle = get_mesh_triangle(mesh, i + ((j < n) ? j : n - 1));
+      set_soa_triangle(&lanes, j, &triangle);
+    }
+
+    int pos =
+        ray_intersect_triangles(&lanes, 0, n, src, dir, max_dist, &max_dist);
+    if (pos >= 0) {
+      hit = i + pos;
+    }
+  }
+
+  if ((hit >= 0) && (dist != NULL)) {
+    *dist = max_dist;
+  }
+
+  return hit;
+}
+
+
+
+#if SIMD_ENABLED
+// 'valid' lanes starting from 'lane' take 'distance' and the primitive index
+void update_packet_hits(ray_packet_t *packet, int lane, vflt distance,
+                        vflt valid, int prim, int *hits) {
+  vflt dist = vflt_loadu(packet->dist + lane);
+  vflt_storeu(packet->dist + lane, vflt_select(valid, dist, distance));
+
+  int hit_mask = vflt_mask(valid);
+
+  for (int i = 0; i < SIMD_WIDTH; ++i) {
+    if (hit_mask & (1 << i)) {
+      hits[lane + i] = prim;
+    }
+  }
+}
+#endif
+
+
+
+// the same as 'ray_intersect_spheres' but with rays in SIMD lanes: every
+// sphere is tested against the whole packet at once, so even a leaf with a
+// single sphere fills the vectors
+void ray_packet_intersect_spheres(const spheres_soa_t *spheres, int first,
+                                  int count, ray_packet_t *packet, int *hits) {
+  assert(spheres);
+  assert(packet);
+  assert(hits);
+  assert((first >= 0) && (first + count <= spheres->n));
+
+#if SIMD_ENABLED
+  const vflt zero = vflt_set1(FLT_ZERO);
+
+  for (int i = first; i < first + count; ++i) {
+    const vflt center_x = vflt_set1(spheres->center_x[i]);
+    const vflt center_y = vflt_set1(spheres->center_y[i]);
+    const vflt center_z = vflt_set1(spheres->center_z[i]);
+    const vflt r        = vflt_set1(spheres->radius[i]);
+
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane += SIMD_WIDTH) {
+      vflt dir_x = vflt_loadu(packet->dir_x + lane);
+      vflt dir_y = vflt_loadu(packet->dir_y + lane);
+      vflt dir_z = vflt_loadu(packet->dir_z + lane);
+      vflt dc_x  = vflt_sub(center_x, vflt_loadu(packet->src_x + lane));
+      vflt dc_y  = vflt_sub(center_y, vflt_loadu(packet->src_y + lane));
+      vflt dc_z  = vflt_sub(center_z, vflt_loadu(packet->src_z + lane));
+
+      vflt mul   = vflt_dot(dc_x, dc_y, dc_z, dir_x, dir_y, dir_z);
+      vflt dc_sq = vflt_dot(dc_x, dc_y, dc_z, dc_x, dc_y, dc_z);
+      vflt discriminant =
+          vflt_add(vflt_sub(vflt_mul(r, r), dc_sq), vflt_mul(mul, mul));
+      vflt valid = vflt_le(zero, discriminant);
+
+      vflt disc_sqrt = vflt_sqrt(vflt_max(discriminant, zero));
+      vflt near      = vflt_sub(mul, disc_sqrt);
+      vflt far       = vflt_add(mul, disc_sqrt);
+      vflt distance  = vflt_select(vflt_lt(near, zero), near, far);
+
+      valid = vflt_and(valid, vflt_le(zero, distance));
+      valid = vflt_and(valid,
+                       vflt_lt(distance, vflt_loadu(packet->dist + lane)));
+
+      if (vflt_mask(valid)) {
+        update_packet_hits(packet, lane, distance, valid, i, hits);
+      }
+    }
+  }
+#else
+  for (int lane = 0; lane < packet->n; ++lane) {
+    int hit = ray_intersect_spheres(
+        spheres, first, count, ray_packet_src(packet, lane),
+        ray_packet_dir(packet, lane), packet->dist[lane], &packet->dist[lane]);
+    if (hit >= 0) {
+      hits[lane] = hit;
+    }
+  }
+#endif
+}
+
+
+
+// packet version of 'ray_intersect_triangles'
+void ray_packet_intersect_triangles(const triangles_soa_t *triangles,
+                                    int first, int count, ray_packet_t *packet,
+                                    int *hits) {
+  assert(triangles);
+  assert(packet);
+  assert(hits);
+  assert((first >= 0) && (first + count <= triangles->n));
+
+#if SIMD_ENABLED
+  const vflt zero    = vflt_set1(FLT_ZERO);
+  const vflt one     = vflt_set1(FLT_ONE);
+  const vflt epsilon = vflt_set1(TRIANGLE_EPSILON);
+
+  for (int i = first; i < first + count; ++i) {
+    const vflt a_x  = vflt_set1(triangles->a_x[i]);
+    const vflt a_y  = vflt_set1(triangles->a_y[i]);
+    const vflt a_z  = vflt_set1(triangles->a_z[i]);
+    const vflt ab_x = vflt_set1(triangles->ab_x[i]);
+    const vflt ab_y = vflt_set1(triangles->ab_y[i]);
+    const vflt ab_z = vflt_set1(triangles->ab_z[i]);
+    const vflt ac_x = vflt_set1(triangles->ac_x[i]);
+    const vflt ac_y = vflt_set1(triangles->ac_y[i]);
+    const vflt ac_z = vflt_set1(triangles->ac_z[i]);
+
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane += SIMD_WIDTH) {
+      vflt dir_x = vflt_loadu(packet->dir_x + lane);
+      vflt dir_y = vflt_loadu(packet->dir_y + lane);
+      vflt dir_z = vflt_loadu(packet->dir_z + lane);
+
+      vflt p_x = vflt_sub(vflt_mul(dir_y, ac_z), vflt_mul(dir_z, ac_y));
+      vflt p_y = vflt_sub(vflt_mul(dir_z, ac_x), vflt_mul(dir_x, ac_z));
+      vflt p_z = vflt_sub(vflt_mul(dir_x, ac_y), vflt_mul(dir_y, ac_x));
+      vflt mul = vflt_dot(ab_x, ab_y, ab_z, p_x, p_y, p_z);
+
+      // ray is parallel to the triangle
+      vflt valid = vflt_le(epsilon, vflt_abs(mul));
+
+      vflt t_x = vflt_sub(vflt_loadu(packet->src_x + lane), a_x);
+      vflt t_y = vflt_sub(vflt_loadu(packet->src_y + lane), a_y);
+      vflt t_z = vflt_sub(vflt_loadu(packet->src_z + lane), a_z);
+      vflt u   = vflt_div(vflt_dot(t_x, t_y, t_z, p_x, p_y, p_z), mul);
+      valid    = vflt_and(valid, vflt_and(vflt_le(zero, u), vflt_le(u, one)));
+
+      vflt q_x = vflt_sub(vflt_mul(t_y, ab_z), vflt_mul(t_z, ab_y));
+      vflt q_y = vflt_sub(vflt_mul(t_z, ab_x), vflt_mul(t_x, ab_z));
+      vflt q_z = vflt_sub(vflt_mul(t_x, ab_y), vflt_mul(t_y, ab_x));
+      vflt v   = vflt_div(vflt_dot(dir_x, dir_y, dir_z, q_x, q_y, q_z), mul);
+      valid    = vflt_and(valid, vflt_le(zero, v));
+      valid    = vflt_and(valid, vflt_le(vflt_add(u, v), one));
+
+      vflt distance =
+          vflt_div(vflt_dot(ac_x, ac_y, ac_z, q_x, q_y, q_z), mul);
+      valid = vflt_and(valid, vflt_le(zero, distance));
+      valid = vflt_and(valid,
+                       vflt_lt(distance, vflt_loadu(packet->dist + lane)));
+
+      if (vflt_mask(valid)) {
+        update_packet_hits(packet, lane, distance, valid, i, hits);
+      }
+    }
+  }
+#else
+  for (int lane = 0; lane < packet->n; ++lane) {
+    int hit = ray_intersect_triangles(
+        triangles, first, count, ray_packet_src(packet, lane),
+        ray_packet_dir(packet, lane), packet->dist[lane], &packet->dist[lane]);
+    if (hit >= 0) {
+      hits[lane] = hit;
+    }
+  }
+#endif
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "geometry.h"
+
+#include "flt_type.h"
+
+#include <stdint.h>
+
+
+
+// structure-of-arrays storage for the SIMD intersection kernels; arrays are
+// padded, so kernels may load a whole vector starting at any valid index
+typedef struct {
+  flt_type *center_x;
+  flt_type *center_y;
+  flt_type *center_z;
+  flt_type *radius;
+
+  int n;
+} spheres_soa_t;
+
+// triangles are stored as vertex 'a' and the edges 'ab' and 'ac' as
+// Moller-Trumbore algorithm needs them
+typedef struct {
+  flt_type *a_x;
+  flt_type *a_y;
+  flt_type *a_z;
+  flt_type *ab_x;
+  flt_type *ab_y;
+  flt_type *ab_z;
+  flt_type *ac_x;
+  flt_type *ac_y;
+  flt_type *ac_z;
+
+  int n;
+} triangles_soa_t;
+
+// triangles sharing their vertices: triangle 'i' is made of the vertices
+// 'indices[3 * i]', 'indices[3 * i + 1]' and 'indices[3 * i + 2]'
+typedef struct {
+  vec3f *   vertices;
+  uint32_t *indices;
+
+  int n_vertices;
+  int n;
+} triangle_mesh_t;
+
+
+
+int  alloc_spheres_soa(spheres_soa_t *spheres, int n);
+void set_soa_sphere(spheres_soa_t *spheres, int idx, const sphere_t *sphere);
+void free_spheres_soa(spheres_soa_t *spheres);
+
+vec3f get_triangle_normal(const triangle_t *triangle);
+
+int  alloc_triangles_soa(triangles_soa_t *triangles, int n);
+void set_soa_triangle(triangles_soa_t *triangles, int idx,
+                      const triangle_t *triangle);
+void free_triangles_soa(triangles_soa_t *triangles);
+
+triangle_t get_mesh_triangle(const triangle_mesh_t *mesh, int idx);
+void       free_triangle_mesh(triangle_mesh_t *mesh);
+
+// return index of the closest primitive from [first, first + count) which is
+// hit nearer than 'max_dist' or -1
+int ray_intersect_spheres(const spheres_soa_t *spheres, int first, int count,
+                          vec3f src, vec3f dir, flt_type max_dist,
+                          flt_type *dist);
+int ray_intersect_triangles(const triangles_soa_t *triangles, int first,
+                            int count, vec3f src, vec3f dir, flt_type max_dist,
+                            flt_type *dist);
+int ray_intersect_mesh_triangles(const triangle_mesh_t *mesh, int first,
+                                 int count, vec3f src, vec3f dir,
+                                 flt_type max_dist, flt_type *dist);
+
+// the same for every ray of the packet: 'dist' of the rays is narrowed and
+// 'hits' gets index of the closest primitive for the rays that hit one
+void ray_packet_intersect_spheres(const spheres_soa_t *spheres, int first,
+                                  int count, ray_packet_t *packet, int *hits);
+void ray_packet_intersect_triangles(const triangles_soa_t *triangles,
+                                    int first, int count, ray_packet_t *packet,
+                                    int *hits);
@@ -1,246 +1,474 @@
 #include "ray_casting.h"
+#include "accel.h"
+#include "bvh.h"
 #include "colors.h"
 #include "geometry.h"
+#include "primitives.h"
 
 #include "flt_type.h"
 
+#ifdef WITH_OBJ
+  #include "obj_model.h"
+#endif
+
 #include <assert.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 
-int ray_intersect_sphere(const sphere_t *sphere, const vec3f src,
-                         const vec3f dir, flt_type *dist) {
-  assert(sphere);
-
-  vec3f    dist_center = vec3f_sub(sphere->center, src);
-  flt_type mul         = vec3f_scalar_mul(dist_center, dir);
+// returns 1 if the ray hits the plane nearer than 'max_dist'
+int ray_intersect_plane(const accel_plane_t *plane, const vec3f src,
+                        const vec3f dir, const flt_type max_dist,
+                        flt_type *dist) {
+  assert(plane);
 
-  flt_type discriminant = sphere->radius * sphere->radius -
-                          vec3f_scalar_mul(dist_center, dist_center) +
-                          mul * mul;
-  if (discriminant < 0) {
+  flt_type distance = (plane->dist - vec3f_scalar_mul(src, plane->n)) /
+                      vec3f_scalar_mul(dir, plane->n);
+  if ((distance < 0) || (distance >= max_dist)) {
     return 0;
   }
 
-  flt_type disc_sqrt = sqrt(discriminant);
-  flt_type distance = (mul - disc_sqrt) < 0 ? mul + disc_sqrt : mul - disc_sqrt;
-
   if (dist != NULL) {
     *dist = distance;
   }
 
-  return distance < 0 ? 0 : 1;
+  return 1;
 }
 
-int ray_intersect_plane(const plane_t *plane, const vec3f src, const vec3f dir,
-                        flt_type *dist) {
-  assert(plane);
+#ifdef WITH_OBJ
+typedef struct {
+  const model_t *model;
 
-  flt_type distance = (vec3f_scalar_mul(plane->r0, plane->n) -
-                       vec3f_scalar_mul(src, plane->n)) /
-                      vec3f_scalar_mul(dir, plane->n);
+  int *face;
+} model_ray_data_t;
 
-  if (dist != NULL) {
-    *dist = distance;
+int ray_intersect_model_leaf(const void *data, const bvh_node_t *leaf,
+                             const vec3f src, const vec3f dir,
+                             const flt_type max_dist, flt_type *dist) {
+  const model_ray_data_t *ray_data = data;
+  const model_t *         model    = ray_data->model;
+
+  int pos = ray_intersect_mesh_triangles(&model->mesh, leaf->first,
+                                         leaf->count, src, dir, max_dist, dist);
+  if (pos < 0) {
+    return 0;
   }
 
-  return distance < 0 ? 0 : 1;
+  *ray_data->face = pos;
+  return 1;
 }
 
-// Moller-Trumbore intersection algorithm
-int ray_intersect_triangle(const triangle_t *triangle, const vec3f src,
-                           const vec3f dir, flt_type *dist) {
-  assert(triangle);
-
-  vec3f    ab    = vec3f_sub(triangle->b, triangle->a);
-  vec3f    bc    = vec3f_sub(triangle->c, triangle->b);
-  vec3f    p_vec = vec3f_vec_mul(dir, bc);
-  flt_type mul   = vec3f_scalar_mul(ab, p_vec);
-
-  const flt_type epsilon = 0.00001;
-  if (flt_abs(mul) < epsilon) {
-    return 0; // ray is parallel to the triangle
-  }
+int ray_intersect_model(const model_t *model, const vec3f src, const vec3f dir,
+                        const flt_type max_dist, flt_type *dist, int *face) {
+  assert(model);
 
-  vec3f    t_vec = vec3f_sub(src, triangle->a);
-  flt_type u     = vec3f_scalar_mul(t_vec, p_vec) / mul;
-  if ((u < 0) || (u > 1)) {
+  flt_type         shortest_distance = FLT_TYPE_MAX;
+  int              intersect_face    = -1;
+  model_ray_data_t ray_data          = {model, &intersect_face};
+  if (!bvh_intersect(&model->bvh, ray_intersect_model_leaf, &ray_data, src,
+                     dir, max_dist, &shortest_distance))
     return 0;
-  }
 
-  vec3f    q_vec = vec3f_vec_mul(t_vec, ab);
-  flt_type v     = vec3f_scalar_mul(dir, q_vec) / mul;
-  if ((v < 0) || (u + v > 1)) {
-    return 0;
-  }
+  if (dist != NULL)
+    *dist = shortest_distance;
 
-  flt_type distance = vec3f_scalar_mul(bc, q_vec) / mul;
+  if (face != NULL)
+    *face = intersect_face;
 
-  if (dist != NULL) {
-    *dist = distance;
-  }
+  return 1;
+}
 
-  return distance < 0 ? 0 : 1;
+int ray_occluded_model_leaf(const void *data, const bvh_node_t *leaf,
+                            const vec3f src, const vec3f dir,
+                            const flt_type max_dist, flt_type *dist) {
+  const model_t *model = data;
+  return ray_intersect_mesh_triangles(&model->mesh, leaf->first, leaf->count,
+                                      src, dir, max_dist, dist) >= 0;
 }
+#endif
 
+// models of the compiled scene are 'model_t' only with WITH_OBJ
+int ray_intersect_accel_model(const scene_accel_t *accel, int idx,
+                              const vec3f src, const vec3f dir,
+                              const flt_type max_dist, flt_type *dist,
+                              int *face) {
 #ifdef WITH_OBJ
-int ray_intersect_model(const model_t *model, const vec3f src, const vec3f dir,
-                        flt_type *dist) {
-  assert(model);
+  return ray_intersect_model(accel->models[idx], src, dir, max_dist, dist,
+                             face);
+#else
+  (void) accel, (void) idx, (void) src, (void) dir, (void) max_dist;
+  (void) dist, (void) face;
+  assert(0 && "models are supported only with WITH_OBJ!");
+  return 0;
+#endif
+}
 
-  int      intersect_face    = -1;
-  flt_type shortest_distance = FLT_TYPE_MAX;
-  for (int i = 0; i < model->n_triangles; i++) {
-    flt_type distance = FLT_TYPE_MAX;
-    if (ray_intersect_triangle(model->triangles + i, src, dir, &distance) &&
-        (distance < shortest_distance)) {
-      shortest_distance = distance;
-      intersect_face    = i + 1;
-    }
+int ray_occluded_accel_model(const scene_accel_t *accel, int idx,
+                             const vec3f src, const vec3f dir,
+                             const flt_type max_dist) {
+#ifdef WITH_OBJ
+  const model_t *model = accel->models[idx];
+  return bvh_occluded(&model->bvh, ray_occluded_model_leaf, model, src, dir,
+                      max_dist);
+#else
+  (void) accel, (void) idx, (void) src, (void) dir, (void) max_dist;
+  assert(0 && "models are supported only with WITH_OBJ!");
+  return 0;
+#endif
+}
+
+// returns 1 if the ray hits the primitive nearer than 'max_dist'
+int ray_occluded_prim(const scene_accel_t *accel, const prim_ref_t prim,
+                      const vec3f src, const vec3f dir,
+                      const flt_type max_dist) {
+  switch (prim.kind) {
+  case SPHERE_PRIM:
+    return ray_intersect_spheres(&accel->spheres, prim.idx, 1, src, dir,
+                                 max_dist, NULL) >= 0;
+  case TRIANGLE_PRIM:
+    return ray_intersect_triangles(&accel->triangles, prim.idx, 1, src, dir,
+                                   max_dist, NULL) >= 0;
+  case MODEL_PRIM:
+    return ray_occluded_accel_model(accel, prim.idx, src, dir, max_dist);
+  case PLANE_PRIM:
+    return ray_intersect_plane(&accel->planes[prim.idx], src, dir, max_dist,
+                               NULL);
+  default:
+    return 0;
   }
+}
+
 
-  if (dist != NULL)
-    *dist = shortest_distance;
 
-  return intersect_face > 0 ? intersect_face : 0;
+// the normal is turned against the ray for two-sided primitives
+vec3f face_normal(const vec3f normal, const vec3f dir) {
+  return (vec3f_scalar_mul(dir, normal) <= 0) ? normal
+                                              : vec3f_mul(normal, -1.0);
 }
-#endif
 
-int ray_intersect(const object_t *object, const vec3f src, const vec3f dir,
-                  flt_type *dist) {
-  assert(object);
-#ifndef NDEBUG
-  const flt_type epsilon = 0.00001;
-  if (flt_abs(vec3f_norm(dir) - FLT_ONE) < epsilon) {
-    fprintf(stderr,
-            "fatal error: %s:%d in function '%s': 'dir' must be a normalized "
-            "vector!\n",
-            __FILE__, __LINE__, __func__);
-    abort();
-  }
+// 'face' is the hit triangle for models
+void calculate_intercection(const scene_accel_t *accel, const prim_ref_t prim,
+                            const int face, intersection_t *intersection,
+                            const vec3f src, const vec3f dir,
+                            const flt_type shortest_dist) {
+  assert(accel);
+#ifndef WITH_OBJ
+  (void) face;
 #endif
 
-  switch (object->type) {
-  case SPHERE:
-    return ray_intersect_sphere((sphere_t *) object->data, src, dir, dist);
-    break;
+  intersection->point = vec3f_add(src, vec3f_mul(dir, shortest_dist));
 
-  case PLANE:
-    return ray_intersect_plane((plane_t *) object->data, src, dir, dist);
+  switch (prim.kind) {
+  case SPHERE_PRIM: {
+    vec3f center = get_vec3f(accel->spheres.center_x[prim.idx],
+                             accel->spheres.center_y[prim.idx],
+                             accel->spheres.center_z[prim.idx]);
+    intersection->normal =
+        vec3f_normalize(vec3f_sub(intersection->point, center));
     break;
-
-  case TRIANGLE:
-    return ray_intersect_triangle((triangle_t *) object->data, src, dir, dist);
+  }
+  case TRIANGLE_PRIM:
+    intersection->normal = face_normal(accel->triangle_normals[prim.idx], dir);
     break;
-
 #ifdef WITH_OBJ
-  case OBJ_MODEL:
-    return ray_intersect_model((model_t *) object->data, src, dir, dist);
+  case MODEL_PRIM: {
+    const model_t *model    = accel->models[prim.idx];
+    triangle_t     triangle = get_mesh_triangle(&model->mesh, face);
+    intersection->normal = face_normal(get_triangle_normal(&triangle), dir);
     break;
+  }
 #endif
-
+  case PLANE_PRIM:
+    intersection->normal = face_normal(accel->planes[prim.idx].n, dir);
+    break;
   default:
-    return 0;
+    assert(0 && "bad primitive kind in scene_intersect!");
     break;
   }
+}
 
-  return 0;
+const material_t *get_prim_material(const scene_accel_t *accel,
+                                    const prim_ref_t     prim) {
+  switch (prim.kind) {
+  case SPHERE_PRIM:
+    return &accel->materials[accel->sphere_materials[prim.idx]];
+  case TRIANGLE_PRIM:
+    return &accel->materials[accel->triangle_materials[prim.idx]];
+  case MODEL_PRIM:
+    return &accel->materials[accel->model_materials[prim.idx]];
+  case PLANE_PRIM:
+    return &accel->materials[accel->planes[prim.idx].material];
+  default:
+    return NULL;
+  }
 }
 
-void calculate_intercection(const scene_pack_t *pack, const int object_idx,
-                            intersection_t *intersection, const vec3f src,
-                            const vec3f dir, const flt_type shortest_dist) {
-  assert(pack);
-  assert(object_idx < pack->n_objects);
 
-  intersection->point = vec3f_add(src, vec3f_mul(dir, shortest_dist));
-  object_t *object    = &pack->objects[object_idx];
 
-  switch (object->type) {
-  case SPHERE: {
-    sphere_t *sphere = object->data;
-    intersection->normal =
-        vec3f_normalize(vec3f_sub(intersection->point, sphere->center));
-    break;
+typedef struct {
+  const scene_accel_t *accel;
+
+  prim_ref_t *prim;
+  int *       face;
+} accel_ray_data_t;
+
+// kinds of a leaf are tested one after another, every kernel narrows the
+// distance for the next one
+int ray_intersect_accel_leaf(const void *data, const bvh_node_t *node,
+                             const vec3f src, const vec3f dir,
+                             const flt_type max_dist, flt_type *dist) {
+  const accel_ray_data_t *ray_data = data;
+  const scene_accel_t *   accel    = ray_data->accel;
+  const accel_leaf_t *    leaf     = &accel->leaves[node - accel->bvh.nodes];
+
+  flt_type shortest_dist = max_dist;
+  int      hit           = 0;
+
+  int pos = ray_intersect_spheres(&accel->spheres, leaf->first_sphere,
+                                  leaf->n_spheres, src, dir, shortest_dist,
+                                  &shortest_dist);
+  if (pos >= 0) {
+    *ray_data->prim = (prim_ref_t){SPHERE_PRIM, pos};
+    hit             = 1;
+  }
+
+  pos = ray_intersect_triangles(&accel->triangles, leaf->first_triangle,
+                                leaf->n_triangles, src, dir, shortest_dist,
+                                &shortest_dist);
+  if (pos >= 0) {
+    *ray_data->prim = (prim_ref_t){TRIANGLE_PRIM, pos};
+    hit             = 1;
   }
-  case PLANE: {
-    plane_t *plane = object->data;
 
-    if (vec3f_scalar_mul(dir, plane->n) <= 0) {
-      intersection->normal = plane->n;
-    } else {
-      intersection->normal = vec3f_mul(plane->n, -1.0);
+  for (int i = leaf->first_model; i < leaf->first_model + leaf->n_models;
+       ++i) {
+    if (ray_intersect_accel_model(accel, i, src, dir, shortest_dist,
+                                  &shortest_dist, ray_data->face)) {
+      *ray_data->prim = (prim_ref_t){MODEL_PRIM, i};
+      hit             = 1;
     }
-    break;
   }
-  case TRIANGLE: {
-    triangle_t *triangle = object->data;
-
-    vec3f ab              = vec3f_sub(triangle->b, triangle->a);
-    vec3f bc              = vec3f_sub(triangle->c, triangle->b);
-    vec3f triangle_normal = vec3f_normalize(vec3f_vec_mul(ab, bc));
-    triangle_normal       = vec3f_normalize(triangle_normal);
-    if (vec3f_scalar_mul(dir, triangle_normal) <= 0) {
-      intersection->normal = triangle_normal;
-    } else {
-      intersection->normal = vec3f_mul(triangle_normal, -1.0);
+
+  if (hit) {
+    *dist = shortest_dist;
+  }
+
+  return hit;
+}
+
+// any hit nearer than 'max_dist' is enough for the leaf to occlude the ray
+int ray_occluded_accel_leaf(const void *data, const bvh_node_t *node,
+                            const vec3f src, const vec3f dir,
+                            const flt_type max_dist, flt_type *dist) {
+  const accel_ray_data_t *ray_data = data;
+  const scene_accel_t *   accel    = ray_data->accel;
+  const accel_leaf_t *    leaf     = &accel->leaves[node - accel->bvh.nodes];
+
+  int pos = ray_intersect_spheres(&accel->spheres, leaf->first_sphere,
+                                  leaf->n_spheres, src, dir, max_dist, dist);
+  if (pos >= 0) {
+    *ray_data->prim = (prim_ref_t){SPHERE_PRIM, pos};
+    return 1;
+  }
+
+  pos = ray_intersect_triangles(&accel->triangles, leaf->first_triangle,
+                                leaf->n_triangles, src, dir, max_dist, dist);
+  if (pos >= 0) {
+    *ray_data->prim = (prim_ref_t){TRIANGLE_PRIM, pos};
+    return 1;
+  }
+
+  for (int i = leaf->first_model; i < leaf->first_model + leaf->n_models;
+       ++i) {
+    if (ray_occluded_accel_model(accel, i, src, dir, max_dist)) {
+      *ray_data->prim = (prim_ref_t){MODEL_PRIM, i};
+      return 1;
     }
-    break;
   }
-#ifdef WITH_OBJ
-  case OBJ_MODEL: {
-    model_t *  model    = object->data;
-    triangle_t triangle = model->triangles[intersect];
-
-    vec3f ab              = vec3f_sub(triangle.b, triangle.a);
-    vec3f bc              = vec3f_sub(triangle.c, triangle.b);
-    vec3f triangle_normal = vec3f_normalize(vec3f_vec_mul(ab, bc));
-    triangle_normal       = vec3f_normalize(triangle_normal);
-    if (vec3f_scalar_mul(dir, triangle_normal) <= 0)
-      intersection->normal = triangle_normal;
-    else
-      intersection->normal = vec3f_mul(triangle_normal, -1.0);
-    break;
+
+  return 0;
+}
+
+// returns 1 if anything lies on the ray nearer than 'max_dist' and sets
+// 'occluder' to it; neither the closest hit nor its normal are needed for
+// that, so it stops at the first one
+int scene_occluded(const scene_accel_t *accel, const vec3f src,
+                   const vec3f dir, const flt_type max_dist,
+                   prim_ref_t *occluder) {
+  assert(accel);
+  assert(occluder);
+
+  for (int i = 0; i < accel->n_planes; ++i) {
+    if (ray_intersect_plane(&accel->planes[i], src, dir, max_dist, NULL)) {
+      *occluder = (prim_ref_t){PLANE_PRIM, i};
+      return 1;
+    }
   }
-#endif
-  default:
-    assert(0 && "bad object type in scene_intersect!");
-    break;
+
+  accel_ray_data_t ray_data = {accel, occluder, NULL};
+  return bvh_occluded(&accel->bvh, ray_occluded_accel_leaf, &ray_data, src,
+                      dir, max_dist);
+}
+
+// the closest primitive on the ray, its kind is NO_PRIM if there is none;
+// 'face' gets the hit triangle of a model
+prim_ref_t find_closest_prim(const scene_accel_t *accel, const vec3f src,
+                             const vec3f dir, int *face, flt_type *dist) {
+  flt_type   shortest_dist = FLT_TYPE_MAX;
+  prim_ref_t prim          = {NO_PRIM, -1};
+
+  // infinite planes can't be bounded, so they are tested separately
+  for (int i = 0; i < accel->n_planes; ++i) {
+    if (ray_intersect_plane(&accel->planes[i], src, dir, shortest_dist,
+                            &shortest_dist)) {
+      prim = (prim_ref_t){PLANE_PRIM, i};
+    }
   }
+
+  // the closest primitive and face of a model hit stay in 'prim' and 'face'
+  // after the traversal
+  accel_ray_data_t ray_data = {accel, &prim, face};
+  bvh_intersect(&accel->bvh, ray_intersect_accel_leaf, &ray_data, src, dir,
+                shortest_dist, &shortest_dist);
+
+  *dist = shortest_dist;
+  return prim;
 }
 
-int scene_intersect(const scene_pack_t *pack, int scene_idx, const vec3f src,
+// 'material' is set to the material of the closest hit
+int scene_intersect(const scene_accel_t *accel, const vec3f src,
                     const vec3f dir, intersection_t *intersection,
-                    int *material_index) {
-  assert(pack);
-  assert(scene_idx < pack->n_scenes);
+                    const material_t **material) {
+  assert(accel);
 
-  flt_type       shortest_dist = FLT_TYPE_MAX;
-  const scene_t *scene         = &pack->scenes[scene_idx];
+  int        face = -1;
+  flt_type   shortest_dist;
+  prim_ref_t prim = find_closest_prim(accel, src, dir, &face, &shortest_dist);
+  if (prim.kind == NO_PRIM) {
+    return 0;
+  }
+
+  if (intersection != NULL) {
+    calculate_intercection(accel, prim, face, intersection, src, dir,
+                           shortest_dist);
+  }
+
+  if (material != NULL) {
+    *material = get_prim_material(accel, prim);
+  }
+
+  return 1;
+}
 
-  for (int i = 0; i < scene->n_objects; ++i) {
-    flt_type tmp_dist = FLT_TYPE_MAX;
+prim_ref_t scene_hit_prim(const scene_accel_t *accel, const vec3f src,
+                          const vec3f dir) {
+  assert(accel);
 
-    int       object_idx = scene->objects[i];
-    object_t *object     = &pack->objects[object_idx];
+  int      face = -1;
+  flt_type dist;
+  return find_closest_prim(accel, src, dir, &face, &dist);
+}
+
+
+
+typedef struct {
+  const scene_accel_t *accel;
 
-    int intersect = ray_intersect(object, src, dir, &tmp_dist);
-    if (intersect && (tmp_dist < shortest_dist)) {
-      shortest_dist = tmp_dist;
+  prim_ref_t *prims;
+  int *       face;
+} accel_packet_data_t;
 
-      if (intersection != NULL) {
-        calculate_intercection(pack, object_idx, intersection, src, dir,
-                               shortest_dist);
+void ray_intersect_accel_leaf_packet(const void *data, const bvh_node_t *node,
+                                     ray_packet_t *packet) {
+  const accel_packet_data_t *packet_data = data;
+  const scene_accel_t *      accel       = packet_data->accel;
+  const accel_leaf_t *       leaf = &accel->leaves[node - accel->bvh.nodes];
+
+  int hits[RAY_PACKET_SIZE];
+
+  if (leaf->n_spheres > 0) {
+    memset(hits, -1, sizeof(hits));
+    ray_packet_intersect_spheres(&accel->spheres, leaf->first_sphere,
+                                 leaf->n_spheres, packet, hits);
+    for (int i = 0; i < packet->n; ++i) {
+      if (hits[i] >= 0) {
+        packet_data->prims[i] = (prim_ref_t){SPHERE_PRIM, hits[i]};
       }
+    }
+  }
+
+  if (leaf->n_triangles > 0) {
+    memset(hits, -1, sizeof(hits));
+    ray_packet_intersect_triangles(&accel->triangles, leaf->first_triangle,
+                                   leaf->n_triangles, packet, hits);
+    for (int i = 0; i < packet->n; ++i) {
+      if (hits[i] >= 0) {
+        packet_data->prims[i] = (prim_ref_t){TRIANGLE_PRIM, hits[i]};
+      }
+    }
+  }
 
-      if (material_index != NULL) {
-        *material_index = object->mtrl_idx;
+  // meshes have their own BVHs, which are traversed ray by ray
+  for (int i = leaf->first_model; i < leaf->first_model + leaf->n_models;
+       ++i) {
+    for (int lane = 0; lane < packet->n; ++lane) {
+      if (ray_intersect_accel_model(
+              accel, i, ray_packet_src(packet, lane),
+              ray_packet_dir(packet, lane), packet->dist[lane],
+              &packet->dist[lane], &packet_data->face[lane])) {
+        packet_data->prims[lane] = (prim_ref_t){MODEL_PRIM, i};
       }
     }
   }
+}
+
+// 'scene_intersect' for all rays of the packet; 'materials' of the rays which
+// hit nothing are set to NULL
+void scene_intersect_packet(const scene_accel_t *accel, ray_packet_t *packet,
+                            intersection_t *   intersections,
+                            const material_t **materials) {
+  assert(accel);
+  assert(packet);
+  assert(intersections);
+  assert(materials);
+
+  prim_ref_t prims[RAY_PACKET_SIZE];
+  int        face[RAY_PACKET_SIZE];
+
+  for (int lane = 0; lane < packet->n; ++lane) {
+    packet->dist[lane] = FLT_TYPE_MAX;
+    prims[lane]        = (prim_ref_t){NO_PRIM, -1};
+    face[lane]         = -1;
+  }
+  ray_packet_pad(packet);
+
+  for (int i = 0; i < accel->n_planes; ++i) {
+    for (int lane = 0; lane < packet->n; ++lane) {
+      if (ray_intersect_plane(&accel->planes[i], ray_packet_src(packet, lane),
+                              ray_packet_dir(packet, lane), packet->dist[lane],
+                              &packet->dist[lane])) {
+        prims[lane] = (prim_ref_t){PLANE_PRIM, i};
+      }
+    }
+  }
+
+  accel_packet_data_t packet_data = {accel, prims, face};
+  bvh_intersect_packet(&accel->bvh, ray_intersect_accel_leaf_packet,
+                       &packet_data, packet);
+
+  for (int lane = 0; lane < packet->n; ++lane) {
+    materials[lane] = NULL;
+    if (prims[lane].kind == NO_PRIM) {
+      continue;
+    }
 
-  return shortest_dist < FLT_TYPE_MAX;
+    calculate_intercection(accel, prims[lane], face[lane],
+                           &intersections[lane], ray_packet_src(packet, lane),
+                           ray_packet_dir(packet, lane), packet->dist[lane]);
+    materials[lane] = get_prim_material(accel, prims[lane]);
+  }
 }
 
 
@@ -268,132 +496,106 @@ vec3f reflect(const vec3f I, const vec3f normal) {
 
 
 
-SDL_Color16 cast_ray16(const scene_pack_t *pack, int scene_idx, vec3f src,
-                       vec3f dir, int depth);
-
-
-
-SDL_Color16 calculate_reflect_color(const scene_pack_t *pack, int scene_idx,
-                                    intersection_t intersection, vec3f dir,
-                                    int depth) {
-  vec3f reflect_dir = reflect(dir, intersection.normal);
-
+// the ray is moved off the surface to not hit it again
+vec3f get_secondary_src(const intersection_t *intersection, const vec3f dir) {
   const flt_type epsilon = 0.001;
-  vec3f reflect_src = vec3f_scalar_mul(reflect_dir, intersection.normal) < 0
-                          ? vec3f_sub(intersection.point,
-                                      vec3f_mul(intersection.normal, epsilon))
-                          : vec3f_add(intersection.point,
-                                      vec3f_mul(intersection.normal, epsilon));
-
-  SDL_Color16 reflect_color =
-      cast_ray16(pack, scene_idx, reflect_src, reflect_dir, depth - 1);
-
-  return reflect_color;
-}
-
-
-
-SDL_Color16 calculate_refract_color(const scene_pack_t *pack, int scene_idx,
-                                    intersection_t intersection, vec3f dir,
-                                    material_t *material, int depth) {
-  vec3f refract_dir = vec3f_normalize(
-      refract(dir, intersection.normal, material->refractive_index, 1.0));
-
-  const flt_type epsilon = 0.001;
-  vec3f refract_src = vec3f_scalar_mul(refract_dir, intersection.normal) < 0
-                          ? vec3f_sub(intersection.point,
-                                      vec3f_mul(intersection.normal, epsilon))
-                          : vec3f_add(intersection.point,
-                                      vec3f_mul(intersection.normal, epsilon));
-
-  SDL_Color16 refract_color =
-      cast_ray16(pack, scene_idx, refract_src, refract_dir, depth - 1);
-
-  return refract_color;
+  return vec3f_scalar_mul(dir, intersection->normal) < 0
+             ? vec3f_sub(intersection->point,
+                         vec3f_mul(intersection->normal, epsilon))
+             : vec3f_add(intersection->point,
+                         vec3f_mul(intersection->normal, epsilon));
 }
 
 
 
-int is_invisible_side(const scene_pack_t *pack, int scene_idx, vec3f shadow_src,
-                      vec3f light_dir, flt_type light_dist) {
-  intersection_t *shadow_intersection = malloc(sizeof(intersection_t));
+int shadow_cache_init(shadow_cache_t *cache, int n_lights) {
+  assert(cache);
+  assert(n_lights >= 0);
 
-  int intersect = scene_intersect(pack, scene_idx, shadow_src, light_dir,
-                                  shadow_intersection, NULL);
-  if (!intersect) {
-    free(shadow_intersection);
-    return 0;
+  cache->occluders = malloc(n_lights * sizeof(prim_ref_t) + 1);
+  if (cache->occluders == NULL) {
+    return -1;
   }
 
-  vec3f    shadow_vec  = vec3f_sub(shadow_src, shadow_intersection->point);
-  flt_type shadow_dist = vec3f_norm(shadow_vec);
-  free(shadow_intersection);
+  for (int i = 0; i < n_lights; ++i) {
+    cache->occluders[i] = (prim_ref_t){NO_PRIM, -1};
+  }
+  cache->n_lights   = n_lights;
+  cache->n_queries  = 0;
+  cache->n_shadowed = 0;
+  cache->n_hits     = 0;
 
-  return shadow_dist < light_dist;
+  return 0;
 }
 
+void shadow_cache_free(shadow_cache_t *cache) {
+  assert(cache);
+  free(cache->occluders);
+  cache->occluders = NULL;
+  cache->n_lights  = 0;
+}
 
+// the cached occluder of the light is tested first; the scene is traversed
+// only if it doesn't block the ray
+int is_invisible_side(const scene_accel_t *accel, shadow_cache_t *cache,
+                      int light_idx, vec3f shadow_src, vec3f light_dir,
+                      flt_type light_dist) {
+  prim_ref_t occluder;
+  if (cache == NULL) {
+    return scene_occluded(accel, shadow_src, light_dir, light_dist,
+                          &occluder);
+  }
 
-SDL_Color16 cast_ray16(const scene_pack_t *pack, int scene_idx, const vec3f src,
-                       const vec3f dir, int depth) {
-  assert(pack);
-  assert(scene_idx < pack->n_scenes);
+  assert(light_idx < cache->n_lights);
+  cache->n_queries++;
 
-  scene_t *      scene    = &pack->scenes[scene_idx];
-  int            mtrl_idx = -1;
-  intersection_t intersection;
-  const flt_type epsilon = 0.001;
+  if (ray_occluded_prim(accel, cache->occluders[light_idx], shadow_src,
+                        light_dir, light_dist)) {
+    cache->n_shadowed++;
+    cache->n_hits++;
+    return 1;
+  }
 
-  // TODO: rewrite recursion with depth control to cycle
-  if ((depth < 0) || (scene_intersect(pack, scene_idx, src, dir, &intersection,
-                                      &mtrl_idx) == 0)) {
-    return BG_CLR16;
+  if (scene_occluded(accel, shadow_src, light_dir, light_dist, &occluder)) {
+    cache->occluders[light_idx] = occluder;
+    cache->n_shadowed++;
+    return 1;
   }
 
-  material_t *material = &pack->materials[mtrl_idx];
+  return 0;
+}
 
-  SDL_Color16 reflect_color = material->clr;
-  SDL_Color16 refract_color = material->clr;
 
-  // calculate reflection
-  if (material->albedo[2] > epsilon) {
-    // TODO: rewrite recursion with depth control to cycle
-    reflect_color =
-        calculate_reflect_color(pack, scene_idx, intersection, dir, depth);
-  }
 
-  // calculate refraction
-  if (material->albedo[3] > epsilon) {
-    // TODO: rewrite recursion with depth control to cycle
-    refract_color = calculate_refract_color(pack, scene_idx, intersection, dir,
-                                            material, depth);
-  }
+// color of the hit point given the colors which come along the reflected and
+// refracted rays
+SDL_Color16 shade16(const scene_accel_t *accel, shadow_cache_t *cache,
+                    const vec3f dir, const intersection_t *intersection,
+                    const material_t *material, SDL_Color16 reflect_color,
+                    SDL_Color16 refract_color) {
+  assert(accel);
 
   // calculate differential and specular light
   flt_type diff_light_intensity = 0.0;
   flt_type spec_light_intensity = 0.0;
-  for (int i = 0; i < scene->n_lights; ++i) {
-    light_t *light = &pack->lights[i];
+  for (int i = 0; i < accel->n_lights; ++i) {
+    const light_t *light = &accel->lights[i];
 
-    vec3f    light_dir  = vec3f_sub(light->pos, intersection.point);
+    vec3f    light_dir  = vec3f_sub(light->pos, intersection->point);
     flt_type light_dist = vec3f_norm(light_dir);
     light_dir           = vec3f_normalize(light_dir);
 
-    vec3f shadow_src = vec3f_scalar_mul(light_dir, intersection.normal) < 0
-                           ? vec3f_sub(intersection.point,
-                                       vec3f_mul(intersection.normal, epsilon))
-                           : vec3f_add(intersection.point,
-                                       vec3f_mul(intersection.normal, epsilon));
-
-    if (is_invisible_side(pack, scene_idx, shadow_src, light_dir, light_dist)) {
+    vec3f shadow_src = get_secondary_src(intersection, light_dir);
+    if (is_invisible_side(accel, cache, i, shadow_src, light_dir,
+                          light_dist)) {
       continue;
     }
 
-    flt_type intensity = vec3f_scalar_mul(light_dir, intersection.normal);
+    flt_type intensity = vec3f_scalar_mul(light_dir, intersection->normal);
     diff_light_intensity += light->intensity * flt_max(0.0, intensity);
 
     flt_type reflection =
-        vec3f_scalar_mul(reflect(light_dir, intersection.normal), dir);
+        vec3f_scalar_mul(reflect(light_dir, intersection->normal), dir);
     spec_light_intensity +=
         pow(flt_max(0.0, reflection), material->spec_exp) * light->intensity;
   }
@@ -412,9 +614,288 @@ SDL_Color16 cast_ray16(const scene_pack_t *pack, int scene_idx, const vec3f src,
   return mix_colors16(colors, sizeof(colors) / sizeof(SDL_Color16));
 }
 
+
+
+// {{{ Ray evaluator
+// A ray tree is evaluated in post-order on an explicit stack: a frame waits
+// for the colors of its reflected and refracted rays, which are pushed above
+// it, and is shaded when both of them are known. A chain of frames is never
+// longer than the cast depth, so the stack has a fixed size.
+//
+// Secondary rays whose path weight falls below the scene threshold are cut
+// off: the surface keeps its own color in place of theirs. With the Russian
+// roulette such a ray is traced with probability weight / threshold instead
+// and its color is divided by that probability.
+
+enum {
+  RAY_STACK_SIZE = MAX_CAST_DEPTH + 2,
+};
+
+typedef enum {
+  RAY_TRACE,
+  RAY_REFLECT,
+  RAY_WAIT_REFLECT,
+  RAY_REFRACT,
+  RAY_WAIT_REFRACT,
+  RAY_SHADE,
+} ray_state_t;
+
+typedef struct {
+  vec3f src;
+  vec3f dir;
+  int   depth;
+
+  // product of albedos along the path from the primary ray
+  flt_type weight;
+
+  ray_state_t       state;
+  intersection_t    intersection;
+  const material_t *material;
+
+  SDL_Color16 reflect_color;
+  SDL_Color16 refract_color;
+
+  // scale of the color of the last secondary ray, traced or not
+  flt_type child_gain;
+} ray_frame_t;
+
+
+
+void init_ray_frame(ray_frame_t *frame, const vec3f src, const vec3f dir,
+                    int depth, flt_type weight) {
+  frame->src    = src;
+  frame->dir    = dir;
+  frame->depth  = depth;
+  frame->weight = weight;
+  frame->state  = RAY_TRACE;
+}
+
+// the frame goes to RAY_REFLECT with the hit already known
+void init_hit_ray_frame(ray_frame_t *frame, const vec3f src, const vec3f dir,
+                        int depth, const intersection_t *intersection,
+                        const material_t *material) {
+  init_ray_frame(frame, src, dir, depth, 1.0);
+  frame->intersection  = *intersection;
+  frame->material      = material;
+  frame->reflect_color = frame->material->clr;
+  frame->refract_color = frame->material->clr;
+  frame->state         = RAY_REFLECT;
+}
+
+// xorshift32 generator; the seed depends only on the primary ray, so a
+// picture does not depend on the order in which pixels are drawn
+uint32_t get_roulette_seed(const ray_frame_t *frame) {
+  const unsigned char *bytes = (const unsigned char *) &frame->dir;
+  uint32_t             hash  = 2166136261u; // FNV-1a
+
+  for (size_t i = 0; i < sizeof(frame->dir); ++i) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+
+  return (hash == 0) ? 1 : hash;
+}
+
+flt_type get_roulette_number(uint32_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return (flt_type) *state / ((flt_type) UINT32_MAX + 1);
+}
+
+// 0 if the secondary ray of path weight '*weight' is not traced; otherwise
+// '*weight' is set for the traced ray; '*gain' scales the color of the ray,
+// traced or not: a ray killed by the roulette adds nothing and a survivor of
+// probability s adds its color 1 / s times, so the expected color is the one
+// of the ray traced in full
+int keep_secondary_ray(const scene_t *scene, uint32_t *rng, flt_type *weight,
+                       flt_type *gain) {
+  *gain = 1;
+  if (*weight >= scene->min_ray_weight) {
+    return 1;
+  }
+
+  if (scene->ray_roulette == 0) {
+    return 0;
+  }
+
+  flt_type survival = *weight / scene->min_ray_weight;
+  if (get_roulette_number(rng) >= survival) {
+    *gain = 0;
+    return 0;
+  }
+
+  *weight = scene->min_ray_weight;
+  *gain   = 1 / survival;
+  return 1;
+}
+
+// pushes the secondary ray of 'frame' if it is worth tracing
+int push_secondary_ray(const scene_t *scene, uint32_t *rng, ray_frame_t *stack,
+                       int *top, const vec3f src, const vec3f dir,
+                       flt_type albedo) {
+  ray_frame_t *frame  = &stack[*top - 1];
+  flt_type     weight = frame->weight * albedo;
+
+  if (keep_secondary_ray(scene, rng, &weight, &frame->child_gain) == 0) {
+    return 0;
+  }
+
+  assert(*top < RAY_STACK_SIZE);
+  init_ray_frame(&stack[(*top)++], src, dir, frame->depth - 1, weight);
+  return 1;
+}
+
+SDL_Color16 get_secondary_color(const ray_frame_t *frame, SDL_Color16 color) {
+  if (frame->child_gain == 1) {
+    return color;
+  }
+
+  return color16_set_brightness(color, frame->child_gain);
+}
+
+// 'src' and 'dir' of the secondary rays
+void get_reflect_ray(const ray_frame_t *frame, vec3f *src, vec3f *dir) {
+  *dir = reflect(frame->dir, frame->intersection.normal);
+  *src = get_secondary_src(&frame->intersection, *dir);
+}
+
+void get_refract_ray(const ray_frame_t *frame, vec3f *src, vec3f *dir) {
+  *dir = vec3f_normalize(refract(frame->dir, frame->intersection.normal,
+                                 frame->material->refractive_index, 1.0));
+  *src = get_secondary_src(&frame->intersection, *dir);
+}
+
+SDL_Color16 evaluate_ray16(const scene_pack_t *pack, int scene_idx,
+                           shadow_cache_t *cache, ray_frame_t *stack) {
+  const flt_type       epsilon = 0.001;
+  const scene_t *      scene   = &pack->scenes[scene_idx];
+  const scene_accel_t *accel   = scene->accel;
+
+  int         top    = 1;
+  SDL_Color16 result = BG_CLR16;
+  uint32_t    rng    = get_roulette_seed(&stack[0]);
+
+  while (top > 0) {
+    ray_frame_t *frame = &stack[top - 1];
+    vec3f        src;
+    vec3f        dir;
+
+    switch (frame->state) {
+    case RAY_TRACE:
+      if ((frame->depth < 0) ||
+          (scene_intersect(accel, frame->src, frame->dir,
+                           &frame->intersection, &frame->material) == 0)) {
+        result = BG_CLR16;
+        top--;
+        break;
+      }
+
+      frame->reflect_color = frame->material->clr;
+      frame->refract_color = frame->material->clr;
+      frame->state         = RAY_REFLECT;
+      break;
+
+    case RAY_REFLECT:
+      frame->state = RAY_REFRACT;
+      if (frame->material->albedo[2] > epsilon) {
+        get_reflect_ray(frame, &src, &dir);
+        if (push_secondary_ray(scene, &rng, stack, &top, src, dir,
+                               frame->material->albedo[2]) != 0) {
+          frame->state = RAY_WAIT_REFLECT;
+        } else {
+          frame->reflect_color =
+              get_secondary_color(frame, frame->material->clr);
+        }
+      }
+      break;
+
+    case RAY_WAIT_REFLECT:
+      frame->reflect_color = get_secondary_color(frame, result);
+      frame->state         = RAY_REFRACT;
+      break;
+
+    case RAY_REFRACT:
+      frame->state = RAY_SHADE;
+      if (frame->material->albedo[3] > epsilon) {
+        get_refract_ray(frame, &src, &dir);
+        if (push_secondary_ray(scene, &rng, stack, &top, src, dir,
+                               frame->material->albedo[3]) != 0) {
+          frame->state = RAY_WAIT_REFRACT;
+        } else {
+          frame->refract_color =
+              get_secondary_color(frame, frame->material->clr);
+        }
+      }
+      break;
+
+    case RAY_WAIT_REFRACT:
+      frame->refract_color = get_secondary_color(frame, result);
+      frame->state         = RAY_SHADE;
+      break;
+
+    case RAY_SHADE:
+      result = shade16(accel, cache, frame->dir, &frame->intersection,
+                       frame->material, frame->reflect_color,
+                       frame->refract_color);
+      top--;
+      break;
+    }
+  }
+
+  return result;
+}
+// }}}
+
+
+
+SDL_Color16 cast_ray16(const scene_pack_t *pack, int scene_idx, const vec3f src,
+                       const vec3f dir, int depth, shadow_cache_t *cache) {
+  assert(pack);
+  assert(scene_idx < pack->n_scenes);
+  assert(depth <= MAX_CAST_DEPTH);
+
+  ray_frame_t stack[RAY_STACK_SIZE];
+  init_ray_frame(&stack[0], src, dir, depth, 1.0);
+  return evaluate_ray16(pack, scene_idx, cache, stack);
+}
+
 SDL_Color cast_ray(const scene_pack_t *pack, int scene_idx, const vec3f src,
-                   const vec3f dir, int depth) {
-  SDL_Color16 pixel16 = cast_ray16(pack, scene_idx, src, dir, depth);
+                   const vec3f dir, int depth, shadow_cache_t *cache) {
+  SDL_Color16 pixel16 = cast_ray16(pack, scene_idx, src, dir, depth, cache);
   return convert_color_16to8(pixel16);
 }
 
+// only the first hits are found for the whole packet: reflected and refracted
+// rays diverge, so they go on one by one
+void cast_ray_packet(const scene_pack_t *pack, int scene_idx,
+                     ray_packet_t *packet, int depth, shadow_cache_t *cache,
+                     SDL_Color *colors) {
+  assert(packet);
+  assert(colors);
+
+  if (depth < 0) {
+    for (int lane = 0; lane < packet->n; ++lane) {
+      colors[lane] = convert_color_16to8(BG_CLR16);
+    }
+    return;
+  }
+
+  intersection_t    intersections[RAY_PACKET_SIZE];
+  const material_t *materials[RAY_PACKET_SIZE];
+  scene_intersect_packet(pack->scenes[scene_idx].accel, packet, intersections,
+                         materials);
+
+  ray_frame_t stack[RAY_STACK_SIZE];
+  for (int lane = 0; lane < packet->n; ++lane) {
+    if (materials[lane] == NULL) {
+      colors[lane] = convert_color_16to8(BG_CLR16);
+      continue;
+    }
+
+    init_hit_ray_frame(&stack[0], ray_packet_src(packet, lane),
+                       ray_packet_dir(packet, lane), depth,
+                       &intersections[lane], materials[lane]);
+    colors[lane] =
+        convert_color_16to8(evaluate_ray16(pack, scene_idx, cache, stack));
+  }
+}
@@ -1,10 +1,39 @@
 #pragma once
 
+#include "accel.h"
 #include "geometry.h"
 #include "scene.h"
 
 
 
+// the last occluder of every light; shading points close to each other are
+// mostly shadowed by the same object, so it is tested before the whole scene
+// is; every thread needs a cache of its own
+typedef struct {
+  prim_ref_t *occluders;
+  int         n_lights;
+
+  // all shadow rays, the ones which are blocked and the ones which are
+  // answered by the cached occluder
+  long long n_queries;
+  long long n_shadowed;
+  long long n_hits;
+} shadow_cache_t;
+
+
+
+int  shadow_cache_init(shadow_cache_t *cache, int n_lights);
+void shadow_cache_free(shadow_cache_t *cache);
+
+// 'cache' may be NULL
 SDL_Color cast_ray(const scene_pack_t *pack, int scene_idx, vec3f src,
-                   vec3f dir, int depth);
+                   vec3f dir, int depth, shadow_cache_t *cache);
+
+// traces primary rays of the packet together; 'colors' get a color per ray
+void cast_ray_packet(const scene_pack_t *pack, int scene_idx,
+                     ray_packet_t *packet, int depth, shadow_cache_t *cache,
+                     SDL_Color *colors);
 
+// the primitive the ray hits first, its kind is NO_PRIM if nothing is hit;
+// all the triangles of a model make one primitive
+prim_ref_t scene_hit_prim(const scene_accel_t *accel, vec3f src, vec3f dir);
@@ -1,7 +1,13 @@
+#include "animation.h"
 #include "colors.h"
 #include "geometry.h"
+#include "image_file.h"
+#include "pack_cache.h"
 #include "ray_casting.h"
+#include "ray_tracer.h"
 #include "scene.h"
+#include "server.h"
+#include "tiles.h"
 
 #include "flt_type.h"
 
@@ -14,20 +20,52 @@
 #endif
 
 #include <SDL2/SDL.h>
-#include <SDL2/SDL_image.h>
 
 #include <assert.h>
+#include <limits.h>
+#include <omp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <bsd/string.h>
 
 
 
 #define USAGE                                                                  \
-  "Usage: ray_tracer <file with scenes> -o <template of output files>\n"       \
+  "Usage: ray_tracer <file with scenes> -o <template of output files> "        \
+  "[-r <first scene>[:<last scene>]] [-p <packet side>] "                      \
+  "[-j <number of threads>] [-s static|dynamic] [-t <seconds>] "               \
+  "[-a <samples per side>] [--serve <socket>]\n"                               \
   "    output template filename should include '#' char which will be "        \
-  "replaced with number of drawn scene\n"
+  "replaced with number of drawn scene\n"                                      \
+  "    images are saved as PNG unless the name ends with .qoi, .ppm or .pam; " \
+  "PNG and QOI are compressed by strips on all the threads, while the image "  \
+  "is drawn unless it is antialiased; with MPI every rank writes its tiles "   \
+  "of .ppm and .pam right to the file unless the root needs the whole image "  \
+  "for antialiasing, refining or the window\n"                                 \
+  "    all the scenes are drawn by default; when there are at least as many "  \
+  "of them as threads (or MPI ranks) every thread draws whole scenes and the " \
+  "window isn't updated\n"                                                     \
+  "    if the file has an animation, its frames are drawn instead of the "     \
+  "scenes: the range selects frames and '#' is replaced with number of the "   \
+  "frame\n"                                                                    \
+  "    primary rays are traced in square packets with side from 1 (no "        \
+  "packets) to 4 pixels, 4 by default\n"                                       \
+  "    the scene is rendered by tiles on the given number of threads, 1 by "   \
+  "default; with MPI every rank runs that many threads, so a rank per node "   \
+  "or socket with a thread per core makes the hybrid layout\n"                 \
+  "    with MPI ranks either render equal ranges of tiles (static) or "        \
+  "request batches of a tile per thread from the root (dynamic, by default)\n" \
+  "    with a time limit every image is refined from a coarse preview until "  \
+  "the time is over and saved as it is then, the recursion depth is lowered "  \
+  "if the full one doesn't fit; with MPI the root renders it alone\n"          \
+  "    with antialiasing pixels on edges of objects and of contrast get n x "  \
+  "n samples, n from 2 to 8; it is off for progressive images and is done by " \
+  "the root alone with MPI\n"                                                  \
+  "    with --serve nothing is drawn at start: jobs '<file with scenes> "      \
+  "<scene or frame> <output file> [view <x> <y> <z> <dx> <dy> <dz>] "          \
+  "[size <width>x<height>] [crop <x> <y> <width>x<height>]' are read from "    \
+  "the unix socket one per line and every one is answered with a line; "       \
+  "loaded files stay in memory for the next jobs, 'quit' stops the server\n"
 
 
 
@@ -35,6 +73,13 @@ typedef enum {
   HELP,
   WINDOW,
   OUTPUT_TEMPLATE,
+  SCENE_RANGE,
+  PACKET_SIDE,
+  N_THREADS,
+  SCHEDULE,
+  TIME_LIMIT,
+  ANTIALIASING,
+  SERVE,
   SCENES_FILE,
   UNKNOWN,
 } arg_type_t;
@@ -49,32 +94,26 @@ enum {
 };
 
 enum {
-  SURFACE_DEPTH = 32,
-  WINDOW_TIME   = 5000,
+  DEFAULT_PACKET_SIDE = 4,
+  MAX_PACKET_SIDE     = 4,
 };
 
-#ifdef DRAW_PARALLEL
 enum {
-  SIZE_TAG,
-  BUF_TAG,
+  WINDOW_TIME = 5000,
 };
 
 enum {
-  ROOT_RANK = 0,
+  // pixels on an object edge or differing in some color channel by more than
+  // AA_CONTRAST from a neighbour are supersampled
+  AA_CONTRAST = 16,
+  MAX_AA_SIDE = 8,
 };
-#endif
-
-
-
-typedef struct {
-  int create_window;
-
-  const char *scenes_file;
-  const char *output_template;
 
-  SDL_Window *  window;
-  SDL_Renderer *renderer;
-} context_t;
+enum {
+  // the first pass of the progressive mode traces every PROGRESSIVE_STEP-th
+  // pixel of every PROGRESSIVE_STEP-th row, every next pass halves the step
+  PROGRESSIVE_STEP = 16,
+};
 
 
 
@@ -118,181 +157,330 @@ void set_pixel32(uint32_t *buf, int i, SDL_PixelFormat *format, SDL_Color clr) {
 
 
 
-SDL_Color calculate_pixel(const scene_pack_t *pack, int scene_idx, int i,
-                          int j) {
-  assert(pack);
-  assert(pack->n_scenes > scene_idx);
-
-  const scene_t *scene = &pack->scenes[scene_idx];
-
-  flt_type x = i - scene->width / (flt_type) 2;
-  flt_type y = -j + scene->height / (flt_type) 2;
-  flt_type z = -scene->height / ((flt_type) 2 * tan(scene->fov / (flt_type) 2));
+// (i, j) are image coordinates in pixels; a pixel is sampled at its top left
+// corner
+vec3f get_primary_dir(const scene_t *scene, flt_type i, flt_type j) {
+  flt_type x = i + scene->crop_x - scene->frame_width / (flt_type) 2;
+  flt_type y = -(j + scene->crop_y) + scene->frame_height / (flt_type) 2;
+  flt_type z =
+      -scene->frame_height / ((flt_type) 2 * tan(scene->fov / (flt_type) 2));
 
   vec3f dir = {x, y, z};
   dir       = vec3f_normalize(dir);
   dir       = vec3f_add(dir, scene->view_dir);
   dir       = vec3f_normalize(dir);
 
-  return cast_ray(pack, scene_idx, scene->view_point, dir, scene->cast_depth);
+  return dir;
 }
 
+SDL_Color calculate_pixel(const scene_pack_t *pack, int scene_idx,
+                          shadow_cache_t *cache, int i, int j) {
+  assert(pack);
+  assert(pack->n_scenes > scene_idx);
+
+  const scene_t *scene = &pack->scenes[scene_idx];
+  vec3f          dir   = get_primary_dir(scene, i, j);
 
+  return cast_ray(pack, scene_idx, scene->view_point, dir, scene->cast_depth,
+                  cache);
+}
 
-#ifndef DRAW_PARALLEL
-SDL_Surface *draw_scene_on_surface(const scene_pack_t *pack, int scene_idx) {
+// pixels (xs[k], ys[k]) are traced as one ray packet
+void calculate_pixel_packet(const scene_pack_t *pack, int scene_idx,
+                            shadow_cache_t *cache, const int *xs,
+                            const int *ys, int n, SDL_Color *pixels) {
   assert(pack);
   assert(pack->n_scenes > scene_idx);
+  assert((n > 0) && (n <= RAY_PACKET_SIZE));
 
-  const scene_t *scene   = &pack->scenes[scene_idx];
-  SDL_Surface *  surface = SDL_CreateRGBSurface(0, scene->width, scene->height,
-                                              SURFACE_DEPTH, 0, 0, 0, 0);
-  SDL_NOT_NULL(surface);
+  if (n == 1) {
+    pixels[0] = calculate_pixel(pack, scene_idx, cache, xs[0], ys[0]);
+    return;
+  }
 
-  for (int i = 0; i < surface->w; ++i) {
-    for (int j = 0; j < surface->h; ++j) {
-      SDL_Color pixel = calculate_pixel(pack, scene_idx, i, j);
-      set_pixel32_on_surface(surface, i, j, pixel);
-    }
+  const scene_t *scene = &pack->scenes[scene_idx];
+  ray_packet_t   packet;
+  packet.n = n;
+  for (int k = 0; k < n; ++k) {
+    ray_packet_set(&packet, k, scene->view_point,
+                   get_primary_dir(scene, xs[k], ys[k]), FLT_TYPE_MAX);
   }
 
-  return surface;
+  cast_ray_packet(pack, scene_idx, &packet, scene->cast_depth, cache, pixels);
 }
 
-#else
 
-void draw_part_of_scene(const scene_pack_t *pack, int scene_idx,
-                        SDL_PixelFormat *format, uint32_t **pix_buf,
-                        int *pix_buf_size) {
-  assert(pack);
-  assert(format);
-  assert(pix_buf);
-  assert(pix_buf_size);
 
-  const scene_t *scene = &pack->scenes[scene_idx];
+void draw_tile(const scene_pack_t *pack, int scene_idx, int packet_side,
+               shadow_cache_t *cache, SDL_PixelFormat *format,
+               const tile_t tile, uint32_t *pixels, int stride) {
+  assert(pixels);
+  assert(packet_side * packet_side <= RAY_PACKET_SIZE);
+
+  int x_end = tile.x + tile.w;
+  int y_end = tile.y + tile.h;
+
+  for (int j = tile.y; j < y_end; j += packet_side) {
+    for (int i = tile.x; i < x_end; i += packet_side) {
+      int xs[RAY_PACKET_SIZE];
+      int ys[RAY_PACKET_SIZE];
+      int n = 0;
+
+      // packets on the right and bottom edges are clipped
+      for (int y = j; (y < j + packet_side) && (y < y_end); ++y) {
+        for (int x = i; (x < i + packet_side) && (x < x_end); ++x) {
+          xs[n]   = x;
+          ys[n++] = y;
+        }
+      }
 
-  int size = -1;
-  int rank = -1;
-  TRY_MPI(MPI_Comm_size(MPI_COMM_WORLD, &size));
-  assert(size < 0);
-  TRY_MPI(MPI_Comm_rank(MPI_COMM_WORLD, &rank));
-  assert(rank < 0);
+      SDL_Color colors[RAY_PACKET_SIZE];
+      calculate_pixel_packet(pack, scene_idx, cache, xs, ys, n, colors);
+      for (int k = 0; k < n; ++k) {
+        set_pixel32(pixels, (ys[k] - tile.y) * stride + xs[k] - tile.x, format,
+                    colors[k]);
+      }
+    }
+  }
+}
 
-  int n_pixels = scene->width * scene->height / size + 1;
-  int shift    = n_pixels * rank;
 
-  if (rank == (size - 1)) {
-    n_pixels -= n_pixels * size - scene->width * scene->height;
-  }
 
-  if (*pix_buf == NULL) {
-    assert((rank != ROOT_RANK) && "pix_buf must be allocated in the root rank");
-    *pix_buf = malloc(n_pixels * sizeof(uint32_t));
+void init_shadow_cache(shadow_cache_t *cache, const scene_t *scene) {
+  if (shadow_cache_init(cache, scene->n_lights) != 0) {
+    fprintf(stderr, "Can't allocate shadow cache\n");
+    exit(EXIT_FAILURE);
   }
-  assert(*pix_buf);
-  *pix_buf_size = n_pixels;
+}
 
-  for (int i = 0; i < n_pixels; ++i) {
-    SDL_Color pixel =
-        calculate_pixel(pack, scene_idx, (shift + i) % scene->width,
-                        (shift + i) / scene->width);
-    (*pix_buf)[i] = SDL_MapRGBA(format, pixel.r, pixel.g, pixel.b, pixel.a);
-  }
+void print_shadow_cache_stats(const long long *stats) {
+  printf("shadow rays: %lld, blocked %lld, cached occluder hits %lld (%.1f%% "
+         "of blocked)\n",
+         stats[0], stats[1], stats[2],
+         (stats[1] > 0) ? 100.0 * stats[2] / stats[1] : 0.0);
 }
 
 
 
-void draw_and_send_part_of_scene(const scene_pack_t *pack, int scene_idx) {
+// every thread renders whole tiles, so it writes to its own rows of the
+// surface only; the encoder, if any, gets every tile once it is drawn
+SDL_Surface *draw_scene_on_surface(const scene_pack_t *pack, int scene_idx,
+                                   int packet_side, int n_threads,
+                                   image_encoder_t *encoder) {
   assert(pack);
   assert(pack->n_scenes > scene_idx);
+  assert(n_threads > 0);
 
-  uint32_t *pix_buf      = NULL;
-  int       pix_buf_size = 0;
+  const scene_t *scene   = &pack->scenes[scene_idx];
+  SDL_Surface *  surface = SDL_CreateRGBSurface(0, scene->width, scene->height,
+                                              SURFACE_DEPTH, 0, 0, 0, 0);
+  SDL_NOT_NULL(surface);
 
-  // TODO: move format to 'draw_part_of_scene'
-  SDL_PixelFormat *format = malloc(sizeof(SDL_PixelFormat));
-  assert(format);
-  TRY_MPI(MPI_Bcast(format, sizeof(SDL_PixelFormat), MPI_BYTE, ROOT_RANK,
-                    MPI_COMM_WORLD));
+  int              n_tiles = get_n_tiles(surface->w, surface->h);
+  tile_scheduler_t scheduler;
+  if (tile_scheduler_init(&scheduler, n_tiles, n_threads) != 0) {
+    fprintf(stderr, "Can't allocate tile scheduler\n");
+    exit(EXIT_FAILURE);
+  }
 
-  draw_part_of_scene(pack, scene_idx, format, &pix_buf, &pix_buf_size);
-  free(format);
-  assert(pix_buf && (pix_buf_size > 0));
+  long long stats[3] = {0, 0, 0};
+
+#pragma omp parallel num_threads(n_threads) default(none)                     \
+    shared(pack, scene_idx, scene, packet_side, surface, scheduler, stats,    \
+           encoder)
+  {
+    shadow_cache_t cache;
+    init_shadow_cache(&cache, scene);
+
+    int worker = omp_get_thread_num();
+    int tile_idx;
+    while ((tile_idx = tile_scheduler_next(&scheduler, worker)) >= 0) {
+      tile_t    tile   = get_tile(surface->w, surface->h, tile_idx);
+      uint32_t *pixels = (uint32_t *) surface->pixels +
+                         tile.y * surface->pitch / sizeof(uint32_t) + tile.x;
+      draw_tile(pack, scene_idx, packet_side, &cache, surface->format, tile,
+                pixels, surface->pitch / sizeof(uint32_t));
+      if (encoder != NULL) {
+        image_encoder_add_tile(encoder, surface, tile);
+      }
+    }
 
-  TRY_MPI(
-      MPI_Send(&pix_buf_size, 1, MPI_INT, ROOT_RANK, SIZE_TAG, MPI_COMM_WORLD));
-  TRY_MPI(MPI_Send(pix_buf, pix_buf_size, MPI_UINT32_T, ROOT_RANK, BUF_TAG,
-                   MPI_COMM_WORLD));
-  free(pix_buf);
+#pragma omp atomic
+    stats[0] += cache.n_queries;
+#pragma omp atomic
+    stats[1] += cache.n_shadowed;
+#pragma omp atomic
+    stats[2] += cache.n_hits;
+
+    shadow_cache_free(&cache);
+  }
+
+  tile_scheduler_free(&scheduler);
+  print_shadow_cache_stats(stats);
+  return surface;
 }
 
 
+// a pixel is on an edge if one of its neighbours shows another primitive or
+// differs much in color; 'prims' are the primitives hit by the primary rays
+int is_edge_pixel(const SDL_Surface *surface, const prim_ref_t *prims, int x,
+                  int y) {
+  const int dx[] = {-1, 1, 0, 0};
+  const int dy[] = {0, 0, -1, 1};
 
-void gather_drawn_pixels(uint32_t *pixels, int drawn_pixels, int free_space,
-                         int size) {
-  assert(pixels);
-  assert(drawn_pixels >= 0);
-  assert(free_space >= 0);
-  assert(size > 0);
+  int       stride = surface->pitch / sizeof(uint32_t);
+  uint32_t *pixels = surface->pixels;
+  int       idx    = y * surface->w + x;
 
-  for (int i = 1; i < size; i++) {
-    pixels += drawn_pixels;
-    TRY_MPI(MPI_Recv(&drawn_pixels, 1, MPI_INT, i, SIZE_TAG, MPI_COMM_WORLD,
-                     MPI_STATUS_IGNORE));
-    assert(drawn_pixels > 0);
-    if (drawn_pixels > free_space) {
-      fprintf(stderr, "drawn more pixels than there is free space, panic");
-      abort();
+  SDL_Color clr;
+  SDL_GetRGBA(pixels[y * stride + x], surface->format, &clr.r, &clr.g, &clr.b,
+              &clr.a);
+
+  for (int k = 0; k < 4; ++k) {
+    int nx = x + dx[k];
+    int ny = y + dy[k];
+    if ((nx < 0) || (nx >= surface->w) || (ny < 0) || (ny >= surface->h)) {
+      continue;
+    }
+
+    int nidx = ny * surface->w + nx;
+    if ((prims[nidx].kind != prims[idx].kind) ||
+        (prims[nidx].idx != prims[idx].idx)) {
+      return 1;
+    }
+
+    SDL_Color nclr;
+    SDL_GetRGBA(pixels[ny * stride + nx], surface->format, &nclr.r, &nclr.g,
+                &nclr.b, &nclr.a);
+    if ((abs(nclr.r - clr.r) > AA_CONTRAST) ||
+        (abs(nclr.g - clr.g) > AA_CONTRAST) ||
+        (abs(nclr.b - clr.b) > AA_CONTRAST)) {
+      return 1;
     }
-    TRY_MPI(MPI_Recv(pixels, drawn_pixels, MPI_UINT32_T, i, BUF_TAG,
-                     MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-    free_space -= drawn_pixels;
   }
+
+  return 0;
 }
 
+// a step of splitmix64, the state is the seed of the first step
+uint64_t next_random(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+  z          = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z          = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
 
+// uniform in [0, 1), 24 bits are exact with any flt_type
+flt_type next_random_unit(uint64_t *state) {
+  return (flt_type)(next_random(state) >> 40) / (flt_type)(1 << 24);
+}
 
-SDL_Surface *draw_scene_on_surface_parallel(const scene_pack_t *pack,
-                                            int                 scene_idx) {
-  TRY_MPI(MPI_Init(NULL, NULL));
+// the pixel gets the mean of aa_side x aa_side samples, one at a random point
+// of every equal cell it is split into; the sample at the pixel corner is its
+// color and stands for the top left cell; the points depend on the pixel only,
+// so the image doesn't change with the threads and the ranks
+SDL_Color supersample_pixel(const scene_pack_t *pack, int scene_idx,
+                            shadow_cache_t *cache, SDL_Color clr, int x, int y,
+                            int aa_side) {
+  const scene_t *scene = &pack->scenes[scene_idx];
+  uint64_t       state = ((uint64_t) y << 32) | (uint32_t) x;
+
+  int sum[4] = {clr.r, clr.g, clr.b, clr.a};
+  for (int j = 0; j < aa_side; ++j) {
+    for (int i = (j == 0) ? 1 : 0; i < aa_side; ++i) {
+      flt_type  dx     = (i + next_random_unit(&state)) / aa_side;
+      flt_type  dy     = (j + next_random_unit(&state)) / aa_side;
+      vec3f     dir    = get_primary_dir(scene, x + dx, y + dy);
+      SDL_Color sample = cast_ray(pack, scene_idx, scene->view_point, dir,
+                                  scene->cast_depth, cache);
+      sum[0] += sample.r;
+      sum[1] += sample.g;
+      sum[2] += sample.b;
+      sum[3] += sample.a;
+    }
+  }
 
-  int size = -1;
-  int rank = -1;
-  TRY_MPI(MPI_Comm_size(MPI_COMM_WORLD, &size));
-  assert((size < 0) && (size >= ROOT_RANK));
-  TRY_MPI(MPI_Comm_rank(MPI_COMM_WORLD, &rank));
-  assert(rank < 0);
+  int       n   = aa_side * aa_side;
+  SDL_Color avg = {(sum[0] + n / 2) / n, (sum[1] + n / 2) / n,
+                   (sum[2] + n / 2) / n, (sum[3] + n / 2) / n};
+  return avg;
+}
 
+// edges are found on the image as it is before any pixel gets supersampled
+void antialias(const context_t *ctx, const scene_pack_t *pack, int scene_idx,
+               SDL_Surface *surface, int n_threads) {
+  if ((ctx->aa_side < 2) || (ctx->time_limit > 0)) {
+    return;
+  }
 
-  if (rank != ROOT_RANK) {
-    draw_and_send_part_of_scene(pack, scene_idx);
-    TRY_MPI(MPI_Finalize());
-    exit(EXIT_SUCCESS);
+  const scene_t *scene    = &pack->scenes[scene_idx];
+  int            n_pixels = surface->w * surface->h;
+  int            stride   = surface->pitch / sizeof(uint32_t);
+  uint32_t *     pixels   = surface->pixels;
+
+  prim_ref_t *prims   = malloc(n_pixels * sizeof(prim_ref_t) + 1);
+  uint8_t *   is_edge = malloc(n_pixels + 1);
+  if ((prims == NULL) || (is_edge == NULL)) {
+    fprintf(stderr, "Can't allocate antialiasing buffers\n");
+    exit(EXIT_FAILURE);
   }
 
-  const scene_t *scene   = &pack->scenes[scene_idx];
-  SDL_Surface *  surface = SDL_CreateRGBSurface(0, scene->width, scene->height,
-                                              SURFACE_DEPTH, 0, 0, 0, 0);
-  SDL_NOT_NULL(surface);
+  long long n_edges = 0;
+
+#pragma omp parallel num_threads(n_threads) default(none)                     \
+    shared(pack, scene_idx, scene, surface, ctx, prims, is_edge, pixels,     \
+           stride) reduction(+ : n_edges)
+  {
+#pragma omp for schedule(dynamic)
+    for (int y = 0; y < surface->h; ++y) {
+      for (int x = 0; x < surface->w; ++x) {
+        prims[y * surface->w + x] =
+            scene_hit_prim(scene->accel, scene->view_point,
+                           get_primary_dir(scene, x, y));
+      }
+    }
 
-  TRY_MPI(MPI_Bcast(surface->format, sizeof(SDL_PixelFormat), MPI_BYTE, 0,
-                    MPI_COMM_WORLD));
+#pragma omp for schedule(dynamic)
+    for (int y = 0; y < surface->h; ++y) {
+      for (int x = 0; x < surface->w; ++x) {
+        is_edge[y * surface->w + x] = is_edge_pixel(surface, prims, x, y);
+        n_edges += is_edge[y * surface->w + x];
+      }
+    }
 
-  uint32_t *pixels       = (uint32_t *) surface->pixels;
-  int       free_space   = surface->w * surface->h;
-  int       drawn_pixels = -1;
-  draw_part_of_scene(pack, scene_idx, surface->format, &pixels, &drawn_pixels);
-  assert(drawn_pixels >= 0);
-  free_space -= drawn_pixels;
-  assert(free_space >= 0);
+    shadow_cache_t cache;
+    init_shadow_cache(&cache, scene);
+
+#pragma omp for schedule(dynamic)
+    for (int y = 0; y < surface->h; ++y) {
+      for (int x = 0; x < surface->w; ++x) {
+        if (!is_edge[y * surface->w + x]) {
+          continue;
+        }
+
+        uint32_t *pixel = &pixels[y * stride + x];
+        SDL_Color clr;
+        SDL_GetRGBA(*pixel, surface->format, &clr.r, &clr.g, &clr.b, &clr.a);
+        clr    = supersample_pixel(pack, scene_idx, &cache, clr, x, y,
+                                ctx->aa_side);
+        *pixel = SDL_MapRGBA(surface->format, clr.r, clr.g, clr.b, clr.a);
+      }
+    }
 
-  gather_drawn_pixels(pixels, drawn_pixels, free_space, size);
+    shadow_cache_free(&cache);
+  }
 
-  TRY_MPI(MPI_Finalize());
+  free(prims);
+  free(is_edge);
 
-  return surface;
+  long long n_samples = ctx->aa_side * ctx->aa_side;
+  printf("antialiasing: %lld of %d pixels (%.1f%%) on edges, %lld extra rays "
+         "and %d hit tests instead of %lld rays of uniform %dx%d "
+         "supersampling\n",
+         n_edges, n_pixels, 100.0 * n_edges / n_pixels,
+         n_edges * (n_samples - 1), n_pixels, n_pixels * (n_samples - 1),
+         ctx->aa_side, ctx->aa_side);
 }
-#endif
 
 
 
@@ -307,16 +495,166 @@ void copy_surface_to_renderer(SDL_Surface *surface, SDL_Renderer *renderer) {
 
 
 
-SDL_Surface *draw(const context_t *ctx, const scene_pack_t *pack,
-                  int scene_idx) {
-  SDL_Surface *surface =
+// the pass traces the pixels in every 'step'-th column of every 'step'-th row
+// but the ones of the coarser passes (unless it is the first one); with
+// 'fill' a traced pixel paints its whole step x step block, so the image has
+// no holes before the finest pass; the pixels left after the deadline aren't
+// traced; returns number of traced pixels
+long long draw_progressive_pass(const scene_pack_t *pack, int scene_idx,
+                                SDL_Surface *surface, int step, int is_first,
+                                int fill, int depth, double deadline,
+                                int n_threads) {
+  const scene_t *scene    = &pack->scenes[scene_idx];
+  uint32_t *     pixels   = surface->pixels;
+  int            stride   = surface->pitch / sizeof(uint32_t);
+  long long      n_traced = 0;
+
+#pragma omp parallel num_threads(n_threads) default(none)                     \
+    shared(pack, scene_idx, scene, surface, pixels, stride, step, is_first,   \
+           fill, depth, deadline) reduction(+ : n_traced)
+  {
+    shadow_cache_t cache;
+    init_shadow_cache(&cache, scene);
+
+#pragma omp for schedule(dynamic)
+    for (int y = 0; y < surface->h; y += step) {
+      for (int x = 0; x < surface->w; x += step) {
+        int is_traced =
+            !is_first && (x % (2 * step) == 0) && (y % (2 * step) == 0);
+        if (is_traced || (omp_get_wtime() >= deadline)) {
+          continue;
+        }
+
+        SDL_Color clr   = cast_ray(pack, scene_idx, scene->view_point,
+                                 get_primary_dir(scene, x, y), depth, &cache);
+        uint32_t  value = SDL_MapRGBA(surface->format, clr.r, clr.g, clr.b,
+                                      clr.a);
+
+        int block_w = fill ? surface->w - x : 1;
+        int block_h = fill ? surface->h - y : 1;
+        block_w     = (block_w < step) ? block_w : step;
+        block_h     = (block_h < step) ? block_h : step;
+        for (int j = y; j < y + block_h; ++j) {
+          for (int i = x; i < x + block_w; ++i) {
+            pixels[j * stride + i] = value;
+          }
+        }
+
+        n_traced++;
+      }
+    }
+
+    shadow_cache_free(&cache);
+  }
+
+  return n_traced;
+}
+
+// passes go from the coarse preview down to single pixels; every pass gets
+// the largest depth at which the rest of the passes would fit into the time
+// left judging by the cost of the previous ones; if the depth has been
+// lowered, the time left after the finest pass goes to tracing the image
+// again with the full depth in the same coarse to fine order; returns NULL on
+// the MPI ranks other than the root, which renders the image alone
+SDL_Surface *draw_scene_progressively(const context_t *   ctx,
+                                      const scene_pack_t *pack,
+                                      int                 scene_idx) {
+  assert(ctx->time_limit > 0);
+
 #ifdef DRAW_PARALLEL
-      draw_scene_on_surface_parallel(pack, scene_idx);
-#else
-      draw_scene_on_surface(pack, scene_idx);
+  int rank = -1;
+  TRY_MPI(MPI_Comm_rank(MPI_COMM_WORLD, &rank));
+  if (rank != ROOT_RANK) {
+    return NULL;
+  }
 #endif
+
+  const scene_t *scene    = &pack->scenes[scene_idx];
+  double         start    = omp_get_wtime();
+  double         deadline = start + ctx->time_limit;
+
+  SDL_Surface *surface = SDL_CreateRGBSurface(0, scene->width, scene->height,
+                                              SURFACE_DEPTH, 0, 0, 0, 0);
   SDL_NOT_NULL(surface);
 
+  long long n_pixels  = (long long) surface->w * surface->h;
+  long long n_traced  = 0;
+  int       min_depth = scene->cast_depth;
+  int       n_passes  = 0;
+  // seconds per pixel and per level of the depth
+  double cost = 0;
+
+  for (int step = PROGRESSIVE_STEP;
+       (step >= 1) && (omp_get_wtime() < deadline); step /= 2) {
+    int depth = scene->cast_depth;
+    if (cost > 0) {
+      double time_left = deadline - omp_get_wtime();
+      double max_depth = time_left / (cost * (n_pixels - n_traced)) - 1;
+      depth            = (max_depth < depth) ? (int) max_depth : depth;
+      depth            = (depth < 0) ? 0 : depth;
+    }
+
+    double    pass_start = omp_get_wtime();
+    long long n          = draw_progressive_pass(
+        pack, scene_idx, surface, step, step == PROGRESSIVE_STEP, 1, depth,
+        deadline, ctx->n_threads);
+    if (n > 0) {
+      cost = (omp_get_wtime() - pass_start) / ((double) n * (depth + 1));
+    }
+
+    n_traced += n;
+    min_depth = (depth < min_depth) ? depth : min_depth;
+    n_passes++;
+    if (ctx->create_window) {
+      copy_surface_to_renderer(surface, ctx->renderer);
+    }
+  }
+
+  for (int step = PROGRESSIVE_STEP;
+       (step >= 1) && (min_depth < scene->cast_depth) &&
+       (omp_get_wtime() < deadline);
+       step /= 2) {
+    draw_progressive_pass(pack, scene_idx, surface, step,
+                          step == PROGRESSIVE_STEP, 0, scene->cast_depth,
+                          deadline, ctx->n_threads);
+    n_passes++;
+    if (ctx->create_window) {
+      copy_surface_to_renderer(surface, ctx->renderer);
+    }
+  }
+
+  printf("scene #%d: %d progressive passes in %.3f s, %.1f%% of pixels "
+         "traced, the least depth %d of %d\n",
+         scene_idx, n_passes, omp_get_wtime() - start,
+         100.0 * n_traced / n_pixels, min_depth, scene->cast_depth);
+
+  return surface;
+}
+
+
+SDL_Surface *draw(const context_t *ctx, const scene_pack_t *pack, int scene_idx,
+                  image_encoder_t *encoder) {
+  SDL_Surface *surface = NULL;
+  if (ctx->time_limit > 0) {
+    surface = draw_scene_progressively(ctx, pack, scene_idx);
+  } else {
+#ifdef DRAW_PARALLEL
+    // the root gets the frame as a whole and encodes it when it is saved
+    (void) encoder;
+    surface = draw_scene_on_surface_parallel(ctx, pack, scene_idx);
+#else
+    surface = draw_scene_on_surface(pack, scene_idx, ctx->packet_side,
+                                    ctx->n_threads,
+                                    (ctx->aa_side < 2) ? encoder : NULL);
+#endif
+  }
+
+  if (surface == NULL) {
+    return NULL;
+  }
+
+  antialias(ctx, pack, scene_idx, surface, ctx->n_threads);
+
   if (ctx->create_window) {
     copy_surface_to_renderer(surface, ctx->renderer);
   }
@@ -327,43 +665,274 @@ SDL_Surface *draw(const context_t *ctx, const scene_pack_t *pack,
 
 
 char *get_output_filename_from_template(const char *template, int n) {
-  assert((n >= 0) && (n < 9));
-  int len = strlen(template) + 1;
-  char *output_filename = malloc(len * sizeof(char));
-  int cpylen = strlcpy(output_filename, template, len);
-  if (cpylen != (len - 1)) {
-    free(output_filename);
-    return NULL;
-  }
+  assert(n >= 0);
+
+  const char *num_pos = strchr(template, '#');
+  assert(num_pos);
+
+  int prefix_len = num_pos - template;
+  int len = snprintf(NULL, 0, "%.*s%d%s", prefix_len, template, n, num_pos + 1);
 
-  char *num_pos = strchr(output_filename, '#');
-  *num_pos      = '0' + n;
+  char *output_filename = malloc(len + 1);
+  if (output_filename != NULL) {
+    snprintf(output_filename, len + 1, "%.*s%d%s", prefix_len, template, n,
+             num_pos + 1);
+  }
 
   return output_filename;
 }
 
+// the strips the encoder hasn't got while the scene was drawn are encoded on
+// 'n_threads' threads, the encoder may be NULL
+void save_scene(const context_t *ctx, SDL_Surface *surface,
+                image_encoder_t *encoder, int scene_idx, int n_threads) {
+  char *output_filename =
+      get_output_filename_from_template(ctx->output_template, scene_idx);
+  assert(output_filename != NULL);
+
+  if (encoder != NULL) {
+    SDL_TRY(image_encoder_save(encoder, surface, output_filename, n_threads));
+  } else {
+    SDL_TRY(save_image(surface, output_filename, n_threads));
+  }
+  free(output_filename);
+}
+
+#ifdef DRAW_PARALLEL
+int writes_tiles_directly(const context_t *ctx, const char *filename) {
+  return is_raw_image(get_image_format(filename)) &&
+         (ctx->time_limit == 0) && (ctx->aa_side < 2) && !ctx->create_window;
+}
+
+void draw_scene_to_file(const context_t *ctx, const scene_pack_t *pack,
+                        int scene_idx, int n) {
+  char *output_filename =
+      get_output_filename_from_template(ctx->output_template, n);
+  assert(output_filename != NULL);
+
+  draw_scene_to_file_parallel(ctx, pack, scene_idx, output_filename);
+  free(output_filename);
+}
+#endif
+
+
+
+// every scene is drawn by all the threads or ranks
+void draw_scenes_one_by_one(const context_t *ctx, const scene_pack_t *pack,
+                            int first_scene, int last_scene) {
+  for (int i = first_scene; i <= last_scene; ++i) {
+#ifdef DRAW_PARALLEL
+    if (writes_tiles_directly(ctx, ctx->output_template)) {
+      draw_scene_to_file(ctx, pack, i, i);
+      continue;
+    }
+#endif
 
+    const scene_t * scene = &pack->scenes[i];
+    image_encoder_t encoder;
+    image_encoder_init(&encoder, ctx->output_template, scene->width,
+                       scene->height);
+
+    SDL_Surface *surface = draw(ctx, pack, i, &encoder);
+    if (surface != NULL) {
+      save_scene(ctx, surface, &encoder, i, ctx->n_threads);
+      SDL_FreeSurface(surface);
+    }
+    image_encoder_free(&encoder);
+  }
+}
+
+// every thread or rank draws and saves whole scenes, the scenes share their
+// compiled geometry; the window isn't updated as its renderer belongs to the
+// main thread
+void draw_scenes_apart(const context_t *ctx, const scene_pack_t *pack,
+                       int first_scene, int last_scene) {
+#ifdef DRAW_PARALLEL
+  int size = -1;
+  int rank = -1;
+  TRY_MPI(MPI_Comm_size(MPI_COMM_WORLD, &size));
+  TRY_MPI(MPI_Comm_rank(MPI_COMM_WORLD, &rank));
+
+  // every rank draws its scenes with its thread pool
+  for (int i = first_scene + rank; i <= last_scene; i += size) {
+    SDL_Surface *surface = draw_scene_on_surface(pack, i, ctx->packet_side,
+                                                 ctx->n_threads, NULL);
+    antialias(ctx, pack, i, surface, ctx->n_threads);
+    save_scene(ctx, surface, NULL, i, ctx->n_threads);
+    SDL_FreeSurface(surface);
+  }
+#else
+  #pragma omp parallel for num_threads(ctx->n_threads) schedule(dynamic)      \
+      default(none) shared(ctx, pack, first_scene, last_scene)
+  for (int i = first_scene; i <= last_scene; ++i) {
+    SDL_Surface *surface =
+        draw_scene_on_surface(pack, i, ctx->packet_side, 1, NULL);
+    antialias(ctx, pack, i, surface, 1);
+    save_scene(ctx, surface, NULL, i, 1);
+    SDL_FreeSurface(surface);
+  }
+#endif
+}
+
+void draw_scenes(const context_t *ctx, const scene_pack_t *pack,
+                 int first_scene, int last_scene) {
+  int n_workers = ctx->n_threads;
+#ifdef DRAW_PARALLEL
+  TRY_MPI(MPI_Comm_size(MPI_COMM_WORLD, &n_workers));
+#endif
+
+  // with fewer scenes than workers some of them would stay idle; progressive
+  // images are refined by all the threads to get the most out of the time
+  if ((ctx->time_limit == 0) && (n_workers > 1) &&
+      (last_scene - first_scene + 1 >= n_workers)) {
+    draw_scenes_apart(ctx, pack, first_scene, last_scene);
+  } else {
+    draw_scenes_one_by_one(ctx, pack, first_scene, last_scene);
+  }
+}
+
+
+
+void pose_frame(animator_t *animator, int frame, int n_threads) {
+  if (set_animation_frame(animator, frame, n_threads) != 0) {
+    fprintf(stderr, "Can't pose frame #%d\n", frame);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// frames of the animated scene are posed and drawn by the master thread while
+// another thread of the outer team saves the previous frame; tiles are drawn
+// by a nested team, which encodes the strips of the frame as they are done,
+// so the encoding never holds up the rendering
+void draw_frames(const context_t *ctx, scene_pack_t *pack, int first_frame,
+                 int last_frame) {
+  animator_t animator;
+  if (init_animator(&animator, pack) != 0) {
+    fprintf(stderr, "Can't animate the scene\n");
+    exit(EXIT_FAILURE);
+  }
+
+  int scene_idx = pack->animation->scene;
+  omp_set_max_active_levels(2);
+
+#pragma omp parallel num_threads(2) default(none)                             \
+    shared(ctx, pack, animator, scene_idx, first_frame, last_frame)
+#pragma omp master
+  for (int frame = first_frame; frame <= last_frame; ++frame) {
+    pose_frame(&animator, frame, ctx->n_threads);
+#ifdef DRAW_PARALLEL
+    if (writes_tiles_directly(ctx, ctx->output_template)) {
+      draw_scene_to_file(ctx, pack, scene_idx, frame);
+      continue;
+    }
+#endif
+
+    const scene_t *  scene   = &pack->scenes[scene_idx];
+    image_encoder_t *encoder = malloc(sizeof(image_encoder_t));
+    assert(encoder);
+    image_encoder_init(encoder, ctx->output_template, scene->width,
+                       scene->height);
+    SDL_Surface *surface = draw(ctx, pack, scene_idx, encoder);
+
+    // at most one frame waits to be saved
+#pragma omp taskwait
+#pragma omp task default(none) firstprivate(ctx, surface, encoder, frame)
+    {
+      if (surface != NULL) {
+        save_scene(ctx, surface, encoder, frame, 1);
+        SDL_FreeSurface(surface);
+      }
+      image_encoder_free(encoder);
+      free(encoder);
+    }
+  }
+
+  free_animator(&animator);
+}
+
+
+
+scene_pack_t *load_pack(const char *scenes_file, const void *ctx) {
+#ifdef DRAW_PARALLEL
+  return load_scenes_on_root(scenes_file, &((const context_t *) ctx)->nodes);
+#else
+  (void) ctx;
+  return load_scenes(scenes_file);
+#endif
+}
+
+int hash_pack_file(const char *scenes_file, uint64_t *hash) {
+#ifdef DRAW_PARALLEL
+  return hash_file_on_root(scenes_file, hash);
+#else
+  return hash_file(scenes_file, hash);
+#endif
+}
+
+
+
+// draws the scenes or the frames of the animation the context asks for
+void draw_scenes_file(const context_t *ctx, const char *program) {
+  scene_pack_t *pack = load_pack(ctx->scenes_file, ctx);
+  if (pack == NULL) {
+    exit(EXIT_FAILURE);
+  }
+
+  const animation_t *animation = pack->animation;
+
+  // the range selects frames of the animation if there is one
+  int n_items   = (animation != NULL) ? animation->n_frames : pack->n_scenes;
+  int last_item = (ctx->last_scene < 0) ? n_items - 1 : ctx->last_scene;
+  if ((last_item >= n_items) || (ctx->first_scene > last_item)) {
+    fprintf(stderr, "%s: there are only %d %s in %s\n", program, n_items,
+            (animation != NULL) ? "frames" : "scenes", ctx->scenes_file);
+    exit(EXIT_FAILURE);
+  }
+
+  if (animation != NULL) {
+    draw_frames(ctx, pack, ctx->first_scene, last_item);
+  } else {
+    draw_scenes(ctx, pack, ctx->first_scene, last_item);
+  }
+  free_scene_pack(pack);
+}
 
 int main(int argc, const char *argv[]) {
   context_t *ctx = process_args(argv, argc);
   assert(ctx->scenes_file);
   assert(ctx->output_template);
 
-  scene_pack_t *pack = get_scenes(ctx->scenes_file);
-  assert(pack);
-
-  char *output_filename =
-      get_output_filename_from_template(ctx->output_template, 0);
-  assert(output_filename != NULL);
+  int is_root = 1;
+#ifdef DRAW_PARALLEL
+  int rank     = -1;
+  int provided = -1;
+  // frames are saved by a thread of their own and tiles are drawn by a thread
+  // pool, the main thread does all the MPI
+  TRY_MPI(MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided));
+  TRY_MPI(MPI_Comm_rank(MPI_COMM_WORLD, &rank));
+  is_root = (rank == ROOT_RANK);
+  if (provided < MPI_THREAD_FUNNELED) {
+    if (is_root) {
+      fprintf(stderr, "%s: MPI has no support of threads (level %d)\n",
+              argv[0], provided);
+    }
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  init_node_layout(&ctx->nodes);
+#endif
 
-  SDL_Surface *surface = draw(ctx, pack, 0);
-  free_scene_pack(pack);
+  if (ctx->socket_path != NULL) {
+    serve(ctx);
+  } else {
+    draw_scenes_file(ctx, argv[0]);
+  }
 
-  SDL_TRY(IMG_SavePNG(surface, output_filename));
-  SDL_FreeSurface(surface);
-  free(output_filename);
+#ifdef DRAW_PARALLEL
+  free_node_layout(&ctx->nodes);
+  TRY_MPI(MPI_Finalize());
+#endif
 
-  if (ctx->create_window) {
+  if (ctx->create_window && is_root) {
     SDL_Delay(WINDOW_TIME);
     close_window(ctx);
   }
@@ -441,6 +1010,35 @@ arg_type_t *classificate_args(const char *argv[], const int argc) {
       types[i - 1] = OUTPUT_TEMPLATE;
       continue;
     }
+    if ((strcmp(argv[i], "-r") == 0) || (strcmp(argv[i], "--range") == 0)) {
+      types[i - 1] = SCENE_RANGE;
+      continue;
+    }
+    if ((strcmp(argv[i], "-p") == 0) || (strcmp(argv[i], "--packet") == 0)) {
+      types[i - 1] = PACKET_SIDE;
+      continue;
+    }
+    if ((strcmp(argv[i], "-j") == 0) || (strcmp(argv[i], "--jobs") == 0)) {
+      types[i - 1] = N_THREADS;
+      continue;
+    }
+    if ((strcmp(argv[i], "-s") == 0) || (strcmp(argv[i], "--schedule") == 0)) {
+      types[i - 1] = SCHEDULE;
+      continue;
+    }
+    if ((strcmp(argv[i], "-t") == 0) || (strcmp(argv[i], "--time") == 0)) {
+      types[i - 1] = TIME_LIMIT;
+      continue;
+    }
+    if ((strcmp(argv[i], "-a") == 0) ||
+        (strcmp(argv[i], "--antialias") == 0)) {
+      types[i - 1] = ANTIALIASING;
+      continue;
+    }
+    if (strcmp(argv[i], "--serve") == 0) {
+      types[i - 1] = SERVE;
+      continue;
+    }
     if ((strncmp(argv[i], "-", 1) == 0) || (strncmp(argv[i], "--", 2) == 0)) {
       types[i - 1] = UNKNOWN;
       continue;
@@ -453,12 +1051,109 @@ arg_type_t *classificate_args(const char *argv[], const int argc) {
 
 
 
+// 'arg' is "<first>" or "<first>:" for the scenes from 'first' to the last one
+// or "<first>:<last>"; returns -1 if it is none of them
+int parse_scene_range(const char *arg, int *first, int *last) {
+  char *endptr;
+  long  first_scene = strtol(arg, &endptr, 10);
+  long  last_scene  = first_scene;
+  if ((endptr == arg) || (first_scene < 0) || (first_scene > INT_MAX)) {
+    return -1;
+  }
+
+  if ((*endptr == ':') && (*(endptr + 1) == '\0')) {
+    last_scene = -1;
+    endptr++;
+  } else if (*endptr == ':') {
+    const char *last_arg = endptr + 1;
+    last_scene           = strtol(last_arg, &endptr, 10);
+    if ((endptr == last_arg) || (last_scene < first_scene) ||
+        (last_scene > INT_MAX)) {
+      return -1;
+    }
+  }
+
+  if (*endptr != '\0') {
+    return -1;
+  }
+
+  *first = first_scene;
+  *last  = last_scene;
+  return 0;
+}
+
+
+
+// returns -1 if 'arg' isn't a supported packet side
+int parse_packet_side(const char *arg) {
+  char *endptr;
+  long  side = strtol(arg, &endptr, 10);
+  if ((*endptr != '\0') || (side < 1) || (side > MAX_PACKET_SIDE)) {
+    return -1;
+  }
+  return side;
+}
+
+
+
+// returns -1 if 'arg' isn't a positive number
+int parse_n_threads(const char *arg) {
+  char *endptr;
+  long  n_threads = strtol(arg, &endptr, 10);
+  if ((*endptr != '\0') || (n_threads < 1) || (n_threads > INT_MAX)) {
+    return -1;
+  }
+  return n_threads;
+}
+
+
+
+// returns -1 if 'arg' isn't a supported number of samples per pixel side
+int parse_aa_side(const char *arg) {
+  char *endptr;
+  long  side = strtol(arg, &endptr, 10);
+  if ((*endptr != '\0') || (side < 1) || (side > MAX_AA_SIDE)) {
+    return -1;
+  }
+  return side;
+}
+
+
+
+// returns -1 if 'arg' isn't a positive number of seconds
+double parse_time_limit(const char *arg) {
+  char * endptr;
+  double seconds = strtod(arg, &endptr);
+  if ((endptr == arg) || (*endptr != '\0') || !(seconds > 0)) {
+    return -1;
+  }
+  return seconds;
+}
+
+
+
 context_t *process_args(const char *argv[], const int argc) {
   assert(argv);
   assert(argc > 0);
 
   context_t *     ctx      = malloc(sizeof(context_t));
-  const context_t ctx_init = {0, "scenes.rtr", "output#.png", NULL, NULL};
+  const context_t ctx_init = {0,
+                              "scenes.rtr",
+                              "output#.png",
+                              NULL,
+                              0,
+                              -1,
+                              DEFAULT_PACKET_SIDE,
+                              1,
+                              DYNAMIC_SCHEDULE,
+                              0,
+                              1,
+#ifdef DRAW_PARALLEL
+                              {MPI_COMM_NULL, 0, 1, MPI_COMM_NULL, 1, 1, 0,
+                               NULL},
+#endif
+                              NULL,
+                              NULL};
   *ctx                     = ctx_init;
   arg_type_t *types        = classificate_args(argv, argc);
   if (argc > 1) {
@@ -484,6 +1179,112 @@ context_t *process_args(const char *argv[], const int argc) {
         i++;
       }
       break;
+    case SCENE_RANGE:
+      if ((i + 2) == argc) {
+        fprintf(stderr, "%s: no range of scenes was provided after '%s'\n",
+                argv[0], argv[i + 1]);
+        exit(EXIT_FAILURE);
+      }
+      if (parse_scene_range(argv[i + 2], &ctx->first_scene,
+                            &ctx->last_scene) != 0) {
+        fprintf(stderr,
+                "%s: range of scenes must be '<first>', '<first>:' or "
+                "'<first>:<last>' with first <= last, got '%s'\n",
+                argv[0], argv[i + 2]);
+        exit(EXIT_FAILURE);
+      }
+      i++;
+      break;
+    case PACKET_SIDE:
+      if ((i + 2) == argc) {
+        fprintf(stderr, "%s: no packet side was provided after '%s'\n",
+                argv[0], argv[i + 1]);
+        exit(EXIT_FAILURE);
+      }
+      ctx->packet_side = parse_packet_side(argv[i + 2]);
+      if (ctx->packet_side < 0) {
+        fprintf(stderr, "%s: packet side must be from 1 to %d, got '%s'\n",
+                argv[0], MAX_PACKET_SIDE, argv[i + 2]);
+        exit(EXIT_FAILURE);
+      }
+      i++;
+      break;
+    case N_THREADS:
+      if ((i + 2) == argc) {
+        fprintf(stderr, "%s: no number of threads was provided after '%s'\n",
+                argv[0], argv[i + 1]);
+        exit(EXIT_FAILURE);
+      }
+      ctx->n_threads = parse_n_threads(argv[i + 2]);
+      if (ctx->n_threads < 0) {
+        fprintf(stderr, "%s: number of threads must be positive, got '%s'\n",
+                argv[0], argv[i + 2]);
+        exit(EXIT_FAILURE);
+      }
+      i++;
+      break;
+    case SCHEDULE:
+      if ((i + 2) == argc) {
+        fprintf(stderr, "%s: no schedule was provided after '%s'\n", argv[0],
+                argv[i + 1]);
+        exit(EXIT_FAILURE);
+      }
+      if (strcmp(argv[i + 2], "static") == 0) {
+        ctx->schedule = STATIC_SCHEDULE;
+      } else if (strcmp(argv[i + 2], "dynamic") == 0) {
+        ctx->schedule = DYNAMIC_SCHEDULE;
+      } else {
+        fprintf(stderr, "%s: schedule must be 'static' or 'dynamic', got "
+                        "'%s'\n",
+                argv[0], argv[i + 2]);
+        exit(EXIT_FAILURE);
+      }
+#ifndef DRAW_PARALLEL
+      fprintf(stderr, "%s: '%s' is ignored without MPI\n", argv[0],
+              argv[i + 1]);
+#endif
+      i++;
+      break;
+    case TIME_LIMIT:
+      if ((i + 2) == argc) {
+        fprintf(stderr, "%s: no time limit was provided after '%s'\n",
+                argv[0], argv[i + 1]);
+        exit(EXIT_FAILURE);
+      }
+      ctx->time_limit = parse_time_limit(argv[i + 2]);
+      if (ctx->time_limit < 0) {
+        fprintf(stderr, "%s: time limit must be a positive number of seconds, "
+                        "got '%s'\n",
+                argv[0], argv[i + 2]);
+        exit(EXIT_FAILURE);
+      }
+      i++;
+      break;
+    case ANTIALIASING:
+      if ((i + 2) == argc) {
+        fprintf(stderr, "%s: no number of samples was provided after '%s'\n",
+                argv[0], argv[i + 1]);
+        exit(EXIT_FAILURE);
+      }
+      ctx->aa_side = parse_aa_side(argv[i + 2]);
+      if (ctx->aa_side < 0) {
+        fprintf(stderr,
+                "%s: number of samples per side must be from 1 to %d, got "
+                "'%s'\n",
+                argv[0], MAX_AA_SIDE, argv[i + 2]);
+        exit(EXIT_FAILURE);
+      }
+      i++;
+      break;
+    case SERVE:
+      if ((i + 2) == argc) {
+        fprintf(stderr, "%s: no socket was provided after '%s'\n", argv[0],
+                argv[i + 1]);
+        exit(EXIT_FAILURE);
+      }
+      ctx->socket_path = argv[i + 2];
+      i++;
+      break;
     case SCENES_FILE:
       ctx->scenes_file = argv[i + 1];
       break;
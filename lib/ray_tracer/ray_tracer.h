@@ -0,0 +1,94 @@
+#pragma once
+
+#include "image_file.h"
+#include "ray_casting.h"
+#include "scene.h"
+#include "tiles.h"
+
+#ifdef DRAW_PARALLEL
+  #include "mpi_render.h"
+#endif
+
+#include <SDL2/SDL.h>
+
+#include <stdint.h>
+
+
+
+enum {
+  // surfaces of the depth get SURFACE_FORMAT pixels
+  SURFACE_DEPTH  = 32,
+  SURFACE_FORMAT = SDL_PIXELFORMAT_RGB888,
+};
+
+typedef enum {
+  STATIC_SCHEDULE,
+  DYNAMIC_SCHEDULE,
+} schedule_t;
+
+
+
+typedef struct context_t {
+  int create_window;
+
+  const char *scenes_file;
+  const char *output_template;
+
+  // the render server listens on the socket, NULL to draw the scenes file
+  const char *socket_path;
+
+  // scenes (or frames of the animation) to draw, 'last_scene' is -1 for the
+  // last one
+  int first_scene;
+  int last_scene;
+
+  // primary rays of packet_side x packet_side pixels are traced together
+  int packet_side;
+  int n_threads;
+
+  // how MPI ranks share the image
+  schedule_t schedule;
+
+  // seconds to refine every image for, 0 to draw it in full
+  double time_limit;
+
+  // edge pixels get aa_side x aa_side samples, 1 turns antialiasing off
+  int aa_side;
+
+#ifdef DRAW_PARALLEL
+  node_layout_t nodes;
+#endif
+
+  SDL_Window *  window;
+  SDL_Renderer *renderer;
+} context_t;
+
+
+
+void init_shadow_cache(shadow_cache_t *cache, const scene_t *scene);
+// 'stats' are the shadow rays, the blocked ones and the ones answered by the
+// cached occluders, as they are counted in 'shadow_cache_t'
+void print_shadow_cache_stats(const long long *stats);
+
+// 'pixels' points to the top left pixel of the tile, rows are 'stride' pixels
+// apart
+void draw_tile(const scene_pack_t *pack, int scene_idx, int packet_side,
+               shadow_cache_t *cache, SDL_PixelFormat *format,
+               const tile_t tile, uint32_t *pixels, int stride);
+
+// returns NULL on the MPI ranks other than the root; the strips of the image
+// are given to the encoder as they are drawn unless they change after that
+SDL_Surface *draw(const context_t *ctx, const scene_pack_t *pack, int scene_idx,
+                  image_encoder_t *encoder);
+
+#ifdef DRAW_PARALLEL
+// PPM and PAM images are written by all the ranks unless the root needs the
+// whole frame to refine, antialias or show it
+int writes_tiles_directly(const context_t *ctx, const char *filename);
+#endif
+
+// with MPI the root reads the files for all the ranks; the loader prints what
+// is wrong and returns NULL if the pack can't be loaded, it gets the context_t
+// as 'ctx', so it fits the pack pool
+scene_pack_t *load_pack(const char *scenes_file, const void *ctx);
+int           hash_pack_file(const char *scenes_file, uint64_t *hash);
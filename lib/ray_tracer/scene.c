@@ -1,5 +1,7 @@
 #include "scene.h"
+#include "accel.h"
 #include "geometry.h"
+#include "pack_cache.h"
 
 #include "flt_type.h"
 
@@ -8,6 +10,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 
@@ -29,6 +32,9 @@ enum {
   N_TRIAN_FLTS = 9,
   N_MODEL_FLTS = 4,
   N_SCENE_FLTS = 7,
+
+  N_CAMERA_KEY_FLTS = 6,
+  N_OBJECT_KEY_FLTS = 4,
 };
 
 enum {
@@ -393,10 +399,9 @@ object_t *extract_triangle_to_object(FILE *pack_file) {
 #ifdef WITH_OBJ
   #include "obj_model.h"
 
-object_t *extract_model_to_object(FILE *pack_file, material_t *materials,
-                                  int n_materials) {
+object_t *extract_model_to_object(FILE *pack_file) {
   char filename[LINE_LEN];
-  if (fscanf(pack_file, "%s", filename) != 1)
+  if (fscanf(pack_file, "%127s", filename) != 1)
     return NULL;
 
   double flt_tmp[N_MODEL_FLTS];
@@ -411,18 +416,15 @@ object_t *extract_model_to_object(FILE *pack_file, material_t *materials,
   if (scan_n_pure_nums(pack_file, &material_index, 1) != 1)
     return NULL;
 
-  if (material_index >= n_materials)
-    return NULL;
-
   model_t *model = extract_obj_model_from_file(filename, shift, scale);
   if (model == NULL)
     return NULL;
 
   object_t *object = malloc(sizeof(object_t));
   assert(object);
-  object->type = OBJ_MODEL;
-  object->data = (void *) model;
-  object->mtrl = materials + material_index;
+  object->type     = OBJ_MODEL;
+  object->data     = (void *) model;
+  object->mtrl_idx = material_index;
 
   return object;
 }
@@ -430,19 +432,31 @@ object_t *extract_model_to_object(FILE *pack_file, material_t *materials,
 
 
 
-void free_object(object_t *object) {
-  if (object != NULL) {
+void free_object_data(object_t *object) {
+  assert(object);
 #ifdef WITH_OBJ
-    if (object->type == OBJ_MODEL)
-      free_model(object->data);
-    else
+  if (object->type == OBJ_MODEL)
+    free_model(object->data);
+  else
 #endif
-      free(object->data);
+    free(object->data);
+}
 
+void free_object(object_t *object) {
+  if (object != NULL) {
+    free_object_data(object);
     free(object);
   }
 }
 
+void free_objects(object_t *objects, int n_objects) {
+  for (int i = 0; i < n_objects; i++) {
+    free_object_data(&objects[i]);
+  }
+
+  free(objects);
+}
+
 
 
 int extract_objects(FILE *pack_file, object_t **objects) {
@@ -518,8 +532,7 @@ int extract_objects(FILE *pack_file, object_t **objects) {
     }
 #ifdef WITH_OBJ
     case OBJ_MODEL: {
-      object_t *object =
-          extract_model_to_object(pack_file, materials, n_materials);
+      object_t *object = extract_model_to_object(pack_file);
       if (object == NULL) {
         free(local_objects);
         return 0;
@@ -542,12 +555,171 @@ int extract_objects(FILE *pack_file, object_t **objects) {
 }
 // }}}
 
+// {{{ Extract animation
+// the track is appended if the object has none yet
+track_t *get_track(animation_t *animation, int object) {
+  for (int i = 0; i < animation->n_tracks; i++) {
+    if (animation->tracks[i].object == object) {
+      return &animation->tracks[i];
+    }
+  }
+
+  animation->tracks = realloc(animation->tracks,
+                              (animation->n_tracks + 1) * sizeof(track_t));
+  assert(animation->tracks);
+
+  track_t *track = &animation->tracks[animation->n_tracks++];
+  track->object  = object;
+  track->keys    = NULL;
+  track->n_keys  = 0;
+
+  return track;
+}
+
+// "camera #<frame> <view point> <view direction>" or
+// "object <index> #<frame> <offset> <angle>"; 'target' is the first lexem
+int scan_keyframe(FILE *pack_file, const char *target,
+                  animation_t *animation) {
+  int object = CAMERA_TRACK;
+  int n_flts = N_CAMERA_KEY_FLTS;
+  if (strcmp(target, "object") == 0) {
+    if ((scan_n_pure_nums(pack_file, &object, 1) != 1) || (object < 0)) {
+      return -1;
+    }
+    n_flts = N_OBJECT_KEY_FLTS;
+  } else if (strcmp(target, "camera") != 0) {
+    return -1;
+  }
+
+  char lexem[LEX_LEN];
+  if (fscanf(pack_file, "%127s", lexem) != 1) {
+    return -1;
+  }
+
+  const int frame = scan_index(lexem);
+  double    flt_tmp[N_CAMERA_KEY_FLTS];
+  if ((frame < 0) ||
+      (scan_arr_of_doubles(pack_file, flt_tmp, n_flts) != n_flts)) {
+    return -1;
+  }
+
+  track_t *track = get_track(animation, object);
+  if ((track->n_keys > 0) && (track->keys[track->n_keys - 1].frame >= frame)) {
+    fprintf(stderr, "keyframe #%d goes after a later one\n", frame);
+    return -1;
+  }
+
+  track->keys = realloc(track->keys, (track->n_keys + 1) * sizeof(keyframe_t));
+  assert(track->keys);
+
+  keyframe_t *key = &track->keys[track->n_keys++];
+  key->frame      = frame;
+  key->pos        = get_vec3f(flt_tmp[0], flt_tmp[1], flt_tmp[2]);
+  if (object == CAMERA_TRACK) {
+    key->dir   = get_vec3f(flt_tmp[3], flt_tmp[4], flt_tmp[5]);
+    key->angle = 0;
+  } else {
+    key->dir   = get_vec3f(0, 0, 0);
+    key->angle = (flt_type) flt_tmp[3];
+  }
+
+  return 0;
+}
+
+// the section starts with "<number of frames> <scene>" followed by keyframes
+int extract_animation(FILE *pack_file, animation_t **animation) {
+  free_animation(*animation);
+  *animation = NULL;
+
+  animation_t *local_animation = calloc(1, sizeof(animation_t));
+  assert(local_animation);
+
+  char lexem[LEX_LEN];
+  if ((skip_comments(pack_file, lexem) != 0) ||
+      (sscanf(lexem, "%d", &local_animation->n_frames) != 1) ||
+      (local_animation->n_frames < 1) ||
+      (scan_n_pure_nums(pack_file, &local_animation->scene, 1) != 1)) {
+    free_animation(local_animation);
+    return -1;
+  }
+
+  for (ever) {
+    if (skip_comments(pack_file, lexem) != 0) {
+      free_animation(local_animation);
+      return -1;
+    }
+
+    if (is_delimiter(lexem)) {
+      break;
+    }
+
+    if (scan_keyframe(pack_file, lexem, local_animation) != 0) {
+      free_animation(local_animation);
+      return -1;
+    }
+  }
+
+  *animation = local_animation;
+
+  return 0;
+}
+
+void free_animation(animation_t *animation) {
+  if (animation != NULL) {
+    for (int i = 0; i < animation->n_tracks; i++) {
+      free(animation->tracks[i].keys);
+    }
+    free(animation->tracks);
+    free(animation);
+  }
+}
+// }}}
+
 // {{{ Extract scenes
+// optional "<min path weight> [roulette]" after the cast depth; 'lexem' holds
+// the lexem after the cast depth and gets the one after the cutoff settings
+int scan_ray_cutoff(FILE *pack_file, scene_t *scene, char *lexem) {
+  scene->min_ray_weight = 0;
+  scene->ray_roulette   = 0;
+
+  if (strcmp(lexem, "{") == 0) {
+    return 0;
+  }
+
+  char *endptr;
+  errno             = 0;
+  double min_weight = strtod(lexem, &endptr);
+  if ((errno != 0) || (*endptr != '\0') || (min_weight < 0) ||
+      (min_weight >= 1)) {
+    fprintf(stderr, "bad ray weight threshold '%s'\n", lexem);
+    return -1;
+  }
+  scene->min_ray_weight = (flt_type) min_weight;
+
+  if (fscanf(pack_file, "%127s", lexem) != 1) {
+    return -1;
+  }
+
+  if (strcmp(lexem, "roulette") == 0) {
+    scene->ray_roulette = 1;
+    if (fscanf(pack_file, "%127s", lexem) != 1) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
 int scan_scene_line(FILE *pack_file, scene_t *scene) {
   if (fscanf(pack_file, "%dx%d", &scene->width, &scene->height) != 2) {
     return 0;
   }
 
+  scene->frame_width  = scene->width;
+  scene->frame_height = scene->height;
+  scene->crop_x       = 0;
+  scene->crop_y       = 0;
+
   double flt_tmp[N_SCENE_FLTS];
   int    n_scanned = scan_arr_of_doubles(pack_file, flt_tmp, N_SCENE_FLTS);
   if (n_scanned != N_SCENE_FLTS) {
@@ -566,12 +738,22 @@ int scan_scene_line(FILE *pack_file, scene_t *scene) {
     return 0;
   }
 
+  if (scene->cast_depth > MAX_CAST_DEPTH) {
+    fprintf(stderr, "cast depth %d is too big, %d is used instead\n",
+            scene->cast_depth, MAX_CAST_DEPTH);
+    scene->cast_depth = MAX_CAST_DEPTH;
+  }
+
   char lexem[LEX_LEN];
 
   if (fscanf(pack_file, "%s", lexem) == 0) {
     return 0;
   }
 
+  if (scan_ray_cutoff(pack_file, scene, lexem) != 0) {
+    return 0;
+  }
+
   if (strcmp(lexem, "{") != 0) {
     return 0;
   }
@@ -622,6 +804,10 @@ int extract_scenes(FILE *pack_file, scene_t **scenes) {
     n_scenes++;
     local_scenes = realloc(local_scenes, n_scenes * sizeof(scene_t));
 
+    // the padding is zeroed too, the scene goes to the pack cache as it is
+    memset(&local_scenes[index], 0, sizeof(scene_t));
+    local_scenes[index].accel = NULL;
+
     if (scan_scene_line(pack_file, &local_scenes[index]) == 0) {
       return 0;
     }
@@ -636,6 +822,7 @@ void free_scenes(scene_t *scenes, int n_scenes) {
   for (int i = 0; i < n_scenes; i++) {
     free(scenes[i].lights);
     free(scenes[i].objects);
+    free_scene_accel(scenes[i].accel);
   }
 
   free(scenes);
@@ -654,14 +841,15 @@ scene_pack_t *parse_scenes_file(const char *pack_filename) {
     return NULL;
   }
 
-  light_t *   lights      = NULL;
-  int         n_lights    = 0;
-  material_t *materials   = NULL;
-  int         n_materials = 0;
-  object_t *  objects     = NULL;
-  int         n_objects   = 0;
-  scene_t *   scenes      = NULL;
-  int         n_scenes    = 0;
+  light_t *    lights      = NULL;
+  int          n_lights    = 0;
+  material_t * materials   = NULL;
+  int          n_materials = 0;
+  object_t *   objects     = NULL;
+  int          n_objects   = 0;
+  scene_t *    scenes      = NULL;
+  int          n_scenes    = 0;
+  animation_t *animation   = NULL;
 
   char lexem[LEX_LEN];
 
@@ -678,7 +866,8 @@ scene_pack_t *parse_scenes_file(const char *pack_filename) {
       n_objects = extract_objects(pack_file, &objects);
     } else if (strcmp(lexem, "scenes") == 0) {
       n_scenes = extract_scenes(pack_file, &scenes);
-    } else {
+    } else if ((strcmp(lexem, "animation") != 0) ||
+               (extract_animation(pack_file, &animation) != 0)) {
       free(lights);
       free(materials);
       free(objects);
@@ -703,37 +892,102 @@ scene_pack_t *parse_scenes_file(const char *pack_filename) {
   pack->objects   = objects;
   pack->n_objects = n_objects;
 
+  pack->animation = animation;
+
+  pack->arena      = NULL;
+  pack->free_arena = NULL;
+
   return pack;
 }
 
 
 
-scene_pack_t *get_scenes(const char *scenes_file) {
+// the compiled scene depends on the objects and the lights only
+int have_same_contents(const scene_t *scene1, const scene_t *scene2) {
+  return (scene1->n_objects == scene2->n_objects) &&
+         (scene1->n_lights == scene2->n_lights) &&
+         (memcmp(scene1->objects, scene2->objects,
+                 scene1->n_objects * sizeof(int)) == 0) &&
+         (memcmp(scene1->lights, scene2->lights,
+                 scene1->n_lights * sizeof(int)) == 0);
+}
+
+scene_pack_t *load_scenes(const char *scenes_file) {
+  scene_pack_t *pack = read_scenes(scenes_file);
+  if ((pack != NULL) && (compile_scenes(pack) != 0)) {
+    free_scene_pack(pack);
+    return NULL;
+  }
+
+  return pack;
+}
+
+scene_pack_t *read_scenes(const char *scenes_file) {
   if (scenes_file == NULL) {
     scenes_file = "scenes.rtr";
   }
 
-  scene_pack_t *pack = parse_scenes_file(scenes_file);
+  // the text is parsed only if there is no valid binary cache of it
+  int           is_cached = 1;
+  scene_pack_t *pack      = load_pack_cache(scenes_file);
+  if (pack == NULL) {
+    is_cached = 0;
+    pack      = parse_scenes_file(scenes_file);
+  }
 
   if (pack == NULL) {
     fprintf(stderr, "parse_scenes failed!\n");
-    exit(EXIT_FAILURE);
+    return NULL;
   }
 
   if (pack->n_scenes < 1) {
-    fprintf(stderr, "No scenes in %s!", scenes_file);
-    exit(EXIT_FAILURE);
+    fprintf(stderr, "No scenes in %s!\n", scenes_file);
+    free_scene_pack(pack);
+    return NULL;
+  }
+
+  if (!is_cached && (save_pack_cache(scenes_file, pack) != 0)) {
+    fprintf(stderr, "Can't write cache of %s\n", scenes_file);
   }
 
   return pack;
 }
 
+int compile_scenes(scene_pack_t *pack) {
+  assert(pack);
+
+  // scenes of a camera sweep usually differ in the view only, so the scene
+  // is compiled once for all of them
+  for (int i = 0; i < pack->n_scenes; i++) {
+    scene_t *scene = &pack->scenes[i];
+    for (int j = i - 1; (j >= 0) && (scene->accel == NULL); --j) {
+      if (have_same_contents(scene, &pack->scenes[j])) {
+        scene->accel = share_scene_accel(pack->scenes[j].accel);
+      }
+    }
+
+    if (scene->accel == NULL) {
+      scene->accel = build_scene_accel(pack, i);
+    }
+    if (scene->accel == NULL) {
+      fprintf(stderr, "build_scene_accel failed!\n");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
 void free_scene_pack(scene_pack_t *pack) {
   assert(pack);
   free_scenes(pack->scenes, pack->n_scenes);
-  free(pack->objects);
+  free_objects(pack->objects, pack->n_objects);
   free(pack->lights);
   free(pack->materials);
+  free_animation(pack->animation);
+  if (pack->free_arena != NULL) {
+    pack->free_arena(pack->arena);
+  }
   free(pack);
 }
 // }}}
@@ -8,6 +8,7 @@
 
 
 struct vec3f;
+struct scene_accel_t;
 
 
 
@@ -45,25 +46,82 @@ typedef struct {
 
 
 
+enum {
+  // longer chains of reflections and refractions are cut
+  MAX_CAST_DEPTH = 64,
+};
+
 typedef struct {
   int width;
   int height;
 
+  // the image may be a crop of a bigger frame: rays are cast as for the
+  // frame_width x frame_height image and pixel (0, 0) of the image is pixel
+  // (crop_x, crop_y) of the frame; the frame is the image itself unless the
+  // render server crops it
+  int frame_width;
+  int frame_height;
+  int crop_x;
+  int crop_y;
+
   vec3f    view_point;
   vec3f    view_dir;
   flt_type fov;
 
   int cast_depth;
 
+  // secondary rays whose path weight (product of albedos from the primary
+  // ray) falls below 'min_ray_weight' are either not traced or, with
+  // 'ray_roulette', traced with probability proportional to the weight
+  flt_type min_ray_weight;
+  int      ray_roulette;
+
   int *objects;
   int  n_objects;
 
   int *lights;
   int  n_lights;
+
+  struct scene_accel_t *accel;
 } scene_t;
 
 
 
+// pose at a keyframe: the camera gets 'pos' as the view point and 'dir' as
+// the view direction; an object is turned by 'angle' (in rad) about the
+// vertical axis through its center and then shifted by 'pos'
+typedef struct {
+  int      frame;
+  vec3f    pos;
+  vec3f    dir;
+  flt_type angle;
+} keyframe_t;
+
+enum {
+  CAMERA_TRACK = -1,
+};
+
+// keyframes of the camera ('object' is CAMERA_TRACK) or of a pack object in
+// increasing order of frames; between them positions and angles are
+// interpolated linearly and directions spherically (slerp_vec3f); the first
+// and the last ones hold before and after them
+typedef struct {
+  int object;
+
+  keyframe_t *keys;
+  int         n_keys;
+} track_t;
+
+typedef struct {
+  int scene;
+  int n_frames;
+
+  track_t *tracks;
+  int      n_tracks;
+} animation_t;
+
+
+
 typedef struct {
   object_t *objects;
   int       n_objects;
@@ -76,10 +134,26 @@ typedef struct {
 
   scene_t *scenes;
   int      n_scenes;
+
+  // NULL unless the pack is a sequence of frames of one of its scenes
+  animation_t *animation;
+
+  // memory some arrays of the pack point into rather than own (a window
+  // shared by the MPI ranks of a node), it is released along with the pack
+  void *arena;
+  void (*free_arena)(void *arena);
 } scene_pack_t;
 
 
 
-scene_pack_t *get_scenes(const char *scenes_file);
+// prints what is wrong and returns NULL if the pack can't be loaded
+scene_pack_t *load_scenes(const char *scenes_file);
+// loads the pack without compiling the scenes, for a pack which is only
+// passed on
+scene_pack_t *read_scenes(const char *scenes_file);
+// builds the compiled scenes of a pack which has been read without them
+int compile_scenes(scene_pack_t *pack);
 void free_scene_pack(scene_pack_t *pack);
 
+void free_animation(animation_t *animation);
+
@@ -0,0 +1,410 @@
+#include "server.h"
+#include "animation.h"
+#include "geometry.h"
+#include "image_file.h"
+#include "pack_pool.h"
+#include "scene.h"
+#include "tiles.h"
+
+#include "flt_type.h"
+
+#ifdef DRAW_PARALLEL
+  #define EXIT_ON_FAIL
+  #include "mpi_error.h"
+  #include <mpi/mpi.h>
+#endif
+
+#include <SDL2/SDL.h>
+
+#include <assert.h>
+#include <limits.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+
+enum {
+  // scenes files kept loaded by the render server
+  SERVE_POOL_SIZE = 4,
+  MAX_JOB_TOKENS  = 32,
+  MAX_REPLY_LEN   = 4096,
+};
+
+
+
+typedef struct {
+  const char *scenes_file;
+  const char *output_file;
+  // scene or frame of the animation
+  int item;
+
+  int   has_view;
+  vec3f view_point;
+  vec3f view_dir;
+
+  // 0 to keep the size of the scene
+  int width;
+  int height;
+
+  int    has_crop;
+  tile_t crop;
+} job_t;
+
+// returns -1 if 'arg' isn't a whole number
+int parse_job_int(const char *arg, int *value) {
+  char *endptr;
+  long  n = strtol(arg, &endptr, 10);
+  if ((endptr == arg) || (*endptr != '\0') || (n < INT_MIN) || (n > INT_MAX)) {
+    return -1;
+  }
+  *value = n;
+  return 0;
+}
+
+// returns -1 if 'args' aren't 'n' numbers
+int parse_job_flts(char *const *args, int n, flt_type *values) {
+  for (int i = 0; i < n; ++i) {
+    char *endptr;
+    values[i] = (flt_type) strtod(args[i], &endptr);
+    if ((endptr == args[i]) || (*endptr != '\0')) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// returns -1 if 'arg' isn't "<width>x<height>" with positive sides
+int parse_job_size(const char *arg, int *width, int *height) {
+  int n = 0;
+  if ((sscanf(arg, "%dx%d%n", width, height, &n) != 2) ||
+      (arg[n] != '\0') || (*width < 1) || (*height < 1)) {
+    return -1;
+  }
+  return 0;
+}
+
+// the job line is cut into tokens in place; returns -1 if it isn't
+// "<file with scenes> <scene or frame> <output file>" followed by options
+// "view <x> <y> <z> <dx> <dy> <dz>", "size <w>x<h>" or "crop <x> <y> <w>x<h>"
+int parse_job(char *line, job_t *job) {
+  char *tokens[MAX_JOB_TOKENS];
+  int   n_tokens = 0;
+  char *save_ptr = NULL;
+  for (char *token = strtok_r(line, " \t", &save_ptr); token != NULL;
+       token       = strtok_r(NULL, " \t", &save_ptr)) {
+    if (n_tokens == MAX_JOB_TOKENS) {
+      return -1;
+    }
+    tokens[n_tokens++] = token;
+  }
+
+  memset(job, 0, sizeof(job_t));
+  if ((n_tokens < 3) || (parse_job_int(tokens[1], &job->item) != 0) ||
+      (job->item < 0)) {
+    return -1;
+  }
+  job->scenes_file = tokens[0];
+  job->output_file = tokens[2];
+
+  for (int i = 3; i < n_tokens;) {
+    char *const *args   = &tokens[i + 1];
+    int          n_args = n_tokens - i - 1;
+    if ((strcmp(tokens[i], "view") == 0) && (n_args >= 6)) {
+      flt_type v[6];
+      if (parse_job_flts(args, 6, v) != 0) {
+        return -1;
+      }
+      job->has_view   = 1;
+      job->view_point = get_vec3f(v[0], v[1], v[2]);
+      job->view_dir   = get_vec3f(v[3], v[4], v[5]);
+      i += 7;
+    } else if ((strcmp(tokens[i], "size") == 0) && (n_args >= 1)) {
+      if (parse_job_size(args[0], &job->width, &job->height) != 0) {
+        return -1;
+      }
+      i += 2;
+    } else if ((strcmp(tokens[i], "crop") == 0) && (n_args >= 3)) {
+      tile_t *crop = &job->crop;
+      if ((parse_job_int(args[0], &crop->x) != 0) ||
+          (parse_job_int(args[1], &crop->y) != 0) ||
+          (parse_job_size(args[2], &crop->w, &crop->h) != 0)) {
+        return -1;
+      }
+      job->has_crop = 1;
+      i += 4;
+    } else {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// the size and the crop are applied to the scene in this order; returns -1
+// if the crop doesn't fit into the frame
+int set_job_view(scene_t *scene, const job_t *job) {
+  if (job->has_view) {
+    scene->view_point = job->view_point;
+    scene->view_dir   = job->view_dir;
+  }
+
+  if (job->width > 0) {
+    scene->width        = job->width;
+    scene->height       = job->height;
+    scene->frame_width  = job->width;
+    scene->frame_height = job->height;
+  }
+
+  if (job->has_crop) {
+    const tile_t *crop = &job->crop;
+    if ((crop->x < 0) || (crop->y < 0) || (crop->w < 1) || (crop->h < 1) ||
+        (crop->x + crop->w > scene->frame_width) ||
+        (crop->y + crop->h > scene->frame_height)) {
+      return -1;
+    }
+
+    scene->width  = crop->w;
+    scene->height = crop->h;
+    scene->crop_x = crop->x;
+    scene->crop_y = crop->y;
+  }
+
+  return 0;
+}
+
+// every rank runs the job, the root saves the image unless the ranks write it
+// together, only the root gets the reply;
+// the scene is restored after the job, the pose of an animated one is kept
+void run_job(const context_t *ctx, pack_pool_t *pool, char *line,
+             char *reply, size_t reply_size) {
+  double start = omp_get_wtime();
+
+  job_t job;
+  if (parse_job(line, &job) != 0) {
+    snprintf(reply, reply_size, "error: can't parse the job\n");
+    return;
+  }
+
+  pooled_pack_t *pooled = pack_pool_get(pool, job.scenes_file);
+  if (pooled == NULL) {
+    snprintf(reply, reply_size, "error: can't load %s\n", job.scenes_file);
+    return;
+  }
+
+  scene_pack_t *     pack      = pooled->pack;
+  const animation_t *animation = pack->animation;
+  int n_items   = (animation != NULL) ? animation->n_frames : pack->n_scenes;
+  int scene_idx = (animation != NULL) ? animation->scene : job.item;
+  if (job.item >= n_items) {
+    snprintf(reply, reply_size, "error: there are only %d %s in %s\n", n_items,
+             (animation != NULL) ? "frames" : "scenes", job.scenes_file);
+    return;
+  }
+
+  if ((animation != NULL) &&
+      (set_animation_frame(&pooled->animator, job.item, ctx->n_threads) !=
+       0)) {
+    snprintf(reply, reply_size, "error: can't pose frame #%d\n", job.item);
+    return;
+  }
+
+  scene_t *scene = &pack->scenes[scene_idx];
+  scene_t  saved = *scene;
+  if (set_job_view(scene, &job) != 0) {
+    *scene = saved;
+    snprintf(reply, reply_size, "error: the crop is out of the frame\n");
+    return;
+  }
+
+#ifdef DRAW_PARALLEL
+  if (writes_tiles_directly(ctx, job.output_file)) {
+    int res = draw_scene_to_file_parallel(ctx, pack, scene_idx,
+                                          job.output_file);
+    *scene  = saved;
+    if (res != 0) {
+      snprintf(reply, reply_size, "error: can't save %s\n", job.output_file);
+    } else {
+      snprintf(reply, reply_size, "done %s in %.3f s\n", job.output_file,
+               omp_get_wtime() - start);
+    }
+    return;
+  }
+#endif
+
+  image_encoder_t encoder;
+  image_encoder_init(&encoder, job.output_file, scene->width, scene->height);
+  SDL_Surface *surface = draw(ctx, pack, scene_idx, &encoder);
+  *scene               = saved;
+  if (surface == NULL) {
+    image_encoder_free(&encoder);
+    return;
+  }
+
+  if (image_encoder_save(&encoder, surface, job.output_file,
+                         ctx->n_threads) != 0) {
+    snprintf(reply, reply_size, "error: can't save %s: %s\n", job.output_file,
+             SDL_GetError());
+  } else {
+    snprintf(reply, reply_size, "done %s in %.3f s\n", job.output_file,
+             omp_get_wtime() - start);
+  }
+  SDL_FreeSurface(surface);
+  image_encoder_free(&encoder);
+}
+
+
+
+// clients connect one after another, every one may send any number of jobs;
+// with MPI only the root listens and broadcasts the jobs to the other ranks
+typedef struct {
+  int   listener;
+  FILE *client;
+
+  char * line;
+  size_t line_size;
+} server_t;
+
+void open_server(server_t *server, const char *socket_path) {
+  server->listener  = -1;
+  server->client    = NULL;
+  server->line      = NULL;
+  server->line_size = 0;
+
+#ifdef DRAW_PARALLEL
+  int rank = -1;
+  TRY_MPI(MPI_Comm_rank(MPI_COMM_WORLD, &rank));
+  if (rank != ROOT_RANK) {
+    return;
+  }
+#endif
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", socket_path);
+    exit(EXIT_FAILURE);
+  }
+  strcpy(address.sun_path, socket_path);
+
+  // the socket left by a previous server is replaced
+  unlink(socket_path);
+  server->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if ((server->listener < 0) ||
+      (bind(server->listener, (struct sockaddr *) &address,
+            sizeof(address)) != 0) ||
+      (listen(server->listener, SOMAXCONN) != 0)) {
+    perror(socket_path);
+    exit(EXIT_FAILURE);
+  }
+
+  printf("serving on %s\n", socket_path);
+  fflush(stdout);
+}
+
+void close_server(server_t *server, const char *socket_path) {
+  if (server->client != NULL) {
+    fclose(server->client);
+  }
+  if (server->listener >= 0) {
+    close(server->listener);
+    unlink(socket_path);
+  }
+  free(server->line);
+}
+
+// blocks until a client connects
+FILE *accept_client(int listener) {
+  FILE *client = NULL;
+  while (client == NULL) {
+    int fd = accept(listener, NULL, NULL);
+    client = (fd >= 0) ? fdopen(fd, "r") : NULL;
+    if ((fd >= 0) && (client == NULL)) {
+      close(fd);
+    }
+  }
+  return client;
+}
+
+// the root waits for the next line of a client; empty lines are skipped
+void read_job_line(server_t *server) {
+  size_t len = 0;
+  while (len == 0) {
+    if (server->client == NULL) {
+      server->client = accept_client(server->listener);
+    }
+
+    if (getline(&server->line, &server->line_size, server->client) < 0) {
+      fclose(server->client);
+      server->client = NULL;
+      continue;
+    }
+
+    len               = strcspn(server->line, "\r\n");
+    server->line[len] = '\0';
+  }
+}
+
+// returns the next job line, the same on every rank
+char *get_job_line(server_t *server) {
+  int is_root = 1;
+#ifdef DRAW_PARALLEL
+  int rank = -1;
+  TRY_MPI(MPI_Comm_rank(MPI_COMM_WORLD, &rank));
+  is_root = (rank == ROOT_RANK);
+#endif
+
+  if (is_root) {
+    read_job_line(server);
+  }
+
+#ifdef DRAW_PARALLEL
+  int len = is_root ? (int) strlen(server->line) : 0;
+  TRY_MPI(MPI_Bcast(&len, 1, MPI_INT, ROOT_RANK, MPI_COMM_WORLD));
+  if (!is_root && (server->line_size < (size_t) len + 1)) {
+    server->line_size = len + 1;
+    server->line      = realloc(server->line, server->line_size);
+    assert(server->line);
+  }
+  TRY_MPI(MPI_Bcast(server->line, len + 1, MPI_CHAR, ROOT_RANK,
+                    MPI_COMM_WORLD));
+#endif
+
+  return server->line;
+}
+
+// the reply is lost if the client has gone
+void send_reply(const server_t *server, const char *reply) {
+  if ((server->client != NULL) && (reply[0] != '\0')) {
+    send(fileno(server->client), reply, strlen(reply), MSG_NOSIGNAL);
+  }
+}
+
+void serve(const context_t *ctx) {
+  pack_pool_t pool;
+  if (pack_pool_init(&pool, SERVE_POOL_SIZE, load_pack, ctx,
+                     hash_pack_file) != 0) {
+    fprintf(stderr, "Can't allocate pool of scenes files\n");
+    exit(EXIT_FAILURE);
+  }
+
+  server_t server;
+  open_server(&server, ctx->socket_path);
+
+  char reply[MAX_REPLY_LEN];
+  for (char *line = get_job_line(&server); strcmp(line, "quit") != 0;
+       line       = get_job_line(&server)) {
+    reply[0] = '\0';
+    run_job(ctx, &pool, line, reply, MAX_REPLY_LEN);
+    send_reply(&server, reply);
+  }
+
+  send_reply(&server, "bye\n");
+  close_server(&server, ctx->socket_path);
+  pack_pool_free(&pool);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "ray_tracer.h"
+
+
+
+// The render server reads jobs from clients of a unix socket, one job per
+// line:
+//   <file with scenes> <scene or frame> <output file>
+//   [view <x> <y> <z> <dx> <dy> <dz>] [size <width>x<height>]
+//   [crop <x> <y> <width>x<height>]
+// and answers every one with a line "done <output file> in <time> s" or
+// "error: <what is wrong>". The view, the size and the crop hold for the job
+// only. Loaded scenes files stay in a pack pool for the next jobs. 'quit'
+// gets "bye" and stops the server.
+//
+// With MPI only the root listens and every job is run by all the ranks.
+
+// serves on ctx->socket_path until it gets 'quit'
+void serve(const context_t *ctx);
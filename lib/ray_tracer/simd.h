@@ -0,0 +1,119 @@
+#pragma once
+
+#include "flt_type.h"
+
+
+
+// Thin layer over SSE/AVX intrinsics used by the SoA and ray packet kernels.
+// Vector width depends on the instruction set the ray tracer is built for
+// (AVX with -DWITH_AVX2=ON, SSE2 on any x86-64) and on flt_type; long double
+// and other architectures fall back to the scalar kernels.
+
+#if defined __AVX__ && defined FLT_TYPE_FLOAT
+  #include <immintrin.h>
+
+typedef __m256 vflt;
+
+  #define SIMD_WIDTH        8
+  #define vflt_set1(f)      _mm256_set1_ps(f)
+  #define vflt_loadu(p)     _mm256_loadu_ps(p)
+  #define vflt_storeu(p, v) _mm256_storeu_ps(p, v)
+  #define vflt_add(a, b)    _mm256_add_ps(a, b)
+  #define vflt_sub(a, b)    _mm256_sub_ps(a, b)
+  #define vflt_mul(a, b)    _mm256_mul_ps(a, b)
+  #define vflt_div(a, b)    _mm256_div_ps(a, b)
+  #define vflt_sqrt(a)      _mm256_sqrt_ps(a)
+  #define vflt_min(a, b)    _mm256_min_ps(a, b)
+  #define vflt_max(a, b)    _mm256_max_ps(a, b)
+  #define vflt_lt(a, b)     _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+  #define vflt_le(a, b)     _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+  #define vflt_and(a, b)    _mm256_and_ps(a, b)
+  #define vflt_andnot(a, b) _mm256_andnot_ps(a, b)
+  #define vflt_or(a, b)     _mm256_or_ps(a, b)
+  #define vflt_mask(a)      _mm256_movemask_ps(a)
+
+#elif defined __AVX__ && defined FLT_TYPE_DOUBLE
+  #include <immintrin.h>
+
+typedef __m256d vflt;
+
+  #define SIMD_WIDTH        4
+  #define vflt_set1(f)      _mm256_set1_pd(f)
+  #define vflt_loadu(p)     _mm256_loadu_pd(p)
+  #define vflt_storeu(p, v) _mm256_storeu_pd(p, v)
+  #define vflt_add(a, b)    _mm256_add_pd(a, b)
+  #define vflt_sub(a, b)    _mm256_sub_pd(a, b)
+  #define vflt_mul(a, b)    _mm256_mul_pd(a, b)
+  #define vflt_div(a, b)    _mm256_div_pd(a, b)
+  #define vflt_sqrt(a)      _mm256_sqrt_pd(a)
+  #define vflt_min(a, b)    _mm256_min_pd(a, b)
+  #define vflt_max(a, b)    _mm256_max_pd(a, b)
+  #define vflt_lt(a, b)     _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+  #define vflt_le(a, b)     _mm256_cmp_pd(a, b, _CMP_LE_OQ)
+  #define vflt_and(a, b)    _mm256_and_pd(a, b)
+  #define vflt_andnot(a, b) _mm256_andnot_pd(a, b)
+  #define vflt_or(a, b)     _mm256_or_pd(a, b)
+  #define vflt_mask(a)      _mm256_movemask_pd(a)
+
+#elif defined __SSE2__ && defined FLT_TYPE_FLOAT
+  #include <emmintrin.h>
+
+typedef __m128 vflt;
+
+  #define SIMD_WIDTH        4
+  #define vflt_set1(f)      _mm_set1_ps(f)
+  #define vflt_loadu(p)     _mm_loadu_ps(p)
+  #define vflt_storeu(p, v) _mm_storeu_ps(p, v)
+  #define vflt_add(a, b)    _mm_add_ps(a, b)
+  #define vflt_sub(a, b)    _mm_sub_ps(a, b)
+  #define vflt_mul(a, b)    _mm_mul_ps(a, b)
+  #define vflt_div(a, b)    _mm_div_ps(a, b)
+  #define vflt_sqrt(a)      _mm_sqrt_ps(a)
+  #define vflt_min(a, b)    _mm_min_ps(a, b)
+  #define vflt_max(a, b)    _mm_max_ps(a, b)
+  #define vflt_lt(a, b)     _mm_cmplt_ps(a, b)
+  #define vflt_le(a, b)     _mm_cmple_ps(a, b)
+  #define vflt_and(a, b)    _mm_and_ps(a, b)
+  #define vflt_andnot(a, b) _mm_andnot_ps(a, b)
+  #define vflt_or(a, b)     _mm_or_ps(a, b)
+  #define vflt_mask(a)      _mm_movemask_ps(a)
+
+#elif defined __SSE2__ && defined FLT_TYPE_DOUBLE
+  #include <emmintrin.h>
+
+typedef __m128d vflt;
+
+  #define SIMD_WIDTH        2
+  #define vflt_set1(f)      _mm_set1_pd(f)
+  #define vflt_loadu(p)     _mm_loadu_pd(p)
+  #define vflt_storeu(p, v) _mm_storeu_pd(p, v)
+  #define vflt_add(a, b)    _mm_add_pd(a, b)
+  #define vflt_sub(a, b)    _mm_sub_pd(a, b)
+  #define vflt_mul(a, b)    _mm_mul_pd(a, b)
+  #define vflt_div(a, b)    _mm_div_pd(a, b)
+  #define vflt_sqrt(a)      _mm_sqrt_pd(a)
+  #define vflt_min(a, b)    _mm_min_pd(a, b)
+  #define vflt_max(a, b)    _mm_max_pd(a, b)
+  #define vflt_lt(a, b)     _mm_cmplt_pd(a, b)
+  #define vflt_le(a, b)     _mm_cmple_pd(a, b)
+  #define vflt_and(a, b)    _mm_and_pd(a, b)
+  #define vflt_andnot(a, b) _mm_andnot_pd(a, b)
+  #define vflt_or(a, b)     _mm_or_pd(a, b)
+  #define vflt_mask(a)      _mm_movemask_pd(a)
+
+#else
+  #define SIMD_WIDTH 1
+#endif
+
+#define SIMD_ENABLED (SIMD_WIDTH > 1)
+
+#if SIMD_ENABLED
+  // (mask ? b : a) without SSE4.1 blends
+  #define vflt_select(mask, a, b)                                              \
+    vflt_or(vflt_and(mask, b), vflt_andnot(mask, a))
+  #define vflt_abs(a) vflt_andnot(vflt_set1(-FLT_ZERO), a)
+  // same order of operations as vec3f_scalar_mul
+  #define vflt_dot(a_x, a_y, a_z, b_x, b_y, b_z)                               \
+    vflt_add(vflt_add(vflt_mul(a_x, b_x), vflt_mul(a_y, b_y)),                 \
+             vflt_mul(a_z, b_z))
+#endif
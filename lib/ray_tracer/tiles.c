@@ -0,0 +1,130 @@
+#include "tiles.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+
+
+enum {
+  RANGE_END_SHIFT = 32,
+};
+
+
+
+int get_n_tiles(int width, int height) {
+  assert((width > 0) && (height > 0));
+
+  int n_cols = (width + TILE_SIZE - 1) / TILE_SIZE;
+  int n_rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+  return n_cols * n_rows;
+}
+
+tile_t get_tile(int width, int height, int tile_idx) {
+  assert((tile_idx >= 0) && (tile_idx < get_n_tiles(width, height)));
+
+  int n_cols = (width + TILE_SIZE - 1) / TILE_SIZE;
+
+  tile_t tile;
+  tile.x = (tile_idx % n_cols) * TILE_SIZE;
+  tile.y = (tile_idx / n_cols) * TILE_SIZE;
+  tile.w = (width - tile.x < TILE_SIZE) ? width - tile.x : TILE_SIZE;
+  tile.h = (height - tile.y < TILE_SIZE) ? height - tile.y : TILE_SIZE;
+  return tile;
+}
+
+
+
+uint64_t pack_range(uint32_t next, uint32_t end) {
+  return ((uint64_t) end << RANGE_END_SHIFT) | next;
+}
+
+uint32_t range_next(uint64_t range) { return (uint32_t) range; }
+
+uint32_t range_end(uint64_t range) {
+  return (uint32_t) (range >> RANGE_END_SHIFT);
+}
+
+
+
+int tile_scheduler_init(tile_scheduler_t *scheduler, int n_tiles,
+                        int n_workers) {
+  assert(scheduler);
+  assert(n_tiles >= 0);
+  assert(n_workers > 0);
+
+  scheduler->n_workers = n_workers;
+  scheduler->ranges =
+      aligned_alloc(CACHE_LINE_SIZE, n_workers * sizeof(tile_range_t));
+  if (scheduler->ranges == NULL) {
+    return -1;
+  }
+
+  // neighbouring tiles of a share are likely to have similar cost, so it's
+  // the whole shares which are balanced by stealing
+  for (int i = 0; i < n_workers; ++i) {
+    uint32_t next = (int64_t) n_tiles * i / n_workers;
+    uint32_t end  = (int64_t) n_tiles * (i + 1) / n_workers;
+    atomic_init(&scheduler->ranges[i].range, pack_range(next, end));
+  }
+
+  return 0;
+}
+
+void tile_scheduler_free(tile_scheduler_t *scheduler) {
+  assert(scheduler);
+  free(scheduler->ranges);
+  scheduler->ranges    = NULL;
+  scheduler->n_workers = 0;
+}
+
+
+
+int take_from_front(tile_range_t *own) {
+  uint64_t range = atomic_load(&own->range);
+  while (range_next(range) < range_end(range)) {
+    uint64_t taken = pack_range(range_next(range) + 1, range_end(range));
+    if (atomic_compare_exchange_weak(&own->range, &range, taken)) {
+      return range_next(range);
+    }
+  }
+  return -1;
+}
+
+// moves the back half of the victim's range to the thief and returns its
+// first tile
+int steal_back_half(tile_range_t *victim, tile_range_t *own) {
+  uint64_t range = atomic_load(&victim->range);
+  while (range_next(range) < range_end(range)) {
+    uint32_t n_left = range_end(range) - range_next(range);
+    uint32_t first  = range_end(range) - (n_left + 1) / 2;
+    uint64_t left   = pack_range(range_next(range), first);
+    if (atomic_compare_exchange_weak(&victim->range, &range, left)) {
+      atomic_store(&own->range, pack_range(first + 1, range_end(range)));
+      return first;
+    }
+  }
+  return -1;
+}
+
+int tile_scheduler_next(tile_scheduler_t *scheduler, int worker) {
+  assert(scheduler);
+  assert((worker >= 0) && (worker < scheduler->n_workers));
+
+  tile_range_t *own  = &scheduler->ranges[worker];
+  int           tile = take_from_front(own);
+  if (tile >= 0) {
+    return tile;
+  }
+
+  for (int i = 1; i < scheduler->n_workers; ++i) {
+    int victim = (worker + i) % scheduler->n_workers;
+    tile       = steal_back_half(&scheduler->ranges[victim], own);
+    if (tile >= 0) {
+      return tile;
+    }
+  }
+
+  return -1;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+
+
+enum {
+  TILE_SIZE = 32,
+
+  // per-worker ranges are kept on separate cache lines
+  CACHE_LINE_SIZE = 64,
+};
+
+
+
+typedef struct {
+  int x;
+  int y;
+  int w;
+  int h;
+} tile_t;
+
+// range of tile indices [next, end) of a worker packed into one word, so the
+// owner and thieves can update it with a single compare-and-swap
+typedef struct {
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t range;
+} tile_range_t;
+
+// work-stealing scheduler: every worker starts with a contiguous share of the
+// tiles and takes them from the front; a worker which has run out of tiles
+// steals the back half of the range of another one
+typedef struct {
+  tile_range_t *ranges;
+  int           n_workers;
+} tile_scheduler_t;
+
+
+
+// tiles are numbered row by row
+int    get_n_tiles(int width, int height);
+tile_t get_tile(int width, int height, int tile_idx);
+
+int  tile_scheduler_init(tile_scheduler_t *scheduler, int n_tiles,
+                         int n_workers);
+void tile_scheduler_free(tile_scheduler_t *scheduler);
+
+// returns index of the next tile to render or -1 if there are no tiles left
+int tile_scheduler_next(tile_scheduler_t *scheduler, int worker);
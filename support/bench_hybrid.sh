@@ -0,0 +1,122 @@
+#!/bin/sh
+
+src_dir="$(readlink -f $(dirname $0)/..)"
+binary="${src_dir}/install/ray_tracer/ray_tracer"
+scenes="${src_dir}/test/ray_tracer/2/scenes.rtr"
+n_cores="$(nproc)"
+n_runs=3
+mpirun_cmd="mpirun"
+bind=1
+
+USAGE="Usage info: bench_hybrid.sh [OPTION(s)]
+Compares layouts of the ray tracer built with PARALLEL=ON on the same number
+of cores: pure MPI with a rank per core against hybrid ones with fewer ranks
+and a thread pool of the rest of the cores in every rank
+Options:
+    -h, --help              Show this help
+    -b, --binary   <path>   Path to the ray tracer, the installed one by default
+    -c, --cores    <n>      Number of cores to use, all of them by default
+    -n, --runs     <n>      Runs of every layout, the best one is reported
+    -s, --scenes   <path>   Path to the file with scenes
+    --mpirun       <cmd>    MPI launcher with its options, 'mpirun' by default
+    --no-bind               Don't bind ranks and threads to cores"
+
+while [ -n "$1" ]; do
+  case "$1" in
+    -b|--binary)
+      binary="$2"
+      shift
+      ;;
+    -c|--cores)
+      n_cores="$2"
+      shift
+      ;;
+    -n|--runs)
+      n_runs="$2"
+      shift
+      ;;
+    -s|--scenes)
+      scenes="$2"
+      shift
+      ;;
+    --mpirun)
+      mpirun_cmd="$2"
+      shift
+      ;;
+    --no-bind)
+      bind=0
+      ;;
+    -h|--help)
+      echo "$USAGE"
+      exit 0
+      ;;
+    *)
+      echo "$0: Unknown option: '$1'"
+      exit 2
+      ;;
+  esac
+  shift
+done
+
+if [ ! -x "$binary" ]; then
+  echo "$0: '${binary}' isn't an executable, build it with install.sh -D PARALLEL=ON"
+  exit 1
+fi
+
+# only Open MPI binding options are known, other launchers place ranks as they do
+if [ 0 -ne $bind ] && ! $mpirun_cmd --version 2>/dev/null | grep -q "Open MPI"; then
+  echo "$0: the launcher isn't Open MPI, ranks aren't bound"
+  bind=0
+fi
+
+out_dir="$(mktemp -d)" || exit $?
+trap 'rm -rf "$out_dir"' EXIT
+
+# prints the best wall time of the runs and the render time the root reports
+# in the best run
+run_layout() {
+  n_ranks=$1
+  n_threads=$2
+  schedule=$3
+
+  layout_options="-np ${n_ranks}"
+  if [ 0 -ne $bind ]; then
+    layout_options="${layout_options} --map-by slot:PE=${n_threads} --bind-to core"
+    layout_options="${layout_options} -x OMP_PLACES=cores -x OMP_PROC_BIND=close"
+  fi
+
+  best=""
+  for run in $(seq $n_runs); do
+    start=$(date +%s.%N)
+    $mpirun_cmd $layout_options "$binary" "$scenes" -o "${out_dir}/out#.png" \
+      -j $n_threads -s $schedule > "${out_dir}/log" 2>&1 || return 1
+    end=$(date +%s.%N)
+
+    wall=$(echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }')
+    if [ -z "$best" ] || [ $(echo "$wall $best" | awk '{ print ($1 < $2) }') -eq 1 ]; then
+      best=$wall
+      rendered=$(sed -n 's/^rendered in \([0-9.]*\) s$/\1/p' "${out_dir}/log" | awk '{ s += $1 } END { printf "%.3f", s }')
+    fi
+  done
+
+  printf "%6d x %-7d %-8s %10s s %12s s\n" $n_ranks $n_threads $schedule $best $rendered
+}
+
+echo "${scenes} on ${n_cores} cores, best of ${n_runs} runs"
+printf "%-16s %-8s %12s %14s\n" "ranks x threads" "schedule" "wall" "rendering"
+
+for n_threads in $(seq $n_cores); do
+  if [ 0 -ne $((n_cores % n_threads)) ]; then
+    continue
+  fi
+
+  for schedule in static dynamic; do
+    run_layout $((n_cores / n_threads)) $n_threads $schedule || {
+      echo "$0: $((n_cores / n_threads)) ranks x ${n_threads} threads failed:"
+      cat "${out_dir}/log"
+      exit 1
+    }
+  done
+done
+
+exit 0
@@ -1,7 +1,11 @@
 import glob
 import math
 import os
+import re
 import shutil
+import socket
+import struct
+import subprocess
 import sys
 import time
 
@@ -36,19 +40,65 @@ def report_success(target: str, flt_type: str, MPI_enabled: bool, time: str):
 
 
 
+# every scene or frame the case draws is checked against its golden image; a
+# case with 'expected_error' has no images, the run must fail with that message
+class image_case(test_ctx.test_case):
+    def __init__(self, test_task: str, check_files: list, test_res_files: list,
+                 downscale: int, threshold: float, expected_error: str):
+        super().__init__(test_task, check_files[0] if check_files else "",
+                         test_res_files[0] if test_res_files else "")
+        self.check_files = check_files
+        self.test_res_files = test_res_files
+        self.downscale = downscale
+        self.threshold = threshold
+        self.expected_error = expected_error
+
+
+
+# optional files of a case dir: 'output' holds the output template
+# ("output#.png" by default), 'args' holds extra options of the ray tracer,
+# 'downscale' holds the factor both images are scaled down by before they are
+# compared, so that the noise of random sampling (such as the ray roulette)
+# averages out, 'threshold' holds the largest difference of the images (0.01 by
+# default, 0 for pixel-exact ones), 'error' holds the message the ray tracer
+# must fail with; golden images are "output<n>.png" whatever the output format
+# is
+def read_case_file(case_dir: str, name: str, default: str):
+    path = case_dir + name
+    if not os.access(path, os.R_OK):
+        return default
+    with open(path) as case_file:
+        return case_file.read().strip()
+
+
+
+# "output<n>.png" -> "<n>"
+def get_image_number(check_file: str):
+    return os.path.basename(check_file)[len("output"):-len(".png")]
+
+
+
 def get_test_cases(ctx: test_ctx, target: str, MPI_enabled: bool, short_test: bool):
     cases = []
     target_path = ctx.install_dir + "/" + ctx.testing_module + "/" + target
     test_res_dir = ctx.test_tmp_dir + "/" + target + "/res"
-    case_dirs = glob.glob(ctx.test_dir + "/[0-9]*/")
+    case_dirs = sorted(glob.glob(ctx.test_dir + "/[0-9]*/"))
     for case_dir in case_dirs:
             test_tasks = []
             scenes = case_dir + "scenes.rtr"
-            output_template = "output#.png"
-            output = output_template.replace("#", "0")
-            check_file = case_dir + output
-            test_res_file = test_res_dir + "/" + output
+            output_template = read_case_file(case_dir, "output", "output#.png")
+            args = read_case_file(case_dir, "args", "")
+            downscale = int(read_case_file(case_dir, "downscale", "1"))
+            threshold = float(read_case_file(case_dir, "threshold", "0.01"))
+            expected_error = read_case_file(case_dir, "error", "")
+            check_files = sorted(glob.glob(case_dir + "output[0-9]*.png"))
+            if not check_files and not expected_error:
+                check_files = [case_dir + "output0.png"]
+            test_res_files = [test_res_dir + "/" + output_template.replace("#", get_image_number(check_file))
+                              for check_file in check_files]
             sequential_task = target_path + " " + scenes + " -o " + test_res_dir + "/" + output_template
+            if args:
+                sequential_task += " " + args
 
             if MPI_enabled:
                 nproc_arr = range((os.cpu_count() or 0) + 1)
@@ -66,22 +116,102 @@ def get_test_cases(ctx: test_ctx, target: str, MPI_enabled: bool, short_test: bo
                 test_tasks.append(sequential_task)
 
             for test_task in test_tasks:
-                cases.append(test_ctx.test_case(test_task, check_file, test_res_file))
+                cases.append(image_case(test_task, check_files, test_res_files,
+                                        downscale, threshold, expected_error))
     return cases
 
 
 
-def calc_diff(test_case: test_ctx.test_case):
-    with Image(filename=test_case.test_res_file) as res_img:
-        with Image(filename=test_case.check_file) as check_img:
+# QOI isn't known to every ImageMagick, so the test decodes it itself;
+# returns width, height and RGB bytes of the image
+def read_qoi(filename: str):
+    with open(filename, "rb") as qoi_file:
+        data = qoi_file.read()
+
+    if data[:4] != b"qoif" or data[-8:] != bytes([0] * 7 + [1]):
+        raise ValueError(filename + " isn't a QOI image")
+    width = int.from_bytes(data[4:8], "big")
+    height = int.from_bytes(data[8:12], "big")
+
+    pixel = [0, 0, 0, 255]
+    index = [[0, 0, 0, 0] for i in range(64)]
+    pixels = bytearray()
+    pos = 14
+    end = len(data) - 8
+    run = 0
+    for i in range(width * height):
+        if run > 0:
+            run -= 1
+        elif pos < end:
+            byte = data[pos]
+            pos += 1
+            if byte == 0xfe:
+                pixel = [data[pos], data[pos + 1], data[pos + 2], pixel[3]]
+                pos += 3
+            elif byte == 0xff:
+                pixel = list(data[pos:pos + 4])
+                pos += 4
+            elif byte >> 6 == 0:
+                pixel = list(index[byte])
+            elif byte >> 6 == 1:
+                pixel = [(pixel[0] + ((byte >> 4) & 3) - 2) & 0xff,
+                         (pixel[1] + ((byte >> 2) & 3) - 2) & 0xff,
+                         (pixel[2] + (byte & 3) - 2) & 0xff,
+                         pixel[3]]
+            elif byte >> 6 == 2:
+                dg = (byte & 0x3f) - 32
+                byte = data[pos]
+                pos += 1
+                pixel = [(pixel[0] + dg - 8 + (byte >> 4)) & 0xff,
+                         (pixel[1] + dg) & 0xff,
+                         (pixel[2] + dg - 8 + (byte & 0xf)) & 0xff,
+                         pixel[3]]
+            else:
+                run = byte & 0x3f
+            index[(pixel[0] * 3 + pixel[1] * 5 + pixel[2] * 7 + pixel[3] * 11) % 64] = list(pixel)
+        pixels += bytes(pixel[:3])
+
+    if pos != end:
+        raise ValueError(filename + " has " + str(end - pos) + " bytes after the pixels")
+    return width, height, bytes(pixels)
+
+
+
+def open_image(filename: str):
+    if filename.endswith(".qoi"):
+        width, height, pixels = read_qoi(filename)
+        return Image(blob=pixels, format="rgb", width=width, height=height, depth=8)
+    return Image(filename=filename)
+
+
+
+# box filter: every pixel becomes the mean of a 'factor' x 'factor' block
+def downscale_image(img: Image, factor: int):
+    if factor > 1:
+        img.resize(img.width // factor, img.height // factor, filter="box")
+
+
+
+def calc_image_diff(test_res_file: str, check_file: str, downscale: int, metrics_threshold: float):
+    if not os.access(test_res_file, os.R_OK):
+        return True, "file '" + test_res_file + "' wasn't written"
+
+    try:
+        res_img = open_image(test_res_file)
+    except ValueError as error:
+        return True, str(error)
+
+    with res_img:
+        with Image(filename=check_file) as check_img:
+            downscale_image(res_img, downscale)
+            downscale_image(check_img, downscale)
             diff_img, is_diff = res_img.compare(check_img,
                                                 metric='fuzz',
                                                 highlight='#fff',
                                                 lowlight='#000')
             diff_img_name = ""
-            metrics_threshold = 0.01
             if is_diff > metrics_threshold:
-                diff_img_name = os.path.splitext(test_case.test_res_file)[0] + "-diff.png"
+                diff_img_name = os.path.splitext(test_res_file)[0] + "-diff.png"
                 diff_img.save(filename=diff_img_name)
                 diff_msg = "diff metrics " + str(is_diff) + " with threshold " \
                         + str(metrics_threshold) \
@@ -92,25 +222,350 @@ def calc_diff(test_case: test_ctx.test_case):
 
 
 
+def calc_diff(test_case: image_case):
+    for test_res_file, check_file in zip(test_case.test_res_files, test_case.check_files):
+        fail, diff_msg = calc_image_diff(test_res_file, check_file, test_case.downscale,
+                                         test_case.threshold)
+        if fail:
+            return True, diff_msg
+    return False, ""
+
+
+
+# the pack of 'cache/scenes.rtr' is drawn from the text, then from the cache the
+# first run has written and then from the text again once it is edited; the
+# cache is written to a new file, so it has to keep its inode while the text is
+# the same and get a new one after the edit
+def test_pack_cache(ctx: test_ctx, target: str, MPI_enabled: bool, verbose: bool):
+    cache_case_dir = ctx.test_dir + "/cache/"
+    work_dir = ctx.test_tmp_dir + "/" + target + "/cache"
+    os.makedirs(work_dir, exist_ok=True)
+    scenes = work_dir + "/scenes.rtr"
+    cache_file = scenes + ".cache"
+    test_res_file = work_dir + "/output0.png"
+
+    test_task = ctx.install_dir + "/" + ctx.testing_module + "/" + target + " " \
+              + scenes + " -o " + work_dir + "/output#.png"
+    if MPI_enabled:
+        test_task = mpirun_cmd() + " " + test_task
+
+    if os.path.exists(cache_file):
+        os.remove(cache_file)
+
+    # scenes file to copy before the run (if any), golden image, what the run
+    # has to do with the cache
+    runs = [("scenes.rtr", "output0.png", "written"),
+            (None, "output0.png", "kept"),
+            ("edited.rtr", "edited0.png", "rebuilt")]
+    cache_id = None
+    for scenes_src, check_name, cache_action in runs:
+        check_file = cache_case_dir + check_name
+        test_case = test_ctx.test_case(test_task, check_file, test_res_file)
+        if scenes_src:
+            shutil.copyfile(cache_case_dir + scenes_src, scenes)
+        if os.path.exists(test_res_file):
+            os.remove(test_res_file)
+
+        if verbose:
+            print(colored("running: ", "blue") + colored(test_task, "cyan"))
+        if os.system(test_task):
+            test_case.diff = "'" + target + "' exited with non-zero return code"
+            return test_case
+
+        if not os.path.exists(cache_file):
+            test_case.diff = "cache '" + cache_file + "' wasn't written"
+            return test_case
+        cache_stat = os.stat(cache_file)
+        new_cache_id = (cache_stat.st_ino, cache_stat.st_mtime_ns)
+        if (new_cache_id == cache_id) != (cache_action == "kept"):
+            test_case.diff = "cache '" + cache_file + "' wasn't " + cache_action
+            return test_case
+        cache_id = new_cache_id
+
+        fail, test_case.diff = calc_image_diff(test_res_file, check_file, 1, 0.01)
+        if fail:
+            return test_case
+
+    return False
+
+
+
+# FNV-1a over 64-bit words and then over the bytes of the tail, as the pack
+# cache hashes files with
+def hash_file(filename: str):
+    with open(filename, "rb") as hashed_file:
+        data = hashed_file.read()
+
+    words_end = len(data) - len(data) % 8
+    file_hash = 14695981039346656037
+    for (word,) in struct.iter_unpack("=Q", data[:words_end]):
+        file_hash = ((file_hash ^ word) * 1099511628211) & 0xffffffffffffffff
+        file_hash ^= file_hash >> 32
+    for byte in data[words_end:]:
+        file_hash = ((file_hash ^ byte) * 1099511628211) & 0xffffffffffffffff
+    return file_hash
+
+
+
+# size, modification time and hash of the file, as the pack cache stamps it
+def stamp_file(filename: str):
+    file_stat = os.stat(filename)
+    return struct.pack("=QqqQ", file_stat.st_size, file_stat.st_mtime_ns // 10 ** 9,
+                       file_stat.st_mtime_ns % 10 ** 9, hash_file(filename))
+
+
+
+# the numbers of the vertices get more digits than the fast parser of OBJ
+# numbers takes, so strtod reads them: "1.5" -> "1.5000...", "-15E-1" ->
+# "-15.000...E-1"
+def pad_obj_numbers(obj_file: str, padded_file: str):
+    with open(obj_file) as src, open(padded_file, "w") as dst:
+        for line in src:
+            tokens = line.split()
+            if tokens and tokens[0] == "v":
+                numbers = []
+                for number in tokens[1:]:
+                    mantissa, exponent = re.match(r"([^eE]*)(.*)", number).groups()
+                    if "." not in mantissa:
+                        mantissa += "."
+                    numbers.append(mantissa + "0" * 24 + exponent)
+                line = " ".join(["v"] + numbers) + "\n"
+            dst.write(line)
+
+
+
+# the model of case 9 is loaded as it is, so its numbers go through the fast
+# parser (but the long ones), and then with the numbers padded for strtod; the
+# pack caches of both runs hold the vertices as they were read, so they must
+# be the same but the stamp of the model file
+def test_obj_numbers(ctx: test_ctx, target: str, MPI_enabled: bool, verbose: bool):
+    case_dir = ctx.test_dir + "/9/"
+    work_dir = ctx.test_tmp_dir + "/" + target + "/obj_numbers"
+    # the scenes file refers to the model by its path from the test dir
+    os.makedirs(work_dir + "/9", exist_ok=True)
+    model = work_dir + "/9/model.obj"
+    scenes = work_dir + "/scenes.rtr"
+    cache_file = scenes + ".cache"
+    shutil.copyfile(case_dir + "scenes.rtr", scenes)
+
+    test_task = ctx.install_dir + "/" + ctx.testing_module + "/" + target \
+              + " scenes.rtr -o output#.png"
+    if MPI_enabled:
+        test_task = mpirun_cmd() + " " + test_task
+    test_task = "cd " + work_dir + " && " + test_task
+    test_case = test_ctx.test_case(test_task, case_dir + "model.obj", cache_file)
+
+    caches = []
+    model_stamps = []
+    for write_model in [shutil.copyfile, pad_obj_numbers]:
+        write_model(case_dir + "model.obj", model)
+        if os.path.exists(cache_file):
+            os.remove(cache_file)
+
+        if verbose:
+            print(colored("running: ", "blue") + colored(test_task, "cyan"))
+        if os.system(test_task):
+            test_case.diff = "'" + target + "' exited with non-zero return code"
+            return test_case
+
+        with open(cache_file, "rb") as cache:
+            caches.append(cache.read())
+        model_stamps.append(stamp_file(model))
+
+    if caches[0].count(model_stamps[0]) != 1:
+        test_case.diff = "stamp of the model isn't found in '" + cache_file + "'"
+        return test_case
+    if caches[0].replace(model_stamps[0], model_stamps[1]) != caches[1]:
+        test_case.diff = "numbers of " + case_dir + "model.obj are read unlike strtod reads them"
+        return test_case
+
+    return False
+
+
+
+# the server listens once it has bound the socket, so connecting is retried
+# until then; returns None if the server has exited or the time is over
+def connect_to_server(server: subprocess.Popen, socket_path: str, timeout: float):
+    deadline = time.time() + timeout
+    while (time.time() < deadline) and (server.poll() is None):
+        if os.path.exists(socket_path):
+            client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            try:
+                client.connect(socket_path)
+                return client
+            except OSError:
+                client.close()
+        time.sleep(0.1)
+    return None
+
+
+
+# the render server gets the jobs of a client one after another: a job with
+# the size and the crop of the image, a job on a scenes file which doesn't
+# exist, which has to be answered with an error and keep the server running,
+# and 'quit'
+def test_server(ctx: test_ctx, target: str, MPI_enabled: bool, verbose: bool):
+    server_case_dir = ctx.test_dir + "/server/"
+    work_dir = ctx.test_tmp_dir + "/" + target + "/server"
+    os.makedirs(work_dir, exist_ok=True)
+    socket_path = work_dir + "/server.sock"
+    scenes = ctx.test_dir + "/3/scenes.rtr"
+    timeout = 60
+
+    test_task = ctx.install_dir + "/" + ctx.testing_module + "/" + target \
+              + " --serve " + socket_path
+    if MPI_enabled:
+        test_task = mpirun_cmd() + " " + test_task
+    test_case = test_ctx.test_case(test_task, server_case_dir, work_dir)
+
+    # job, golden image of the job (if any), start of the reply
+    jobs = [(scenes + " 0 " + work_dir + "/size.png size 160x90", "size.png", "done "),
+            (scenes + " 0 " + work_dir + "/crop.png size 160x90 crop 40 20 80x50", "crop.png", "done "),
+            (work_dir + "/missing.rtr 0 " + work_dir + "/missing.png", None, "error: can't load "),
+            ("quit", None, "bye")]
+
+    if os.path.exists(socket_path):
+        os.remove(socket_path)
+
+    if verbose:
+        print(colored("running: ", "blue") + colored(test_task, "cyan"))
+    server = subprocess.Popen(test_task, shell=True)
+    try:
+        client = connect_to_server(server, socket_path, timeout)
+        if not client:
+            test_case.diff = "'" + target + "' didn't listen on '" + socket_path + "'"
+            return test_case
+
+        client.settimeout(timeout)
+        with client, client.makefile("rw") as stream:
+            for job, check_name, reply_start in jobs:
+                if verbose:
+                    print(colored("job: ", "blue") + colored(job, "cyan"))
+                try:
+                    stream.write(job + "\n")
+                    stream.flush()
+                    reply = stream.readline().strip()
+                except OSError as error:
+                    test_case.diff = "job '" + job + "' got no reply: " + str(error)
+                    return test_case
+
+                if not reply.startswith(reply_start):
+                    test_case.diff = "job '" + job + "' got reply '" + reply + "' instead of '" \
+                                   + reply_start + "...'"
+                    return test_case
+
+                if check_name:
+                    test_res_file = job.split()[2]
+                    fail, test_case.diff = calc_image_diff(test_res_file, server_case_dir + check_name,
+                                                           1, 0.01)
+                    if fail:
+                        return test_case
+
+        if server.wait(timeout=timeout):
+            test_case.diff = "'" + target + "' exited with non-zero return code"
+            return test_case
+    except subprocess.TimeoutExpired:
+        test_case.diff = "'" + target + "' didn't stop after 'quit'"
+        return test_case
+    finally:
+        if server.poll() is None:
+            server.kill()
+            server.wait()
+
+    return False
+
+
+
+# the scenes of 'modes/scenes.rtr' are drawn in the modes which have no golden
+# images: progressively with a time limit, as a range of scenes with numbers
+# of two digits and as a batch of the whole pack; every run has to write the
+# images of its scenes only, and scene n is (32 + 4 n)x24
+def test_render_modes(ctx: test_ctx, target: str, MPI_enabled: bool, verbose: bool):
+    modes_case_dir = ctx.test_dir + "/modes/"
+    work_dir = ctx.test_tmp_dir + "/" + target + "/modes"
+    os.makedirs(work_dir, exist_ok=True)
+    # the cache of the pack is written next to the scenes file
+    scenes = work_dir + "/scenes.rtr"
+    shutil.copyfile(modes_case_dir + "scenes.rtr", scenes)
+
+    # options of the run, numbers of the scenes it has to draw
+    runs = [("-r 11 -t 0.5", [11]),
+            ("-r 9:10", [9, 10]),
+            ("-j 2", list(range(12)))]
+    for args, scene_numbers in runs:
+        test_task = ctx.install_dir + "/" + ctx.testing_module + "/" + target + " " \
+                  + scenes + " -o " + work_dir + "/output#.png " + args
+        if MPI_enabled:
+            test_task = mpirun_cmd() + " " + test_task
+        test_case = test_ctx.test_case(test_task, scenes, work_dir)
+
+        for test_res_file in glob.glob(work_dir + "/output*.png"):
+            os.remove(test_res_file)
+
+        if verbose:
+            print(colored("running: ", "blue") + colored(test_task, "cyan"))
+        if os.system(test_task):
+            test_case.diff = "'" + target + "' exited with non-zero return code"
+            return test_case
+
+        test_res_files = [work_dir + "/output" + str(n) + ".png" for n in scene_numbers]
+        written_files = glob.glob(work_dir + "/output*.png")
+        if sorted(written_files) != sorted(test_res_files):
+            test_case.diff = "images " + str(sorted(written_files)) + " were written instead of " \
+                           + str(sorted(test_res_files))
+            return test_case
+
+        for scene_number, test_res_file in zip(scene_numbers, test_res_files):
+            with open_image(test_res_file) as res_img:
+                size = (res_img.width, res_img.height)
+            if size != (32 + 4 * scene_number, 24):
+                test_case.diff = "image '" + test_res_file + "' is " + str(size[0]) + "x" \
+                               + str(size[1]) + " instead of " + str(32 + 4 * scene_number) + "x24"
+                return test_case
+
+    return False
+
+
+
 def test_target(ctx: test_ctx, target: str, MPI_enabled: bool, verbose: bool, short_test: bool):
     test_cases = get_test_cases(ctx, target, MPI_enabled, short_test)
     total_elapsed = 0
     for test_case in test_cases:
-        if not os.access(test_case.check_file, os.R_OK):
-            test_case.diff = __file__ + ": file '" + test_case.check_file + "' not found"
-            return test_case, "0"
+        for check_file in test_case.check_files:
+            if not os.access(check_file, os.R_OK):
+                test_case.diff = __file__ + ": file '" + check_file + "' not found"
+                return test_case, "0"
+
+        # images of the previous case mustn't pass for the ones of this one
+        for test_res_file in test_case.test_res_files:
+            if os.path.exists(test_res_file):
+                os.remove(test_res_file)
 
         if verbose:
             message = colored("running: ", "blue") + colored(test_case.test_task, "cyan")
             print(message)
 
         start = time.time()
-        returncode = os.system(test_case.test_task)
+        if test_case.expected_error:
+            run = subprocess.run(test_case.test_task, shell=True, stderr=subprocess.PIPE, text=True)
+            returncode = run.returncode
+        else:
+            returncode = os.system(test_case.test_task)
         elapsed = time.time() - start
         total_elapsed += elapsed
         if verbose:
             print(colored("elapsed time: ", "blue") + colored(str(elapsed) + "s", "yellow"))
 
+        if test_case.expected_error:
+            if not returncode:
+                test_case.diff = "'" + target + "' had to fail with '" + test_case.expected_error + "'"
+                return test_case, str(total_elapsed)
+            if test_case.expected_error not in run.stderr:
+                test_case.diff = "'" + target + "' didn't fail with '" + test_case.expected_error \
+                               + "', its errors:\n" + run.stderr
+                return test_case, str(total_elapsed)
+            continue
+
         if returncode:
             test_case.diff = "'" + target + "' exited with non-zero return code"
             return test_case, str(total_elapsed)
@@ -119,11 +574,18 @@ def test_target(ctx: test_ctx, target: str, MPI_enabled: bool, verbose: bool, sh
         if fail:
             return test_case, str(total_elapsed)
 
+    for test_func in [test_pack_cache, test_obj_numbers, test_server, test_render_modes]:
+        start = time.time()
+        test_case = test_func(ctx, target, MPI_enabled, verbose)
+        total_elapsed += time.time() - start
+        if test_case:
+            return test_case, str(total_elapsed)
+
     return False, str(total_elapsed)
 
 
 def test_config(ctx: test_ctx, flt_type: str, MPI_enable: bool, verbose: bool, short_test: bool):
-    ctx.set_build_task(["FLT_TYPE=" + flt_type, "PARALLEL=" + str(MPI_enable)])
+    ctx.set_build_task(["FLT_TYPE=" + flt_type, "PARALLEL=" + str(MPI_enable), "WITH_OBJ=ON"])
     flt_type = flt_type.lower()
     build_start = time.time()
     build = ctx.build(verbose=verbose)